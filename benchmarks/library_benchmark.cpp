@@ -0,0 +1,414 @@
+// Google Benchmark suite for the catalog: the ISBN and title indexes on their own and the
+// Library operations on top of them, on synthetic catalogs of 1K to 10M books, and the
+// sharded catalog from one shard up to one per core.
+//
+//   library_benchmark --benchmark_filter=Title
+//   LMS_BENCH_MAX_BOOKS=100000 library_benchmark   (stop at 100K books on small machines)
+//
+// Titles are generated in one of three orders: sorted (every insert lands at the right end
+// of the tree), random (a shuffled permutation of distinct titles) and skewed (a few popular
+// titles shared by many editions, as in a real catalog, so title lookups return long runs).
+#include <benchmark/benchmark.h>
+
+#include "library.h"
+
+using namespace std;
+
+enum TitleOrder { SORTED, RANDOM, SKEWED };
+
+// xorshift64, the same generator the console's search benchmark uses
+struct Xorshift {
+    uint64_t seed = 88172645463325252ULL;
+    uint64_t next() {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return seed;
+    }
+};
+
+// Zero-padded so that string order matches number order; short enough to stay in the
+// string's inline buffer
+string titleFor(size_t key) {
+    char text[24];  // Room for the widest size_t
+    snprintf(text, sizeof(text), "T%010zu", key);
+    return text;
+}
+
+string isbnFor(size_t i) { return to_string(9780000000000ULL + i); }
+
+// Title key of each book in insertion order
+vector<size_t> makeTitleKeys(size_t count, TitleOrder order) {
+    vector<size_t> keys(count);
+    if (order == SKEWED) {
+        // Log-uniform over [1, count]: key k is picked about 1/k as often as key 1
+        Xorshift random;
+        double logCount = log(double(count));
+        for (size_t& key : keys) key = size_t(exp(logCount * (random.next() >> 11) * 0x1.0p-53));
+        return keys;
+    }
+    for (size_t i = 0; i < count; ++i) keys[i] = i;
+    if (order == RANDOM) shuffle(keys.begin(), keys.end(), mt19937_64(42));
+    return keys;
+}
+
+// Synthetic catalog of pooled books. Only the most recently requested catalog is kept, so
+// the 10M runs never hold two of them (or a catalog and a loaded Library) at once.
+struct Catalog {
+    size_t count = 0;
+    TitleOrder order = SORTED;
+    ObjectPool<Book, 4096> pool;
+    vector<Book*> books;     // In insertion order
+    vector<Book*> byTitle;   // Sorted by (title, isbn), for bulkLoad
+};
+
+struct Fixture {
+    unique_ptr<Catalog> catalog;
+    unique_ptr<Library> library;
+    size_t libraryCount = 0;
+    size_t libraryShards = 1;
+    Session session;
+};
+
+Fixture& fixture() {
+    static Fixture shared;
+    return shared;
+}
+
+const Catalog& catalog(size_t count, TitleOrder order) {
+    Fixture& f = fixture();
+    if (f.catalog && f.catalog->count == count && f.catalog->order == order) return *f.catalog;
+    f.library.reset();
+    f.catalog.reset();
+    f.catalog.reset(new Catalog);
+    Catalog& c = *f.catalog;
+    c.count = count;
+    c.order = order;
+    vector<size_t> keys = makeTitleKeys(count, order);
+    c.books.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+        c.books.push_back(c.pool.create(titleFor(keys[i]), "Author " + to_string(keys[i] % 1000), isbnFor(i)));
+    c.byTitle = c.books;
+    sort(c.byTitle.begin(), c.byTitle.end(), [](const Book* a, const Book* b) {
+        int byTitle = a->title.compare(b->title);
+        return byTitle != 0 ? byTitle < 0 : a->isbn < b->isbn;
+    });
+    return c;
+}
+
+// Library with count books added through addBook, titles in random order
+Library& library(size_t count, Session*& session, size_t shards = 1) {
+    Fixture& f = fixture();
+    session = &f.session;
+    if (f.library && f.libraryCount == count && f.libraryShards == shards) return *f.library;
+    f.catalog.reset();
+    f.library.reset();
+    f.library.reset(new Library(shards));
+    f.libraryCount = count;
+    f.libraryShards = shards;
+    Library& l = *f.library;
+    l.setPasswordCost(1000);  // Hashing strength does not matter here
+    l.signUp("bench", "bench");
+    l.login(f.session, "bench", "bench");
+    l.setUndoDepth(1);        // The undo benchmark needs only the latest action
+    vector<size_t> keys = makeTitleKeys(count, RANDOM);
+    for (size_t i = 0; i < count; ++i)
+        l.addBook(f.session, titleFor(keys[i]), "Author " + to_string(keys[i] % 1000), isbnFor(i));
+    return l;
+}
+
+// 1K, 10K, ... up to 10M books, or up to LMS_BENCH_MAX_BOOKS
+void catalogSizes(benchmark::internal::Benchmark* b) {
+    size_t maxBooks = 10000000;
+    if (const char* cap = getenv("LMS_BENCH_MAX_BOOKS")) maxBooks = strtoull(cap, nullptr, 10);
+    for (size_t count = 1000; count <= maxBooks; count *= 10) b->Arg(int64_t(count));
+}
+
+// A fixed catalog of 1M books (or LMS_BENCH_MAX_BOOKS) split over 1, 2, 4, ... shards,
+// up to one per core
+void shardCounts(benchmark::internal::Benchmark* b) {
+    size_t books = 1000000;
+    if (const char* cap = getenv("LMS_BENCH_MAX_BOOKS")) books = min<size_t>(books, strtoull(cap, nullptr, 10));
+    size_t cores = max(1u, thread::hardware_concurrency());
+    for (size_t shards = 1;; shards *= 2) {
+        b->Args({int64_t(books), int64_t(min(shards, cores))});
+        if (shards >= cores) break;
+    }
+}
+
+// ---- ISBN index ----
+
+// Loads every book into an empty table (growing and migrating as it goes)
+void BM_IsbnInsert(benchmark::State& state) {
+    const Catalog& c = catalog(state.range(0), RANDOM);
+    for (auto _ : state) {
+        HashTable table;
+        for (Book* book : c.books) table.insert(book->isbn, book);
+        benchmark::DoNotOptimize(table.size());
+        state.PauseTiming();  // Freeing the table is not part of the load
+        table.clear();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * c.count);
+}
+
+// Lookups of ISBNs in the table, in random order, hits or misses
+void isbnSearch(benchmark::State& state, bool hit) {
+    const Catalog& c = catalog(state.range(0), RANDOM);
+    HashTable table;
+    for (Book* book : c.books) table.insert(book->isbn, book);
+    vector<string> keys(4096);
+    Xorshift random;
+    for (string& key : keys) key = isbnFor(random.next() % c.count + (hit ? 0 : c.count));
+    size_t i = 0;
+    for (auto _ : state) benchmark::DoNotOptimize(table.search(keys[i++ & 4095]));
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_IsbnSearchHit(benchmark::State& state) { isbnSearch(state, true); }
+void BM_IsbnSearchMiss(benchmark::State& state) { isbnSearch(state, false); }
+
+// The same hits looked up 16 at a time, with the slots prefetched ahead
+void BM_IsbnSearchBatch(benchmark::State& state) {
+    const Catalog& c = catalog(state.range(0), RANDOM);
+    HashTable table;
+    for (Book* book : c.books) table.insert(book->isbn, book);
+    vector<vector<string>> batches(256, vector<string>(16));
+    Xorshift random;
+    for (vector<string>& batch : batches)
+        for (string& key : batch) key = isbnFor(random.next() % c.count);
+    Book* results[16];
+    size_t i = 0;
+    for (auto _ : state) {
+        table.searchBatch(batches[i++ & 255], results);
+        benchmark::DoNotOptimize(results[0]);
+    }
+    state.SetItemsProcessed(state.iterations() * 16);
+}
+
+// Removes every book from a full table
+void BM_IsbnRemove(benchmark::State& state) {
+    const Catalog& c = catalog(state.range(0), RANDOM);
+    for (auto _ : state) {
+        state.PauseTiming();
+        HashTable table;
+        for (Book* book : c.books) table.insert(book->isbn, book);
+        state.ResumeTiming();
+        for (Book* book : c.books) table.remove(book->isbn);
+        benchmark::DoNotOptimize(table.size());
+    }
+    state.SetItemsProcessed(state.iterations() * c.count);
+}
+
+// ---- Title index ----
+
+// Inserts every book into an empty tree in the catalog's title order
+void BM_TitleInsert(benchmark::State& state, TitleOrder order) {
+    const Catalog& c = catalog(state.range(0), order);
+    for (auto _ : state) {
+        TitleIndex index;
+        for (Book* book : c.books) index.insert(book);
+        benchmark::DoNotOptimize(index.size());
+        state.PauseTiming();
+        index.clear();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * c.count);
+}
+
+// Builds the same tree from the sorted books in one pass
+void BM_TitleBulkLoad(benchmark::State& state, TitleOrder order) {
+    const Catalog& c = catalog(state.range(0), order);
+    TitleIndex index;
+    for (auto _ : state) {
+        index.bulkLoad(c.byTitle);
+        benchmark::DoNotOptimize(index.size());
+    }
+    state.SetItemsProcessed(state.iterations() * c.count);
+}
+
+// Lookups of titles of the catalog, picked the way the books were; in the skewed catalog a
+// popular title returns every edition of it
+void BM_TitleSearch(benchmark::State& state, TitleOrder order) {
+    const Catalog& c = catalog(state.range(0), order);
+    TitleIndex index;
+    index.bulkLoad(c.byTitle);
+    vector<const string*> titles(4096);
+    Xorshift random;
+    for (const string*& title : titles) title = &c.books[random.next() % c.count]->title;
+    size_t i = 0, found = 0;
+    for (auto _ : state) found += index.search(*titles[i++ & 4095]).size();
+    state.SetItemsProcessed(state.iterations());
+    state.counters["books/lookup"] = double(found) / double(state.iterations());
+}
+
+// Removes every book, in insertion order, from a full tree
+void BM_TitleRemove(benchmark::State& state, TitleOrder order) {
+    const Catalog& c = catalog(state.range(0), order);
+    for (auto _ : state) {
+        state.PauseTiming();
+        TitleIndex index;
+        index.bulkLoad(c.byTitle);
+        state.ResumeTiming();
+        for (Book* book : c.books) index.remove(book);
+        benchmark::DoNotOptimize(index.size());
+    }
+    state.SetItemsProcessed(state.iterations() * c.count);
+}
+
+// Full iteration in title order along the linked leaves, with forEach and with a cursor
+void BM_TitleForEach(benchmark::State& state) {
+    const Catalog& c = catalog(state.range(0), RANDOM);
+    TitleIndex index;
+    index.bulkLoad(c.byTitle);
+    for (auto _ : state) {
+        size_t available = 0;
+        index.forEach([&](const Book* book) { available += book->isAvailable(); });
+        benchmark::DoNotOptimize(available);
+    }
+    state.SetItemsProcessed(state.iterations() * c.count);
+}
+
+void BM_TitleCursor(benchmark::State& state) {
+    const Catalog& c = catalog(state.range(0), RANDOM);
+    TitleIndex index;
+    index.bulkLoad(c.byTitle);
+    for (auto _ : state) {
+        size_t available = 0;
+        for (TitleIndex::Cursor cursor = index.begin(); cursor.isValid(); cursor.next())
+            available += cursor.book()->isAvailable();
+        benchmark::DoNotOptimize(available);
+    }
+    state.SetItemsProcessed(state.iterations() * c.count);
+}
+
+// ---- Library ----
+
+// Issue and return of random books through the thread-safe API, loan and undo records included
+void BM_LibraryIssueReturn(benchmark::State& state) {
+    Session* session;
+    Library& l = library(state.range(0), session);
+    vector<string> isbns(4096);
+    Xorshift random;
+    for (string& isbn : isbns) isbn = isbnFor(random.next() % state.range(0));
+    size_t i = 0;
+    for (auto _ : state) {
+        const string& isbn = isbns[i++ & 4095];
+        benchmark::DoNotOptimize(l.issueBook(*session, isbn));
+        benchmark::DoNotOptimize(l.returnBook(*session, isbn));
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+// Undo and redo of an issue: the book goes back on the shelf and out again
+void BM_LibraryUndoRedo(benchmark::State& state) {
+    Session* session;
+    Library& l = library(state.range(0), session);
+    string isbn = isbnFor(state.range(0) / 2);
+    l.issueBook(*session, isbn);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(l.undo(*session));
+        benchmark::DoNotOptimize(l.redo(*session));
+    }
+    l.undo(*session);
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+// The whole catalog streamed in title order, 1000 books per chunk, as the listing does
+void BM_LibraryListAll(benchmark::State& state) {
+    Session* session;
+    Library& l = library(state.range(0), session);
+    for (auto _ : state) {
+        size_t available = 0;
+        l.listBooks(1000, ListFilter(), [&](const vector<BookInfo>& chunk) {
+            for (const BookInfo& book : chunk) available += book.isAvailable();
+        });
+        benchmark::DoNotOptimize(available);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// ---- Sharded catalog ----
+
+// Point lookups by ISBN, each routed to the one shard that owns it
+void BM_ShardedFindByIsbn(benchmark::State& state) {
+    Session* session;
+    Library& l = library(state.range(0), session, state.range(1));
+    vector<string> isbns(4096);
+    Xorshift random;
+    for (string& isbn : isbns) isbn = isbnFor(random.next() % state.range(0));
+    BookInfo info;
+    size_t i = 0;
+    for (auto _ : state) benchmark::DoNotOptimize(l.findByIsbn(isbns[i++ & 4095], info));
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Title lookups, scattered to every shard and merged
+void BM_ShardedFindByTitle(benchmark::State& state) {
+    Session* session;
+    Library& l = library(state.range(0), session, state.range(1));
+    vector<string> titles(4096);
+    Xorshift random;
+    for (string& title : titles) title = titleFor(random.next() % state.range(0));
+    size_t i = 0;
+    for (auto _ : state) benchmark::DoNotOptimize(l.findByTitle(titles[i++ & 4095]));
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Books by one author out of 1000, the shards scanned in parallel and merged in title order
+void BM_ShardedListAuthor(benchmark::State& state) {
+    Session* session;
+    Library& l = library(state.range(0), session, state.range(1));
+    ListFilter filter;
+    filter.author = "Author 7";
+    for (auto _ : state) {
+        size_t found = 0;
+        l.listBooks(1000, filter, [&](const vector<BookInfo>& chunk) { found += chunk.size(); });
+        benchmark::DoNotOptimize(found);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// The whole catalog streamed in title order across all shards
+void BM_ShardedListAll(benchmark::State& state) {
+    Session* session;
+    Library& l = library(state.range(0), session, state.range(1));
+    for (auto _ : state) {
+        size_t available = 0;
+        l.listBooks(1000, ListFilter(), [&](const vector<BookInfo>& chunk) {
+            for (const BookInfo& book : chunk) available += book.isAvailable();
+        });
+        benchmark::DoNotOptimize(available);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_IsbnInsert)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_IsbnSearchHit)->Apply(catalogSizes);
+BENCHMARK(BM_IsbnSearchMiss)->Apply(catalogSizes);
+BENCHMARK(BM_IsbnSearchBatch)->Apply(catalogSizes);
+BENCHMARK(BM_IsbnRemove)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_TitleInsert, sorted, SORTED)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_TitleInsert, random, RANDOM)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_TitleInsert, skewed, SKEWED)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_TitleBulkLoad, random, RANDOM)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_TitleSearch, sorted, SORTED)->Apply(catalogSizes);
+BENCHMARK_CAPTURE(BM_TitleSearch, random, RANDOM)->Apply(catalogSizes);
+BENCHMARK_CAPTURE(BM_TitleSearch, skewed, SKEWED)->Apply(catalogSizes);
+BENCHMARK_CAPTURE(BM_TitleRemove, sorted, SORTED)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_TitleRemove, random, RANDOM)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_TitleRemove, skewed, SKEWED)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_TitleForEach)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_TitleCursor)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+
+BENCHMARK(BM_LibraryIssueReturn)->Apply(catalogSizes);
+BENCHMARK(BM_LibraryUndoRedo)->Apply(catalogSizes);
+BENCHMARK(BM_LibraryListAll)->Apply(catalogSizes)->Unit(benchmark::kMillisecond);
+
+BENCHMARK(BM_ShardedFindByIsbn)->Apply(shardCounts)->ArgNames({"books", "shards"});
+BENCHMARK(BM_ShardedFindByTitle)->Apply(shardCounts)->ArgNames({"books", "shards"});
+BENCHMARK(BM_ShardedListAuthor)->Apply(shardCounts)->ArgNames({"books", "shards"})->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_ShardedListAll)->Apply(shardCounts)->ArgNames({"books", "shards"})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -1,494 +1,609 @@
-#include <iostream>
-#include <string>
-using namespace std;
+#include "library.h"
+#include <sstream>
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#endif
 
-const int TABLE_SIZE = 100; // Hash table size
-class Book  // Class for a Book
-{
-    public:
-    string title, author, isbn;                
-    bool isAvailable; // Availability status
-    Book(string t, string a, string i, bool available = true) 
-	: title(t), author(a), isbn(i), isAvailable(available) {}
-};
-
-class TreeNode {  // Node for Binary Search Tree (BST)
-public:
-    Book* book;  // Pointer to a Book object
-    TreeNode* left = nullptr;  // Pointer to the left child node
-    TreeNode* right = nullptr; // Pointer to the right child node
-    TreeNode(Book* b) : book(b) {}
-};
-
-//Hash Table Implementation
-class HashNode {
-    public:
-    string key; //Key used in the hash table (ISBN of the book)
-    Book* book;                               
-    HashNode* next = nullptr; //Pointer to the next node in the linked list for collision handling
-    HashNode(string k, Book* b) : key(k), book(b) {}
-};
-
-class HashTable {                           
+// Output collected in memory and handed to the file one block at a time, so a long listing
+// costs one write per block instead of one per line
+class OutputBuffer {
     private:
-    HashNode* table[TABLE_SIZE] = {nullptr}; //Array of hash nodes
-    int hashFunction(const string& key) {   // Hash function to calculate index from ISBN
-        int hash = 0;
-        for (char c : key) hash = (hash * 31 + c) % TABLE_SIZE; // Compute hash value using a prime number
-        return hash;
-    }
+    FILE* file;
+    string* sink;  // Without a file, output is appended here instead (server connections)
+    string block;
+    size_t blockSize;
 
     public:
-    void insert(const string& key, Book* book) { // Insert a book into the hash table using its ISBN 
-        int index = hashFunction(key);                
-        HashNode* newNode = new HashNode(key, book); // Create a new hash node with the key and book
-        newNode->next = table[index];   //Point the next pointer of the new node to the current head
-        table[index] = newNode;         //Insert the new node at the head of the list
-    }
-    Book* search(const string& key) {  // Search for a book by ISBN in the hash table
-        int index = hashFunction(key);               
-        for (HashNode* current = table[index]; current; current = current->next) // Traverse the linked list at index
-            if (current->key == key) return current->book;   // Return book if key matches
-        return nullptr;   // Return nullptr if book is not found
-    }
-
-    void remove(const string& key) {
-    int index = hashFunction(key); // Compute the hash index for the given key
-    HashNode* current = table[index];
-    HashNode* prev = nullptr;
-
-    while (current) {
-        if (current->key == key) { // Found the node with the matching key
-            if (prev) {
-                prev->next = current->next; // Update the previous node's 'next' pointer
-            } 
-			else {
-                table[index] = current->next; // Update the head of the linked list
-            }
-            delete current; // Free memory for the removed node
+    OutputBuffer(FILE* f, size_t size = 64 * 1024) : file(f), sink(nullptr), blockSize(size) { block.reserve(size); }
+    explicit OutputBuffer(string& target) : file(nullptr), sink(&target), blockSize(0) {}
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+    ~OutputBuffer() { flush(); }
+
+    void write(string_view text) {
+        if (sink) {
+            sink->append(text.data(), text.size());
             return;
         }
-        prev = current;       // Move the 'prev' pointer to the current node
-        current = current->next; // Move to the next node in the list
-       }
+        block.append(text.data(), text.size());
+        if (block.size() >= blockSize) flush();
+    }
+
+    void flush() {
+        if (!file) return;
+        if (!block.empty()) fwrite(block.data(), 1, block.size(), file);
+        block.clear();
+        fflush(file);
     }
 };
 
-// Custom Queue Implementation
-class QueueNode {
-    public:
-    Book* book; // Pointer to a Book object stored in this queue node
-    QueueNode* next = nullptr; // Pointer to the next node in the queue, initialized to nullptr
+inline const char* outcomeName(Outcome outcome) {
+    switch (outcome) {
+        case Outcome::Done: return "Done";
+        case Outcome::Duplicate: return "Duplicate";
+        case Outcome::NotFound: return "NotFound";
+        case Outcome::NotAvailable: return "NotAvailable";
+        case Outcome::Held: return "Held";
+        case Outcome::NotIssued: return "NotIssued";
+        case Outcome::NothingToUndo: return "NothingToUndo";
+        case Outcome::NothingToRedo: return "NothingToRedo";
+        case Outcome::Conflict: return "Conflict";
+        case Outcome::NotLoggedIn: return "NotLoggedIn";
+        case Outcome::InvalidCredentials: return "InvalidCredentials";
+        case Outcome::CannotOpen: return "CannotOpen";
+        case Outcome::Corrupt: return "Corrupt";
+        case Outcome::Invalid: return "Invalid";
+    }
+    return "Unknown";
+}
 
-    // Constructor to initialize the node with a Book pointer
-    QueueNode(Book* b) : book(b) {}
-};
+// Calendar date (UTC) of a time in seconds since the epoch, as YYYY-MM-DD
+inline string formatDate(int64_t seconds) {
+    int64_t days = (seconds >= 0 ? seconds : seconds - 86399) / 86400;
+    // Civil date from a day count (era-based conversion of the proleptic Gregorian calendar)
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t dayOfEra = z - era * 146097;
+    int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int64_t monthIndex = (5 * dayOfYear + 2) / 153;
+    int64_t day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    int64_t month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    int64_t year = yearOfEra + era * 400 + (month <= 2);
+    char text[64];
+    snprintf(text, sizeof text, "%04lld-%02lld-%02lld", static_cast<long long>(year), static_cast<long long>(month),
+             static_cast<long long>(day));
+    return text;
+}
 
-class CustomQueue {
-    private:
-    QueueNode* front = nullptr; // Pointer to the front node
-    QueueNode* rear = nullptr;  // Pointer to the rear node
+// Turns results into output. status() reports the result of one command, book() one record
+// of a listing; nothing is written until the buffer fills or flush() is called.
+class Renderer {
+    protected:
+    OutputBuffer& out;
 
     public:
-    // Adds a new book to the rear of the queue
-    void enqueue(Book* book) {
-        QueueNode* newNode = new QueueNode(book); // Create a new node with the book
-        if (!rear) // If the queue is empty, both front and rear point to the new node
-            front = rear = newNode;
-        else 
-            rear = rear->next = newNode; // Otherwise, add the new node to the rear
-    }
-
-    // Removes and returns the book from the front of the queue
-    Book* dequeue() {
-        if (!front) return nullptr; // Return nullptr if the queue is empty
-        QueueNode* temp = front;    // Temporary pointer to the front node
-        front = front->next;        // Move the front pointer to the next node
-        if (!front) rear = nullptr; // If the queue is now empty, set rear to nullptr
-        Book* book = temp->book;    // Get the book from the removed node
-        delete temp;                // Delete the removed node
-        return book;                // Return the book
-    }
-
-    // Checks if the queue is empty
-    bool isEmpty() const { return !front; }
+    Renderer(OutputBuffer& o) : out(o) {}
+    virtual ~Renderer() {}
+    virtual void heading() {}                   // Start of a new screen (console only)
+    virtual void prompt(const string&) {}       // Request for input (console only)
+    virtual void status(Outcome outcome, const string& message) = 0;
+    virtual void book(const BookInfo& book) = 0;
+    virtual void loan(const LoanInfo& loan) = 0;
+    void books(const vector<BookInfo>& chunk) {
+        for (const BookInfo& record : chunk) book(record);
+    }
+    void loans(const vector<LoanInfo>& chunk) {
+        for (const LoanInfo& record : chunk) loan(record);
+    }
+    // Where the next page of a listing starts
+    virtual void cursor(const ListCursor& next) {
+        status(Outcome::Done, "More books after: " + next.title + "\t" + next.isbn);
+    }
+    void flush() { out.flush(); }
 };
 
+// The text console the program has always shown. Screens are cleared with an ANSI escape
+// sequence, and only when the output is a terminal; batch runs leave out the headings.
+class ConsoleRenderer : public Renderer {
+    private:
+    bool clearScreen, headings;
 
-// User Class
-class User {
-public:
-    string username; //string to store username
-    string password; //string to store password
+    public:
+    ConsoleRenderer(OutputBuffer& o, bool clear, bool showHeadings = true)
+        : Renderer(o), clearScreen(clear), headings(showHeadings) {}
 
-    User(string u, string p) : username(u), password(p) {}
-};
+    void heading() override {
+        if (!headings) return;
+        if (clearScreen) out.write("\x1b[2J\x1b[H");
+        out.write("\t\t\t\t\t\t\t\t\tLibrary Management System\n");
+    }
 
-// Hash Table for Users
-class UserHashTable {
-private:
-    User* table[TABLE_SIZE] = {nullptr}; // Hash table to store User objects
+    void prompt(const string& text) override {
+        out.write(text);
+        out.flush();  // The user has to see it before typing
+    }
 
-    // Hash function to compute an index based on username
-    int hashFunction(const string& key) {
-        int hash = 0;
-        for (char c : key) 
-            hash = (hash * 31 + c) % TABLE_SIZE; // Compute hash value
-        return hash; // Return the computed index 
+    void status(Outcome, const string& message) override {
+        out.write(message);
+        out.write("\n");
     }
 
-public:
-    // Inserts a new User object into the hash table
-    void insert(const string& username, const string& password) {
-        int index = hashFunction(username); // Compute the index using the hash function
-        table[index] = new User(username, password); // Store a new User object at the computed index
+    void book(const BookInfo& book) override {
+        out.write("Title: ");
+        out.write(book.title);
+        out.write(", Author: ");
+        out.write(book.author);
+        out.write(", ISBN: ");
+        out.write(book.isbn);
+        out.write(book.isAvailable() ? ", Available: Yes" : ", Available: No");
+        if (book.copies > 1) out.write(" (" + to_string(book.available) + " of " + to_string(book.copies) + " copies)");
+        if (book.holds) out.write(", Holds: " + to_string(book.holds));
+        out.write("\n");
     }
 
-    // Searches for a User object in the hash table based on the username
-    User* search(const string& username) {
-        int index = hashFunction(username); // Compute the index using the hash function
-        // Check if a User exists at the index and if the username matches
-        return table[index] && table[index]->username == username ? table[index] : nullptr;
+    void loan(const LoanInfo& loan) override {
+        out.write("Title: ");
+        out.write(loan.title);
+        out.write(", ISBN: ");
+        out.write(loan.isbn);
+        out.write(", Reader: ");
+        out.write(loan.username);
+        out.write(", Due: ");
+        out.write(formatDate(loan.due));
+        out.write(loan.overdue ? " (overdue)\n" : "\n");
     }
 };
 
+// One JSON object per line: {"type":"status",...} for results, {"type":"book",...} for records
+class JsonLinesRenderer : public Renderer {
+    private:
+    void quoted(string_view text) {
+        static const char hex[] = "0123456789abcdef";
+        out.write("\"");
+        size_t plain = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            unsigned char c = text[i];
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+            out.write(text.substr(plain, i - plain));
+            if (c == '"') out.write("\\\"");
+            else if (c == '\\') out.write("\\\\");
+            else if (c == '\n') out.write("\\n");
+            else if (c == '\t') out.write("\\t");
+            else {
+                char escaped[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                out.write(string_view(escaped, sizeof escaped));
+            }
+            plain = i + 1;
+        }
+        out.write(text.substr(plain));
+        out.write("\"");
+    }
 
-// Undo Stack Implementation
-class UndoNode {
-public:
-    string action;    // The action to be undone
-    string isbn;      // The ISBN associated with the action
-    UndoNode* next = nullptr; // Pointer to the next node in the stack
-
-    // Constructor to initialize an UndoNode with an action and ISBN
-    UndoNode(const string& a, const string& i = "") : action(a), isbn(i) {}
-};
+    public:
+    JsonLinesRenderer(OutputBuffer& o) : Renderer(o) {}
 
-class UndoStack {
-private:
-    UndoNode* top = nullptr; // Pointer to the top node of the stack
+    void status(Outcome outcome, const string& message) override {
+        out.write("{\"type\":\"status\",\"outcome\":\"");
+        out.write(outcomeName(outcome));
+        out.write("\",\"message\":");
+        quoted(message);
+        out.write("}\n");
+    }
 
-public:
-    // Pushes a new undo action onto the stack
-    void push(const string& action, const string& isbn = "") {
-        UndoNode* newNode = new UndoNode(action, isbn); // Create a new node with action and ISBN
-        newNode->next = top; // Link the new node to the current top node
-        top = newNode;       // Update the top pointer to the new node
+    void book(const BookInfo& book) override {
+        out.write("{\"type\":\"book\",\"title\":");
+        quoted(book.title);
+        out.write(",\"author\":");
+        quoted(book.author);
+        out.write(",\"isbn\":");
+        quoted(book.isbn);
+        out.write(book.isAvailable() ? ",\"available\":true" : ",\"available\":false");
+        out.write(",\"copies\":" + to_string(book.copies) + ",\"availableCopies\":" + to_string(book.available) +
+                  ",\"holds\":" + to_string(book.holds) + "}\n");
     }
 
-    // Removes and returns the top undo action from the stack
-    UndoNode* pop() {
-        if (!top) return nullptr; // If the stack is empty, return nullptr
-        UndoNode* temp = top;     // Temporarily store the current top node
-        top = top->next;          // Update the top pointer to the next node
-        return temp;              // Return the removed node
+    void loan(const LoanInfo& loan) override {
+        out.write("{\"type\":\"loan\",\"title\":");
+        quoted(loan.title);
+        out.write(",\"isbn\":");
+        quoted(loan.isbn);
+        out.write(",\"reader\":");
+        quoted(loan.username);
+        out.write(",\"due\":\"" + formatDate(loan.due) + "\",\"dueTime\":" + to_string(loan.due));
+        out.write(loan.overdue ? ",\"overdue\":true}\n" : ",\"overdue\":false}\n");
     }
 
-    // Checks if the stack is empty
-    bool isEmpty() const {
-        return top == nullptr; // Returns true if the stack has no nodes
+    void cursor(const ListCursor& next) override {
+        out.write("{\"type\":\"cursor\",\"title\":");
+        quoted(next.title);
+        out.write(",\"isbn\":");
+        quoted(next.isbn);
+        out.write("}\n");
     }
 };
 
-// Library Management System Class
-class Library {
+// Books as CSV rows (with a header row first), in the format importCatalog reads back;
+// loans and status messages get their own header rows. A new header row starts each change
+// of table, so a script can split the output on them.
+class CsvRenderer : public Renderer {
     private:
-    TreeNode* root = nullptr; // Root node of BST 
-    HashTable isbnTable;      // Hash table for ISBN-based book lookup    
-    CustomQueue issueQueue;   // Queue for managing issued books    
-    UserHashTable userTable;  // Hash table for storing user information  
-    string currentUser;       // Currently logged-in user  
-    UndoStack undoStack;      // Stack for undoing actions
-    
-    class AddedBookNode {    // Linked list to track added books for undo
-        public:
-		Book* book;
-        AddedBookNode* next;
-        AddedBookNode(Book* b) : book(b), next(nullptr) {}
-    };
-    AddedBookNode* addedBooksHead = nullptr;
+    const char* header = nullptr; // Header row of the table being written
 
-    //function to insert a book into the BST
-    TreeNode* insertIntoBST(TreeNode* node, Book* book) {
-        if (!node) return new TreeNode(book);  // Create new node if the current is null
-        if (book->title < node->book->title)  // Recursively insert into the left or right subtree
-            node->left = insertIntoBST(node->left, book);
-        else
-            node->right = insertIntoBST(node->right, book);
-        return node;
+    void table(const char* columns) {
+        if (header == columns) return;
+        out.write(columns);
+        header = columns;
     }
 
-    //function to remove a book from the BST
-    TreeNode* removeFromBST(TreeNode* root, const string& title) {
-        if (!root) return root;  // return if empty tree
-        if (title < root->book->title) {  
-            root->left = removeFromBST(root->left, title);
-        } else if (title > root->book->title) {
-            root->right = removeFromBST(root->right, title);
-        } else {
-            // Node with only one child or no child
-            if (!root->left) {
-                TreeNode* temp = root->right;
-                delete root;
-                return temp;
-            } else if (!root->right) {
-                TreeNode* temp = root->left;
-                delete root;
-                return temp;
-            }
-            // Node with two children: find in-order successor
-            TreeNode* temp = minValueNode(root->right);
-            root->book = temp->book; 
-            root->right = removeFromBST(root->right, temp->book->title);  // Delete successor
+    void field(string_view text) {
+        if (text.find_first_of(",\"\r\n") == string_view::npos) {
+            out.write(text);
+            return;
+        }
+        out.write("\"");
+        for (size_t quote; (quote = text.find('"')) != string_view::npos; text.remove_prefix(quote + 1)) {
+            out.write(text.substr(0, quote + 1));
+            out.write("\"");  // Quotes inside a field are doubled
         }
-        return root;
+        out.write(text);
+        out.write("\"");
     }
 
-    //function to find the node with the smallest value in a subtree
-    TreeNode* minValueNode(TreeNode* node) {
-        TreeNode* current = node;
-        while (current && current->left) {
-            current = current->left;
-        }
-        return current;
+    public:
+    CsvRenderer(OutputBuffer& o) : Renderer(o) {}
+
+    void status(Outcome outcome, const string& message) override {
+        static const char columns[] = "outcome,message\n";
+        table(columns);
+        out.write(outcomeName(outcome));
+        out.write(",");
+        field(message);
+        out.write("\n");
     }
 
-    //function to search for a book in the BST by title
-    TreeNode* searchInBST(TreeNode* node, const string& title) {
-        if (!node || node->book->title == title)
-            return node;  // return if book found or tree is empty
-        if (title < node->book->title)
-            return searchInBST(node->left, title);
-        return searchInBST(node->right, title);
+    void book(const BookInfo& book) override {
+        static const char columns[] = "title,author,isbn,available,copies\n";
+        table(columns);
+        field(book.title);
+        out.write(",");
+        field(book.author);
+        out.write(",");
+        field(book.isbn);
+        out.write("," + to_string(book.available) + "," + to_string(book.copies) + "\n");
     }
 
-    //function to perform in-order traversal of the BST
-    void inOrder(TreeNode* node) {
-        if (!node) return;
-        inOrder(node->left);
-        cout << "Title: " << node->book->title << ", Author: " << node->book->author
-             << ", ISBN: " << node->book->isbn << ", Available: "
-             << (node->book->isAvailable ? "Yes" : "No") << endl;
-        inOrder(node->right);
+    void loan(const LoanInfo& loan) override {
+        static const char columns[] = "title,isbn,reader,due,overdue\n";
+        table(columns);
+        field(loan.title);
+        out.write(",");
+        field(loan.isbn);
+        out.write(",");
+        field(loan.username);
+        out.write("," + formatDate(loan.due) + (loan.overdue ? ",1\n" : ",0\n"));
     }
+};
 
-    //function to remove a book from the hash table
-    void removeFromHashTable(const string& isbn) {
-        isbnTable.remove(isbn);
+// Console front end: reads commands, runs them through the Library API for one session and
+// hands the results to a renderer. The interactive mode shows the menus; batch mode reads
+// one command per line (fields separated by tabs) and never prompts.
+class LibraryConsole {
+    private:
+    Library& library;
+    Renderer& render;
+    istream& in;
+    Session session;  // The user logged in at this console
+    bool remote;      // Serving a network client: no commands that reach the server's files
+
+    string ask(const string& text) {
+        render.prompt(text);
+        string line;
+        getline(in, line);
+        return line;
     }
 
-    //function to track added books for undo operations
-    void addToAddedBooks(Book* book) {
-        AddedBookNode* newNode = new AddedBookNode(book);
-        newNode->next = addedBooksHead;
-        addedBooksHead = newNode;
+    void screen(Outcome outcome, const string& message) {
+        render.heading();
+        render.status(outcome, message);
     }
 
-public:
-    // Constructor
-    Library() {}
+    public:
+    LibraryConsole(Library& l, Renderer& r, istream& input, bool remoteClient = false)
+        : library(l), render(r), in(input), remote(remoteClient) {}
+
+    // Reports what opening storage found; false if the library cannot be used
+    bool reportStorage(const StorageSummary& storage) {
+        if (storage.outcome == Outcome::CannotOpen)
+            render.status(storage.outcome, "Could not open " + storage.path + ".");
+        else if (storage.outcome == Outcome::Corrupt)
+            render.status(storage.outcome, "Snapshot " + storage.path + " is corrupt or from an incompatible version.");
+        else if (!storage.path.empty())
+            render.status(storage.outcome, "Loaded " + to_string(storage.books) + " books and " + to_string(storage.users) +
+                                               " users from " + storage.path + ".");
+        if (storage.outcome == Outcome::Done && storage.replayed)
+            render.status(storage.outcome, "Recovered " + to_string(storage.replayed) + " operations from the log.");
+        render.flush();
+        return storage.outcome == Outcome::Done;
+    }
 
     // Register a new user
     void registerUser(const string& username, const string& password) {
-        if (userTable.search(username)) {  // Check if username already exists
-            printHeading();
-            cout << "Username already exists. Please choose a different username.\n";
-            return;
-        }
-        userTable.insert(username, password);  // Add new user
-        printHeading();
-        cout << "User registered successfully!\n";
+        if (library.signUp(username, password) == Outcome::Duplicate)  // Check if username already exists
+            screen(Outcome::Duplicate, "Username already exists. Please choose a different username.");
+        else
+            screen(Outcome::Done, "User registered successfully!");
     }
 
     // User login functionality
     bool loginUser(const string& username, const string& password) {
-        User* user = userTable.search(username);
-        if (!user || user->password != password) {  // Validate username and password
-            printHeading();
-            cout << "Invalid username or password.\n";
-            return false;
-        }
-        currentUser = username;  // Set the current user
-        printHeading();
-        cout << "Login successful! Welcome, " << username << ".\n";
-        return true;
+        Outcome outcome = library.login(session, username, password);
+        screen(outcome, outcome == Outcome::Done ? "Login successful! Welcome, " + username + "." : "Invalid username or password.");
+        return outcome == Outcome::Done;
     }
 
     // User logout functionality
     void logoutUser() {
-        if (currentUser.empty()) {  // Check if any user is logged in
-            printHeading();
-            cout << "No user is currently logged in.\n";
+        if (!session.isLoggedIn()) {  // Check if any user is logged in
+            screen(Outcome::NotLoggedIn, "No user is currently logged in.");
             return;
         }
-        printHeading();
-        cout << "User " << currentUser << " logged out successfully.\n";
-        currentUser.clear();  // Clear the current user
+        screen(Outcome::Done, "User " + session.username + " logged out successfully.");
+        library.logout(session);  // Clear the current user
     }
 
     // Add a new book to the library
-    void addBook(const string& title, const string& author, const string& isbn, bool isAvailable = true) {
-        Book* newBook = new Book(title, author, isbn, isAvailable);  // Create a new book object
-        root = insertIntoBST(root, newBook);  // Insert the book into the BST
-        isbnTable.insert(isbn, newBook);  // Add the book to the hash table
-        addToAddedBooks(newBook);  // Track the book for undo operations
-        undoStack.push("addBook", isbn);  // Push the action to the undo stack
-        printHeading();
-        cout << "Book added successfully!\n";
-    }
-
-    // Display all books in the library
-    void displayAllBooks() {
-        if (!root) {  // Check if the library is empty
-            printHeading();
-            cout << "No books available in the library.\n";
+    void addBook(const string& title, const string& author, const string& isbn, uint32_t copies = 1) {
+        Outcome outcome = library.addBook(session, title, author, isbn, copies);
+        if (outcome == Outcome::NotLoggedIn) screen(outcome, "Please log in first.");
+        else if (outcome == Outcome::Duplicate) screen(outcome, "Book with ISBN " + isbn + " already exists.");
+        else if (outcome == Outcome::Invalid) screen(outcome, "A book needs at least one copy.");
+        else screen(outcome, "Book added successfully!");
+    }
+
+    // Display all books in the library that pass the filter, streamed in chunks
+    void displayAllBooks(const ListFilter& filter) {
+        render.heading();
+        if (!library.bookCount()) {  // Check if the library is empty
+            render.status(Outcome::NotFound, "No books available in the library.");
             return;
         }
-        printHeading();
-        cout << "Books in the library:\n";
-        inOrder(root);  // Perform in-order traversal of the BST
+        render.status(Outcome::Done, "Books in the library:");
+        library.listBooks(1024, filter, [this](const vector<BookInfo>& chunk) { render.books(chunk); });
     }
 
-    // Search for a book by its title
+    // Display the catalog a page at a time, starting after the cursor. Interactively, Enter
+    // shows the next page; batch mode shows one page and the cursor to continue from.
+    void displayPage(ListCursor cursor, size_t pageSize, const ListFilter& filter, bool interactive) {
+        vector<BookInfo> page;
+        for (size_t shown = 0;;) {
+            bool more;
+            if (library.listPage(cursor, pageSize, filter, page, cursor, more) == Outcome::Invalid) {
+                screen(Outcome::Invalid, "The page size must be a positive number.");
+                return;
+            }
+            if (page.empty() && !shown) {
+                screen(Outcome::NotFound, "No books available in the library.");
+                return;
+            }
+            screen(Outcome::Done, "Books " + to_string(shown + 1) + "-" + to_string(shown + page.size()) + ":");
+            render.books(page);
+            shown += page.size();
+            if (!more) return;
+            if (!interactive) {
+                render.cursor(cursor);
+                return;
+            }
+            if (!ask("Press Enter for more books, or q to stop: ").empty() || !in) return;
+        }
+    }
+
+    // Search for every edition with the given title
     void searchBookByTitle(const string& title) {
-        TreeNode* result = searchInBST(root, title);  // Search the BST
-        if (result) {
-            printHeading();
-            cout << "Book Found:\n"
-                 << "Title: " << result->book->title << ", Author: " << result->book->author
-                 << ", ISBN: " << result->book->isbn << ", Available: "
-                 << (result->book->isAvailable ? "Yes" : "No") << endl;
-        } else {
-            printHeading();
-            cout << "No book found with title: " << title << endl;
+        vector<BookInfo> results = library.findByTitle(title);
+        if (results.empty()) {
+            screen(Outcome::NotFound, "No book found with title: " + title);
+            return;
         }
+        screen(Outcome::Done, results.size() == 1 ? "Book Found:" : "Books Found:");
+        render.books(results);
     }
 
-    // Issue a book to a user
-    void issueBook(const string& isbn) {
-        Book* book = isbnTable.search(isbn);  // Search for the book by ISBN
-        if (!book) {
-            printHeading();
-            cout << "Book with ISBN " << isbn << " not found.\n";
-        } else if (book->isAvailable) {
-            book->isAvailable = false;  // Mark the book as unavailable
-            issueQueue.enqueue(book);  // Add the book to the issue queue
-            undoStack.push("issueBook", isbn);  // Push the action to the undo stack
-            printHeading();
-            cout << "Book issued successfully!\n";
-        } else {
-            printHeading();
-            cout << "Book is not available.\n";
+    // Search titles and authors and show one page of results. Interactively, Enter shows the
+    // next page; batch mode shows the requested page only.
+    void searchCatalog(const string& query, size_t offset, size_t pageSize, bool interactive) {
+        vector<BookInfo> page;
+        for (;; offset += pageSize) {
+            size_t total = library.searchBooks(query, offset, pageSize, page);
+            if (!total) {
+                screen(Outcome::NotFound, "No books match: " + query);
+                return;
+            }
+            if (page.empty()) {
+                screen(Outcome::Done, "No more results (" + to_string(total) + " in total).");
+                return;
+            }
+            screen(Outcome::Done, "Results " + to_string(offset + 1) + "-" + to_string(offset + page.size()) + " of " +
+                                      to_string(total) + ":");
+            render.books(page);
+            if (!interactive || offset + page.size() >= total) return;
+            if (!ask("Press Enter for more results, or q to stop: ").empty() || !in) return;
         }
     }
 
+    // Issue a book to a user, or put the user in the hold queue if every copy is out
+    void issueBook(const string& isbn) {
+        size_t position = 0;
+        Outcome outcome = library.issueBook(session, isbn, &position);
+        if (outcome == Outcome::NotLoggedIn) screen(outcome, "Please log in first.");
+        else if (outcome == Outcome::NotFound) screen(outcome, "Book with ISBN " + isbn + " not found.");
+        else if (outcome == Outcome::Done) screen(outcome, "Book issued successfully!");
+        else if (outcome == Outcome::Held)
+            screen(outcome, "Book is not available. You are number " + to_string(position) + " in the hold queue.");
+        else if (outcome == Outcome::Duplicate)
+            screen(outcome, "Book is not available. You are already number " + to_string(position) + " in the hold queue.");
+        else screen(outcome, "Book is not available.");
+    }
+
     // Return a book to the library
     void returnBook(const string& isbn) {
-        Book* book = isbnTable.search(isbn);  // Search for the book by ISBN
-        if (!book) {
-            printHeading();
-            cout << "Book with ISBN " << isbn << " not found.\n";
-        } else if (book->isAvailable) {
-            printHeading();
-            cout << "This book was not issued, so it cannot be returned.\n";
-        } else {
-            book->isAvailable = true;  // Mark the book as available
-            undoStack.push("returnBook", isbn);  // Push the action to the undo stack
-            printHeading();
-            cout << "Book returned successfully!\n";
+        string handedTo;
+        Outcome outcome = library.returnBook(session, isbn, &handedTo);
+        if (outcome == Outcome::NotLoggedIn) screen(outcome, "Please log in first.");
+        else if (outcome == Outcome::NotFound) screen(outcome, "Book with ISBN " + isbn + " not found.");
+        else if (outcome == Outcome::NotIssued) screen(outcome, "This book was not issued, so it cannot be returned.");
+        else if (!handedTo.empty()) screen(outcome, "Book returned and issued to " + handedTo + ", first in the hold queue.");
+        else screen(outcome, "Book returned successfully!");
+    }
+
+    // List the books a user has out with their due dates
+    void showLoans(const string& username) {
+        vector<LoanInfo> loans;
+        if (library.loansOf(username, loans) == Outcome::NotFound) screen(Outcome::NotFound, "No user named " + username + ".");
+        else if (loans.empty()) screen(Outcome::Done, username + " has no books out.");
+        else {
+            screen(Outcome::Done, username + " has " + to_string(loans.size()) + (loans.size() == 1 ? " book" : " books") + " out:");
+            render.loans(loans);
+        }
+    }
+
+    // Run the overdue sweep, then list every overdue loan
+    void showOverdue() {
+        size_t newlyOverdue = library.sweepOverdue().size();
+        vector<LoanInfo> loans = library.overdueLoans();
+        if (loans.empty()) {
+            screen(Outcome::Done, "No loans are overdue.");
+            return;
+        }
+        screen(Outcome::Done, to_string(loans.size()) + " overdue (" + to_string(newlyOverdue) + " since the last check):");
+        render.loans(loans);
+    }
+
+    // Leave the hold queue of a book
+    void cancelHold(const string& isbn) {
+        Outcome outcome = library.cancelHold(session, isbn);
+        if (outcome == Outcome::NotLoggedIn) screen(outcome, "Please log in first.");
+        else if (outcome == Outcome::NotFound) screen(outcome, "Book with ISBN " + isbn + " not found.");
+        else if (outcome == Outcome::NotIssued) screen(outcome, "You are not in the hold queue of this book.");
+        else screen(outcome, "Hold cancelled.");
+    }
+
+    // Issue or return several books as one batch, one status line per book
+    void circulateBatch(const vector<string>& isbns, bool issuing) {
+        vector<Outcome> results = issuing ? library.issueBooks(session, isbns) : library.returnBooks(session, isbns);
+        render.heading();
+        for (size_t i = 0; i < isbns.size(); ++i) {
+            Outcome outcome = results[i];
+            if (outcome == Outcome::NotLoggedIn) render.status(outcome, "Please log in first.");
+            else if (outcome == Outcome::NotFound) render.status(outcome, "Book with ISBN " + isbns[i] + " not found.");
+            else if (outcome == Outcome::Done) render.status(outcome, (issuing ? "Issued " : "Returned ") + isbns[i] + ".");
+            else if (outcome == Outcome::NotIssued) render.status(outcome, "Book " + isbns[i] + " was not issued.");
+            else render.status(outcome, "Book " + isbns[i] + " is not available.");
         }
     }
 
     // Undo the last action
     void undo() {
-        if (undoStack.isEmpty()) {  // Check if the undo stack is empty
-            printHeading();
-            cout << "No actions to undo.\n";
+        uint32_t action = 0;
+        Outcome outcome = library.undo(session, &action);
+        if (outcome == Outcome::NotLoggedIn) screen(outcome, "Please log in first.");
+        else if (outcome == Outcome::NothingToUndo) screen(outcome, "No actions to undo.");
+        else if (outcome == Outcome::Conflict) screen(outcome, "Undo: Another reader has changed the book since; that action was dropped.");
+        else if (outcome != Outcome::Done) screen(outcome, "Unknown action to undo.");
+        else if (action == UNDO_ADD_BOOK) screen(outcome, "Undo: Last book addition undone.");
+        else if (action == UNDO_ISSUE_BOOK) screen(outcome, "Undo: Last book issue undone.");
+        else if (action == UNDO_BATCH) screen(outcome, "Undo: Last batch of issues or returns undone.");
+        else if (action == UNDO_HOLD) screen(outcome, "Undo: Last hold undone.");
+        else if (action == UNDO_HAND_OFF) screen(outcome, "Undo: Last return undone; the reader is back at the front of the hold queue.");
+        else screen(outcome, "Undo: Last book return undone.");
+    }
+
+    // Redo the last undone action
+    void redo() {
+        uint32_t action = 0;
+        Outcome outcome = library.redo(session, &action);
+        if (outcome == Outcome::NotLoggedIn) screen(outcome, "Please log in first.");
+        else if (outcome == Outcome::NothingToRedo) screen(outcome, "No actions to redo.");
+        else if (outcome == Outcome::Conflict) screen(outcome, "Redo: Another reader has changed the book since; nothing left to redo.");
+        else if (outcome != Outcome::Done) screen(outcome, "Unknown action to redo.");
+        else if (action == UNDO_ADD_BOOK) screen(outcome, "Redo: Book addition redone.");
+        else if (action == UNDO_ISSUE_BOOK) screen(outcome, "Redo: Book issue redone.");
+        else if (action == UNDO_BATCH) screen(outcome, "Redo: Batch of issues or returns redone.");
+        else if (action == UNDO_HOLD) screen(outcome, "Redo: Hold redone.");
+        else if (action == UNDO_HAND_OFF) screen(outcome, "Redo: Return redone; the copy went to the first reader in the hold queue.");
+        else screen(outcome, "Redo: Book return redone.");
+    }
+
+    void importCatalog(const string& path) {
+        ImportSummary summary = library.importCatalog(session, path);
+        if (summary.outcome == Outcome::NotLoggedIn) {
+            screen(summary.outcome, "Please log in first.");
             return;
         }
-
-        UndoNode* lastAction = undoStack.pop();  // Get the last action from the stack
-        if (lastAction->action == "addBook") {
-            // Undo adding a book
-            Book* lastBook = isbnTable.search(lastAction->isbn);
-            if (lastBook) {
-                root = removeFromBST(root, lastBook->title);  // Remove the book from the BST
-                removeFromHashTable(lastAction->isbn);  // Remove the book from the hash table
-                printHeading();
-                cout << "Undo: Last book addition undone.\n";
-            }
-        } else if (lastAction->action == "issueBook") {
-            // Undo issuing a book
-            Book* book = isbnTable.search(lastAction->isbn);
-            if (book) {
-                book->isAvailable = true;  // Make the book available again
-                printHeading();
-                cout << "Undo: Last book issue undone.\n";
-            }
-        } else if (lastAction->action == "returnBook") {
-            // Undo returning a book
-            Book* book = isbnTable.search(lastAction->isbn);
-            if (book) {
-                book->isAvailable = false;  // Make the book unavailable again
-                printHeading();
-                cout << "Undo: Last book return undone.\n";
-            }
-        } else {
-            printHeading();
-            cout << "Unknown action to undo.\n";
+        if (summary.outcome != Outcome::Done) {
+            screen(summary.outcome, "Could not open " + path + ".");
+            return;
         }
+        string message = "Imported " + to_string(summary.imported) + " books in " + to_string(summary.milliseconds) + " ms";
+        if (summary.duplicates || summary.malformed)
+            message += " (skipped " + to_string(summary.duplicates) + " duplicate ISBNs, " + to_string(summary.malformed) +
+                       " malformed rows)";
+        screen(Outcome::Done, message + ".");
     }
-    
-    // Print Heading
-    void printHeading() {
-    	system("cls");
-        cout << "\t\t\t\t\t\t\t\t\tLibrary Management System\n";
+
+    // Saves a snapshot and empties the log
+    void checkpoint() {
+        if (library.checkpoint()) render.status(Outcome::Done, "Saved " + to_string(library.bookCount()) + " books.");
+        else render.status(Outcome::CannotOpen, "Could not save the library.");
     }
+
     // function to print library options
     void showMenu() {
         int choice;
-        printHeading();
         do {
-            cout << "\nLibrary Menu:\n"
-                 << "1. Add Book\n"
-                 << "2. Display All Books\n"
-                 << "3. Search Book by Title\n"
-                 << "4. Issue Book\n"
-                 << "5. Return Book\n"
-                 << "6. Undo\n"
-                 << "7. Logout\n"
-                 << "Enter choice: ";
-            cin >> choice;
-            cin.ignore();  // To consume the newline character
+            string line = ask("\nLibrary Menu:\n"
+                              "1. Add Book\n"
+                              "2. Display All Books\n"
+                              "3. Search Book by Title\n"
+                              "4. Issue Book\n"
+                              "5. Return Book\n"
+                              "6. Undo\n"
+                              "7. Logout\n"
+                              "8. Import Catalog (CSV/TSV)\n"
+                              "9. Search Books (title or author, partial words allowed)\n"
+                              "10. Cancel Hold\n"
+                              "11. My Loans\n"
+                              "12. Overdue Loans\n"
+                              "13. Redo\n"
+                              "Enter choice: ");
+            choice = in ? atoi(line.c_str()) : 7;  // End of input logs out
 
             string title, author, isbn;
             switch (choice) {
                 case 1:
-                    cout << "Enter title: ";
-                    getline(cin, title);
-                    cout << "Enter author: ";
-                    getline(cin, author);
-                    cout << "Enter ISBN: ";
-                    getline(cin, isbn);
-                    addBook(title, author, isbn);
+                    title = ask("Enter title: ");
+                    author = ask("Enter author: ");
+                    isbn = ask("Enter ISBN: ");
+                    addBook(title, author, isbn, max(atoi(ask("Enter number of copies (Enter for 1): ").c_str()), 1));
                     break;
                 case 2:
-                    displayAllBooks();
+                    displayPage(ListCursor(), 20, ListFilter(), true);
                     break;
                 case 3:
-                    cout << "Enter title to search: ";
-                    getline(cin, title);
-                    searchBookByTitle(title);
+                    searchBookByTitle(ask("Enter title to search: "));
                     break;
                 case 4:
-                    cout << "Enter ISBN to issue: ";
-                    getline(cin, isbn);
-                    issueBook(isbn);
+                    issueBook(ask("Enter ISBN to issue: "));
                     break;
                 case 5:
-                    cout << "Enter ISBN to return: ";
-                    getline(cin, isbn);
-                    returnBook(isbn);
+                    returnBook(ask("Enter ISBN to return: "));
                     break;
                 case 6:
                     undo();
@@ -496,53 +611,857 @@ public:
                 case 7:
                     logoutUser();
                     break;
+                case 8:
+                    importCatalog(ask("Enter catalog file path: "));
+                    break;
+                case 9:
+                    searchCatalog(ask("Enter search words: "), 0, 10, true);
+                    break;
+                case 10:
+                    cancelHold(ask("Enter ISBN to cancel the hold on: "));
+                    break;
+                case 11:
+                    showLoans(session.username);
+                    break;
+                case 12:
+                    showOverdue();
+                    break;
+                case 13:
+                    redo();
+                    break;
                 default:
-                    cout << "Invalid choice, please try again.\n";
+                    render.status(Outcome::Invalid, "Invalid choice, please try again.");
             }
         } while (choice != 7);  //condition for logout
     }
+
+    // Interactive session: sign up, log in and use the library menu until Exit
+    void run() {
+        int choice;
+        render.heading();
+        do {
+            string line = ask("1. Sign up\n"
+                              "2. Login\n"
+                              "3. Exit\n"
+                              "what operation would you like to perform?: ");
+            choice = in ? atoi(line.c_str()) : 3;  // End of input exits
+
+            string username, password;
+            switch (choice) {
+                case 1:
+                    username = ask("Enter username: ");
+                    password = ask("Enter password: ");
+                    registerUser(username, password);
+                    break;
+                case 2:
+                    username = ask("Enter username: ");
+                    password = ask("Enter password: ");
+                    if (loginUser(username, password)) showMenu();
+                    break;
+                case 3:
+                    checkpoint();
+                    render.status(Outcome::Done, "Exiting.......!");
+                    break;
+                default:
+                    render.status(Outcome::Invalid, "Invalid option!");
+            }
+        } while (choice != 3);
+        render.flush();
+    }
+
+    // Filter given by the optional "available"/"all" and author fields at fields[first]
+    static ListFilter listFilter(const vector<string>& fields, size_t first) {
+        ListFilter filter;
+        if (first < fields.size()) filter.availableOnly = fields[first] == "available";
+        if (first + 1 < fields.size()) filter.author = fields[first + 1];
+        return filter;
+    }
+
+    // Page size given as a decimal number; 0 when the text is not one
+    static size_t pageSize(const string& text) {
+        if (text.empty() || text.size() > 9 || text.find_first_not_of("0123456789") != string::npos) return 0;
+        return strtoull(text.c_str(), nullptr, 10);
+    }
+
+    // Runs one batch command; fields[0] is the command name
+    void runCommand(const vector<string>& fields) {
+        const string& command = fields[0];
+        size_t argCount = fields.size() - 1;
+        if (command == "signup" && argCount == 2) registerUser(fields[1], fields[2]);
+        else if (command == "login" && argCount == 2) loginUser(fields[1], fields[2]);
+        else if (command == "logout" && argCount == 0) logoutUser();
+        else if (command == "add" && argCount == 3) addBook(fields[1], fields[2], fields[3]);
+        else if (command == "add" && argCount == 4)
+            addBook(fields[1], fields[2], fields[3], static_cast<uint32_t>(strtoul(fields[4].c_str(), nullptr, 10)));
+        else if (command == "list" && argCount <= 2) displayAllBooks(listFilter(fields, 1));
+        else if (command == "page" && argCount >= 1 && argCount <= 5)
+            displayPage({argCount >= 4 ? fields[4] : "", argCount >= 5 ? fields[5] : ""},
+                        pageSize(fields[1]), listFilter(fields, 2), false);
+        else if (command == "find" && argCount == 1) searchBookByTitle(fields[1]);
+        else if (command == "search" && argCount >= 1 && argCount <= 3)
+            searchCatalog(fields[1], argCount >= 2 ? strtoull(fields[2].c_str(), nullptr, 10) : 0,
+                          argCount >= 3 ? strtoull(fields[3].c_str(), nullptr, 10) : 10, false);
+        else if ((command == "issue" || command == "return") && argCount == 1) {
+            if (command == "issue") issueBook(fields[1]);
+            else returnBook(fields[1]);
+        } else if ((command == "issue" || command == "return") && argCount > 1)
+            circulateBatch(vector<string>(fields.begin() + 1, fields.end()), command == "issue");
+        else if (command == "cancel" && argCount == 1) cancelHold(fields[1]);
+        else if ((command == "loans" && argCount <= 1) || (command == "overdue" && argCount == 0)) {
+            // Other readers' loans are shown to logged-in users only
+            if (!session.isLoggedIn()) render.status(Outcome::NotLoggedIn, "Please log in first.");
+            else if (command == "overdue") showOverdue();
+            else showLoans(argCount ? fields[1] : session.username);
+        }
+        else if (command == "undo" && argCount == 0) undo();
+        else if (command == "redo" && argCount == 0) redo();
+        else if (command == "import" && argCount == 1 && !remote) importCatalog(fields[1]);
+        else if (command == "metrics" && argCount == 0) {
+            string text = library.metricsText();
+            text.pop_back();  // status() ends the line itself
+            render.status(Outcome::Done, text);
+        }
+        else render.status(Outcome::Invalid, "Unknown command or wrong number of arguments: " + command);
+    }
+
+    // Non-interactive mode. Each line is a command and its arguments separated by tabs:
+    //   signup/login <user> <password>, logout, add <title> <author> <isbn> [copies],
+    //   list [available|all] [author], page <limit> [available|all] [author] [title isbn],
+    //   find <title>, search <words> [offset] [limit], issue/return <isbn>..., cancel <isbn>,
+    //   loans [user], overdue, undo, redo, import <path> (not over the network), metrics
+    // page continues after the book with the given title and ISBN, as printed by the page before.
+    // Output is flushed once per block and at the end.
+    void runBatch() {
+        string line;
+        while (getline(in, line)) runLine(line);
+        checkpoint();
+        render.flush();
+    }
+
+    // Runs one batch line; false for blank lines and # comments, which are skipped silently
+    bool runLine(string_view line) {
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.empty() || line[0] == '#') return false;
+        vector<string> fields;
+        for (size_t start = 0;;) {
+            size_t tab = line.find('\t', start);
+            fields.emplace_back(line.substr(start, tab == string_view::npos ? string_view::npos : tab - start));
+            if (tab == string_view::npos) break;
+            start = tab + 1;
+        }
+        runCommand(fields);
+        return true;
+    }
 };
 
+// Keeps a Prometheus stats dump of the library in a file for a textfile collector: the
+// file is rewritten every interval and once more when the writer is destroyed
+class MetricsFileWriter {
+    private:
+    Library& library;
+    string path;
+    mutex lock;
+    condition_variable stopped;
+    bool stopping = false;
+    thread writer;
+
+    public:
+    MetricsFileWriter(Library& l, const string& p, chrono::seconds interval) : library(l), path(p) {
+        writer = thread([this, interval] {
+            unique_lock<mutex> guard(lock);
+            while (!stopped.wait_for(guard, interval, [this] { return stopping; })) library.writeMetrics(path);
+        });
+    }
+    ~MetricsFileWriter() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        stopped.notify_one();
+        writer.join();
+        library.writeMetrics(path);
+    }
+};
+
+// Prints object counts of the library's pools and indexes (tool modes)
+void printMemoryStats(const MemoryStats& stats) {
+    cout << "Books:        " << stats.books << " in " << stats.bookChunks << " chunks\n"
+         << "Title index:  " << stats.titleNodes << " nodes in " << stats.titleChunks << " chunks\n"
+         << "ISBN index:   " << stats.isbnEntries << " entries in one flat table\n"
+         << "Issue queue:  " << stats.queueEntries << " entries in a ring of " << stats.queueCapacity << " slots\n"
+         << "Undo history: " << stats.undoRecords << " records in " << stats.undoBytes << " bytes of rings\n"
+         << "Search index: " << stats.searchTerms << " words, " << stats.searchPostings << " postings\n";
+}
+
+// Whether a stream is attached to a terminal (and so can take screen-clearing sequences)
+inline bool isTerminal(FILE* file) {
+#ifdef _WIN32
+    (void)file;
+    return false;  // Older Windows consoles print escape sequences literally
+#else
+    return isatty(fileno(file));
+#endif
+}
+
+// Loads a synthetic catalog through the same path as addBook (including undo records)
+// and reports pool usage and peak resident memory
+int runLoadTest(size_t bookCount) {
+    Library library;
+    Session session;
+    library.signUp("loadtest", "loadtest");
+    library.login(session, "loadtest", "loadtest");
+    for (size_t i = 0; i < bookCount; ++i) {
+        size_t key = (i * 2654435761ULL) % bookCount;  // Scatter titles so the load is not pre-sorted
+        string isbn = to_string(9780000000000ULL + i);
+        library.addBook(session, "Title " + to_string(key), "Author " + to_string(key % 1000), isbn);
+    }
+    cout << "Loaded " << bookCount << " books\n";
+    printMemoryStats(library.memoryStats());
+#ifndef _WIN32
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    cout << "Peak RSS:     " << usage.ru_maxrss / 1024 << " MiB\n";
+#endif
+    return 0;
+}
+
+// Issue queue throughput: every thread enqueues and dequeues in pairs, so any thread count
+// works and the queue never runs dry. The old linked-list queue has no synchronization of its
+// own, so it is measured behind a mutex, the way a concurrent library would have to use it.
+int runQueueBenchmark(size_t pairsPerThread) {
+    vector<Book*> books(1024);
+    for (size_t i = 0; i < books.size(); ++i) books[i] = reinterpret_cast<Book*>((i + 1) * 64);  // Never dereferenced
+
+    auto measure = [&](size_t threadCount, auto pair) {
+        atomic<bool> start{false};
+        vector<thread> workers;
+        for (size_t t = 0; t < threadCount; ++t)
+            workers.emplace_back([&, t] {
+                while (!start.load(memory_order_acquire)) this_thread::yield();
+                for (size_t i = 0; i < pairsPerThread; ++i) pair(books[(t + i) & 1023]);
+            });
+        auto started = chrono::steady_clock::now();
+        start.store(true, memory_order_release);
+        for (thread& worker : workers) worker.join();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - started;
+        return 2.0 * threadCount * pairsPerThread / elapsed.count() / 1e6;  // Million operations per second
+    };
+
+    cout << "Threads  CustomQueue+mutex  IssueQueue   (million ops/s)\n";
+    for (size_t threadCount : {1, 2, 4, 8, 16, 32}) {
+        CustomQueue oldQueue;
+        mutex oldLock;
+        double before = measure(threadCount, [&](Book* book) {
+            { lock_guard<mutex> guard(oldLock); oldQueue.enqueue(book); }
+            lock_guard<mutex> guard(oldLock);
+            oldQueue.dequeue();
+        });
+        IssueQueue newQueue;
+        double after = measure(threadCount, [&](Book* book) {
+            newQueue.enqueue(book);
+            newQueue.dequeue();
+        });
+        printf("%7zu  %17.2f  %10.2f\n", threadCount, before, after);
+    }
+    return 0;
+}
+
+// Search latency on a synthetic catalog: titles of two to five words drawn with a skew from
+// a vocabulary of made-up words, authors from made-up first and last names. Queries use
+// words of the catalog whole, cut to a prefix, cut to an inner substring and with a typo.
+// Also times the letter-signature candidate filter with and without AVX2.
+int runSearchBenchmark(size_t bookCount) {
+    uint64_t seed = 88172645463325252ULL;
+    auto next = [&seed]() {  // xorshift64
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return seed;
+    };
+    const char consonants[] = "bcdfghjklmnprstvwz", vowels[] = "aeiouy";
+    auto makeWord = [&](size_t syllableCount) {  // Consonant-vowel syllables, sometimes closed by a consonant
+        string word;
+        for (size_t i = 0; i < syllableCount; ++i) {
+            word += consonants[next() % 18];
+            word += vowels[next() % 6];
+        }
+        if (next() % 2) word += consonants[next() % 18];
+        return word;
+    };
+    vector<string> vocabulary(50000), firstNames(2000), lastNames(20000);
+    for (string& word : vocabulary) word = makeWord(2 + next() % 3);
+    for (string& name : firstNames) name = makeWord(2);
+    for (string& name : lastNames) name = makeWord(2 + next() % 2);
+    auto skewed = [&](size_t range) {  // Low indexes are drawn far more often
+        double u = (next() % 1000000) / 1000000.0;
+        return static_cast<size_t>(u * u * u * range);
+    };
 
-// Main Function
-int main() {
     Library library;
-    int choice;
-    cout << "\t\t\t\t\t\t\t\t\tLibrary Management System\n";
-    do {
-        cout << "1. Sign up\n"
-             << "2. Login\n"
-             << "3. Exit\n"
-             << "what operation would you like to perform?: ";
-        cin >> choice;
-        cin.ignore();
-
-        string username, password;
-        switch (choice) {
-            case 1:
-                cout << "Enter username: ";
-                getline(cin, username);
-                cout << "Enter password: ";
-                getline(cin, password);
-                library.registerUser(username, password);
-                break;
-            case 2:
-                cout << "Enter username: ";
-                getline(cin, username);
-                cout << "Enter password: ";
-                getline(cin, password);
-                if (library.loginUser(username, password)) {
-                    system("cls");
-                    library.showMenu();
+    Session session;
+    library.signUp("bench", "bench");
+    library.login(session, "bench", "bench");
+    auto started = chrono::steady_clock::now();
+    for (size_t i = 0; i < bookCount; ++i) {
+        string title;
+        for (size_t w = 2 + next() % 4; w > 0; --w) title += (title.empty() ? "" : " ") + vocabulary[skewed(vocabulary.size())];
+        string author = firstNames[next() % firstNames.size()] + " " + lastNames[skewed(lastNames.size())];
+        library.addBook(session, title, author, to_string(9780000000000ULL + i));
+    }
+    chrono::duration<double> loadTime = chrono::steady_clock::now() - started;
+    cout << "Loaded " << bookCount << " books in " << loadTime.count() << " s\n";
+    printMemoryStats(library.memoryStats());
+
+    auto report = [&](const char* name, auto makeQuery) {
+        vector<double> latencies;
+        vector<BookInfo> page;
+        size_t matches = 0;
+        for (int i = 0; i < 2000; ++i) {
+            string query = makeQuery();
+            auto begin = chrono::steady_clock::now();
+            matches += library.searchBooks(query, 0, 10, page);
+            latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count());
+        }
+        sort(latencies.begin(), latencies.end());
+        printf("%-22s median %8.1f us   p99 %9.1f us   avg matches %zu\n", name, latencies[latencies.size() / 2],
+               latencies[latencies.size() * 99 / 100], matches / latencies.size());
+    };
+    auto rareWord = [&]() {  // Rarer half of the vocabulary, the words people look up by name
+        const string& word = vocabulary[vocabulary.size() / 2 + next() % (vocabulary.size() / 2)];
+        return word.size() >= 6 ? word : word + vocabulary[vocabulary.size() - 1 - next() % 1000];
+    };
+    report("whole word", [&]() { return vocabulary[skewed(vocabulary.size())]; });
+    report("two words", [&]() { return vocabulary[skewed(vocabulary.size())] + " " + vocabulary[skewed(vocabulary.size())]; });
+    report("author + title word", [&]() { return lastNames[next() % lastNames.size()] + " " + vocabulary[skewed(100)]; });
+    report("prefix", [&]() { return rareWord().substr(0, 5); });
+    report("substring", [&]() { return rareWord().substr(1, 4); });
+    report("typo", [&]() {
+        string word = rareWord();
+        word[next() % word.size()] = 'x';
+        return word;
+    });
+
+    // Candidate filter alone, over every word of the vocabulary
+    vector<uint64_t> signatures;
+    for (const string& word : vocabulary) signatures.push_back(letterSignature(word));
+    while (signatures.size() < 1000000) signatures.insert(signatures.end(), signatures.begin(), signatures.begin() + min(signatures.size(), 1000000 - signatures.size()));
+    vector<uint32_t> out(signatures.size());
+    auto timeFilter = [&](auto filter) {
+        auto begin = chrono::steady_clock::now();
+        size_t kept = 0;
+        for (int i = 0; i < 200; ++i) kept += filter(signatures.data(), signatures.size(), letterSignature(vocabulary[i]), 2, out.data());
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+        return make_pair(200.0 * signatures.size() / elapsed.count() / 1e6, kept);
+    };
+    auto scalar = timeFilter(filterSignaturesScalar);
+    printf("Signature filter, scalar: %8.0f M signatures/s\n", scalar.first);
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    if (__builtin_cpu_supports("avx2")) {
+        auto simd = timeFilter(filterSignaturesAvx2);
+        printf("Signature filter, AVX2:   %8.0f M signatures/s%s\n", simd.first, simd.second == scalar.second ? "" : "  (MISMATCH)");
+    }
+#endif
+    return 0;
+}
+
+// User store and login latency. Registers userCount users at the lowest cost to time the
+// user table, then for a few password costs times a first login (the slow hash), a repeated
+// login (answered by the login cache) and a login with a wrong password.
+int runLoginBenchmark(size_t userCount) {
+    using Clock = chrono::steady_clock;
+    auto micros = [](Clock::duration d) { return chrono::duration<double, micro>(d).count(); };
+    {
+        Library library;
+        library.setPasswordCost(1);
+        auto started = Clock::now();
+        for (size_t i = 0; i < userCount; ++i) library.signUp("user" + to_string(i), "pw" + to_string(i));
+        double registerTime = micros(Clock::now() - started) / userCount;
+        Session session;
+        started = Clock::now();
+        size_t found = 0;
+        for (size_t i = 0; i < userCount; ++i)
+            found += library.login(session, "user" + to_string((i * 2654435761ULL) % userCount), "pw") == Outcome::InvalidCredentials;
+        printf("%zu users: %.2f us per registration, %.2f us per failed login at cost 1 (%zu)\n", userCount, registerTime,
+               micros(Clock::now() - started) / userCount, found);
+    }
+
+    const size_t users = 16;
+    printf("   Cost   first login   repeated login   wrong password   (us, p50 / p99)\n");
+    for (uint32_t cost : {1000u, 10000u, 100000u, 600000u}) {
+        Library library;
+        library.setPasswordCost(cost);
+        for (size_t i = 0; i < users; ++i) library.signUp("user" + to_string(i), "password" + to_string(i));
+        auto measure = [&](size_t rounds, const char* suffix) {
+            vector<double> times;
+            for (size_t r = 0; r < rounds; ++r)
+                for (size_t i = 0; i < users; ++i) {
+                    Session session;
+                    auto started = Clock::now();
+                    library.login(session, "user" + to_string(i), "password" + to_string(i) + suffix);
+                    times.push_back(micros(Clock::now() - started));
+                }
+            sort(times.begin(), times.end());
+            return make_pair(times[times.size() / 2], times[times.size() * 99 / 100]);
+        };
+        auto first = measure(1, "");
+        auto repeated = measure(1000, "");
+        auto wrong = measure(1, "x");
+        printf("%7u  %6.0f /%6.0f   %6.2f /%6.2f   %6.0f /%6.0f\n", cost, first.first, first.second, repeated.first,
+               repeated.second, wrong.first, wrong.second);
+    }
+    return 0;
+}
+
+#ifdef __linux__
+// Server mode: the batch command language over a local socket, for any number of clients at
+// once. Every connection is a console of its own (its own Session and renderer) on the one
+// shared Library. Requests are the tab-separated lines of --batch; each response is the
+// lines the command printed followed by an empty line, so a client can pipeline requests
+// and match the responses up in order. All requests that arrived in one read are run before
+// their responses go out in one write.
+//
+// Each worker thread runs its own epoll loop; the listening socket sits in all of them with
+// EPOLLEXCLUSIVE, so every new connection wakes one worker and stays with it. Slow calls
+// (a password hash on login) hold up only the connections of that worker.
+class LibraryServer {
+    private:
+    static const size_t READ_SIZE = 64 * 1024;
+    static const size_t MAX_LINE = 64 * 1024;       // Longer requests close the connection
+    static const size_t OUTPUT_LIMIT = 1024 * 1024; // Stop reading requests while this much is unsent
+
+    struct Connection {
+        int fd;
+        string input;      // Bytes received, not yet run
+        string output;     // Responses, from sent on not yet written to the socket
+        size_t sent = 0;
+        bool closing = false;  // The client has shut down its side
+        uint32_t events = 0;   // Events the connection is registered for
+        OutputBuffer buffer;
+        unique_ptr<Renderer> render;
+        istringstream noInput;
+        LibraryConsole console;
+
+        Connection(int socket, Library& library, bool json)
+            : fd(socket), buffer(output),
+              render(json ? static_cast<Renderer*>(new JsonLinesRenderer(buffer))
+                          : static_cast<Renderer*>(new ConsoleRenderer(buffer, false, false))),
+              console(library, *render, noInput, true) {}
+        ~Connection() { close(fd); }
+    };
+
+    Library& library;
+    bool json;
+    int listenFd = -1;
+    int stopFd = -1;     // eventfd, readable once stop() has been called
+    string unixPath;     // Socket file to remove on exit
+
+    static int stopSignalFd;
+    static void onStopSignal(int) {
+        uint64_t one = 1;
+        if (write(stopSignalFd, &one, sizeof one) < 0) {}  // Nothing to do about it in a handler
+    }
+
+    static void watch(int epoll, Connection& c, uint32_t events) {
+        if (c.events == events) return;
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = c.fd;
+        epoll_ctl(epoll, EPOLL_CTL_MOD, c.fd, &event);
+        c.events = events;
+    }
+
+    // Runs the complete request lines received so far, as long as the unsent output stays
+    // under OUTPUT_LIMIT; false if a request is too long
+    static bool runRequests(Connection& c) {
+        size_t start = 0;
+        while (c.output.size() - c.sent < OUTPUT_LIMIT) {
+            size_t end = c.input.find('\n', start);
+            if (end == string::npos) break;
+            if (c.console.runLine(string_view(c.input).substr(start, end - start))) c.buffer.write("\n");
+            start = end + 1;
+        }
+        c.input.erase(0, start);
+        return c.input.size() <= MAX_LINE || c.input.find('\n') != string::npos;
+    }
+
+    // Writes as much of the pending output as the socket takes; false if the client is gone
+    static bool sendOutput(Connection& c) {
+        while (c.sent < c.output.size()) {
+            ssize_t written = send(c.fd, c.output.data() + c.sent, c.output.size() - c.sent, MSG_NOSIGNAL);
+            if (written < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            c.sent += written;
+        }
+        c.output.clear();
+        c.sent = 0;
+        return true;
+    }
+
+    // Reads, runs and answers what a connection has sent; false once it should be closed
+    bool serve(int epoll, Connection& c, uint32_t ready) {
+        if (ready & EPOLLERR) return false;
+        if ((ready & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) && !c.closing) {
+            char data[READ_SIZE];
+            ssize_t received = recv(c.fd, data, sizeof data, 0);
+            if (received > 0) c.input.append(data, received);
+            else if (received == 0) c.closing = true;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+        }
+        if (!runRequests(c) || !sendOutput(c)) return false;
+        bool unsent = c.sent < c.output.size();
+        if (c.closing && !unsent && (c.input.find('\n') == string::npos)) return false;
+        bool backlog = c.output.size() - c.sent >= OUTPUT_LIMIT;
+        watch(epoll, c, (unsent ? uint32_t(EPOLLOUT) : 0) | (backlog || c.closing ? 0 : uint32_t(EPOLLIN | EPOLLRDHUP)));
+        return true;
+    }
+
+    void acceptClients(int epoll, unordered_map<int, unique_ptr<Connection>>& connections) {
+        for (;;) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;  // EAGAIN: another worker took it, or nobody is waiting
+            if (unixPath.empty()) {
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);  // Responses are small
+            }
+            Connection* c = new Connection(fd, library, json);
+            connections[fd].reset(c);
+            c->events = EPOLLIN | EPOLLRDHUP;
+            epoll_event event = {};
+            event.events = c->events;
+            event.data.fd = fd;
+            epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+        }
+    }
+
+    void runWorker() {
+        int epoll = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.fd = listenFd;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, listenFd, &event);
+        event.events = EPOLLIN;  // Level-triggered and never read, so it wakes every worker
+        event.data.fd = stopFd;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, stopFd, &event);
+
+        unordered_map<int, unique_ptr<Connection>> connections;
+        epoll_event ready[256];
+        for (bool running = true; running;) {
+            int count = epoll_wait(epoll, ready, 256, -1);
+            for (int i = 0; i < count; ++i) {
+                int fd = ready[i].data.fd;
+                if (fd == stopFd) running = false;
+                else if (fd == listenFd) acceptClients(epoll, connections);
+                else {
+                    auto found = connections.find(fd);
+                    if (found != connections.end() && !serve(epoll, *found->second, ready[i].events))
+                        connections.erase(found);  // Closing the socket also takes it out of the epoll set
+                }
+            }
+        }
+        close(epoll);
+    }
+
+    public:
+    LibraryServer(Library& l, bool jsonLines) : library(l), json(jsonLines) {}
+    ~LibraryServer() {
+        if (listenFd >= 0) close(listenFd);
+        if (stopFd >= 0) close(stopFd);
+        if (!unixPath.empty()) unlink(unixPath.c_str());
+    }
+
+    // Listens on a TCP port of the loopback interface when address is a number, otherwise on
+    // a Unix socket at that path (replacing a stale socket file)
+    bool listenOn(const string& address) {
+        bool tcp = !address.empty() && address.find_first_not_of("0123456789") == string::npos;
+        listenFd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) return false;
+        int bound;
+        if (tcp) {
+            int on = 1;
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+            sockaddr_in local = {};
+            local.sin_family = AF_INET;
+            local.sin_port = htons(static_cast<uint16_t>(atoi(address.c_str())));
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bound = ::bind(listenFd, reinterpret_cast<sockaddr*>(&local), sizeof local);
+        } else {
+            sockaddr_un local = {};
+            local.sun_family = AF_UNIX;
+            if (address.size() >= sizeof local.sun_path) return false;
+            memcpy(local.sun_path, address.c_str(), address.size());
+            unlink(address.c_str());
+            bound = ::bind(listenFd, reinterpret_cast<sockaddr*>(&local), sizeof local);
+            if (bound == 0) unixPath = address;
+        }
+        return bound == 0 && listen(listenFd, SOMAXCONN) == 0;
+    }
+
+    // Serves clients on threadCount workers until SIGINT or SIGTERM
+    void run(size_t threadCount) {
+        stopFd = eventfd(0, EFD_CLOEXEC);
+        stopSignalFd = stopFd;
+        signal(SIGINT, onStopSignal);
+        signal(SIGTERM, onStopSignal);
+        vector<thread> workers;
+        for (size_t i = 0; i < max<size_t>(threadCount, 1); ++i) workers.emplace_back([this] { runWorker(); });
+        for (thread& worker : workers) worker.join();
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+    }
+};
+int LibraryServer::stopSignalFd = -1;
+
+// Opens a blocking connection to a server address as given to --serve; -1 on failure
+int connectTo(const string& address) {
+    bool tcp = !address.empty() && address.find_first_not_of("0123456789") == string::npos;
+    int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int connected;
+    if (tcp) {
+        sockaddr_in remote = {};
+        remote.sin_family = AF_INET;
+        remote.sin_port = htons(static_cast<uint16_t>(atoi(address.c_str())));
+        remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        connected = connect(fd, reinterpret_cast<sockaddr*>(&remote), sizeof remote);
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    } else {
+        sockaddr_un remote = {};
+        remote.sun_family = AF_UNIX;
+        strncpy(remote.sun_path, address.c_str(), sizeof remote.sun_path - 1);
+        connected = connect(fd, reinterpret_cast<sockaddr*>(&remote), sizeof remote);
+    }
+    if (connected != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Client side of the protocol for the load generator: sends request lines and waits for
+// whole responses (ended by an empty line)
+class ProtocolClient {
+    private:
+    int fd;
+    string received;
+    size_t scanned = 0;    // received is checked for response ends up to here
+    bool atLineStart = true;
+
+    public:
+    ProtocolClient(int socket) : fd(socket) {}
+    ~ProtocolClient() { close(fd); }
+
+    bool send(const string& requests) {
+        for (size_t done = 0; done < requests.size();) {
+            ssize_t written = ::send(fd, requests.data() + done, requests.size() - done, MSG_NOSIGNAL);
+            if (written <= 0) return false;
+            done += written;
+        }
+        return true;
+    }
+
+    // Blocks until at least one more response has ended and returns how many did; 0 once
+    // the server has closed the connection
+    size_t awaitResponses() {
+        for (;;) {
+            size_t ended = 0;
+            for (; scanned < received.size(); ++scanned) {
+                bool newline = received[scanned] == '\n';
+                if (newline && atLineStart) ++ended;
+                atLineStart = newline;
+            }
+            received.clear();
+            scanned = 0;
+            if (ended) return ended;
+            char data[64 * 1024];
+            ssize_t count = recv(fd, data, sizeof data, 0);
+            if (count <= 0) return 0;
+            received.assign(data, count);
+        }
+    }
+};
+
+// Load generator for a running server: each connection signs up and logs in its own reader,
+// then sends requests in pipelined batches of depth (55% title lookups, 20% issues, 20%
+// returns, 5% undos) over a catalog of 10,000 books that the first connection adds.
+// Reports requests per second and latency quantiles; a request's latency runs from sending
+// its batch to the end of its response.
+int runLoadGenerator(const string& address, size_t connectionCount, double seconds, size_t depth) {
+    static const size_t CATALOG = 10000;
+    connectionCount = max<size_t>(connectionCount, 1);
+    depth = max<size_t>(depth, 1);
+    {
+        int fd = connectTo(address);
+        if (fd < 0) {
+            fprintf(stderr, "Cannot connect to %s\n", address.c_str());
+            return 1;
+        }
+        ProtocolClient seeder(fd);
+        string requests = "signup\tloadgen\tloadgen\nlogin\tloadgen\tloadgen\n";
+        for (size_t i = 0; i < CATALOG; ++i)
+            requests += "add\tLoad Title " + to_string(i) + "\tLoad Author " + to_string(i % 100) + "\t" +
+                        to_string(9790000000000ULL + i) + "\n";
+        seeder.send(requests);
+        for (size_t answered = 0; answered < CATALOG + 2;) {
+            size_t ended = seeder.awaitResponses();
+            if (!ended) return 1;
+            answered += ended;
+        }
+    }
+
+    vector<unique_ptr<LatencyHistogram>> latencies;
+    vector<size_t> completed(connectionCount, 0);
+    for (size_t i = 0; i < connectionCount; ++i) latencies.emplace_back(new LatencyHistogram);
+    atomic<bool> failed{false};
+    auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+                                                      chrono::duration<double>(seconds));
+    auto started = chrono::steady_clock::now();
+    vector<thread> clients;
+    for (size_t c = 0; c < connectionCount; ++c)
+        clients.emplace_back([&, c] {
+            int fd = connectTo(address);
+            if (fd < 0) {
+                failed = true;
+                return;
+            }
+            ProtocolClient client(fd);
+            string reader = "reader" + to_string(c);
+            client.send("signup\t" + reader + "\tload\nlogin\t" + reader + "\tload\n");
+            for (size_t answered = 0; answered < 2;) answered += client.awaitResponses();
+
+            uint64_t seed = 88172645463325252ULL + c;
+            string batch;
+            while (chrono::steady_clock::now() < deadline) {
+                batch.clear();
+                for (size_t i = 0; i < depth; ++i) {
+                    seed ^= seed << 13;  // xorshift64
+                    seed ^= seed >> 7;
+                    seed ^= seed << 17;
+                    size_t book = (seed >> 8) % CATALOG, kind = seed % 100;
+                    if (kind < 55) batch += "find\tLoad Title " + to_string(book) + "\n";
+                    else if (kind < 75) batch += "issue\t" + to_string(9790000000000ULL + book) + "\n";
+                    else if (kind < 95) batch += "return\t" + to_string(9790000000000ULL + book) + "\n";
+                    else batch += "undo\n";
                 }
-                break;
-            case 3:
-                cout << "Exiting.......!\n";
-                break;
-            default:
-                cout << "Invalid option!\n";
+                auto sentAt = chrono::steady_clock::now();
+                if (!client.send(batch)) {
+                    failed = true;
+                    return;
+                }
+                for (size_t answered = 0; answered < depth;) {
+                    size_t ended = client.awaitResponses();
+                    if (!ended) {
+                        failed = true;
+                        return;
+                    }
+                    uint64_t nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sentAt).count();
+                    for (size_t i = 0; i < ended; ++i) latencies[c]->record(nanos);
+                    answered += ended;
+                }
+                completed[c] += depth;
+            }
+        });
+    for (thread& client : clients) client.join();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - started;
+    if (failed) {
+        fprintf(stderr, "A connection to %s failed\n", address.c_str());
+        return 1;
+    }
+
+    LatencyHistogram total;
+    size_t requests = 0;
+    for (size_t c = 0; c < connectionCount; ++c) {
+        total.add(*latencies[c]);
+        requests += completed[c];
+    }
+    printf("Connections: %zu, pipeline depth: %zu, %.1f s\n", connectionCount, depth, elapsed.count());
+    printf("Requests:    %zu (%.0f per second)\n", requests, requests / elapsed.count());
+    printf("Latency:     p50 %.1f us, p99 %.1f us, p99.9 %.1f us\n", total.quantile(0.5) / 1e3,
+           total.quantile(0.99) / 1e3, total.quantile(0.999) / 1e3);
+    return 0;
+}
+#endif
+
+// Main Function
+int main(int argc, char* argv[]) {
+    if (argc == 3 && string(argv[1]) == "--load-test")
+        return runLoadTest(strtoull(argv[2], nullptr, 10));
+    if (argc >= 2 && string(argv[1]) == "--bench-search")
+        return runSearchBenchmark(argc == 3 ? strtoull(argv[2], nullptr, 10) : 1000000);
+    if (argc >= 2 && string(argv[1]) == "--bench-queue")
+        return runQueueBenchmark(argc == 3 ? strtoull(argv[2], nullptr, 10) : 1000000);
+    if (argc >= 2 && string(argv[1]) == "--bench-login")
+        return runLoginBenchmark(argc == 3 ? strtoull(argv[2], nullptr, 10) : 1000000);
+#ifdef __linux__
+    if (argc >= 3 && argc <= 6 && string(argv[1]) == "--load-gen")
+        return runLoadGenerator(argv[2], argc > 3 ? strtoull(argv[3], nullptr, 10) : 16,
+                                argc > 4 ? strtod(argv[4], nullptr) : 10, argc > 5 ? strtoull(argv[5], nullptr, 10) : 16);
+#endif
+
+    bool batch = false;
+    string format = "text";
+    long loanDays = 14;
+    long undoDepth = 100;
+    long passwordCost = 100000;
+    long shardCount = 1;
+    string metricsPath;
+    string serveAddress;
+    long serverThreads = thread::hardware_concurrency();
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--batch") batch = true;
+        else if (arg == "--format" && i + 1 < argc) format = argv[++i];
+        else if (arg == "--loan-days" && i + 1 < argc) loanDays = strtol(argv[++i], nullptr, 10);
+        else if (arg == "--undo-depth" && i + 1 < argc) undoDepth = strtol(argv[++i], nullptr, 10);
+        else if (arg == "--password-cost" && i + 1 < argc) passwordCost = strtol(argv[++i], nullptr, 10);
+        else if (arg == "--metrics" && i + 1 < argc) metricsPath = argv[++i];
+        else if (arg == "--shards" && i + 1 < argc) shardCount = strtol(argv[++i], nullptr, 10);
+#ifdef __linux__
+        else if (arg == "--serve" && i + 1 < argc) serveAddress = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc) serverThreads = strtol(argv[++i], nullptr, 10);
+#endif
+        else batch = false, format.clear();  // Unknown argument
+    }
+    bool serving = !serveAddress.empty();
+    bool formatOk = format == "text" || (batch && (format == "json" || format == "csv")) || (serving && format == "json");
+    if (!formatOk || (batch && serving) || loanDays <= 0 || undoDepth <= 0 || passwordCost <= 0 ||
+        passwordCost > UINT32_MAX || serverThreads <= 0 || shardCount <= 0 || shardCount > 1024) {
+        fprintf(stderr, "usage: %s [--batch [--format text|json|csv] | --serve PORT|PATH [--threads N] [--format text|json]] [--loan-days N] [--undo-depth N] [--password-cost N] [--shards N] [--metrics FILE] | --load-test N | --bench-queue [N] | --bench-search [N] | --bench-login [N] | --load-gen PORT|PATH [CONNECTIONS [SECONDS [DEPTH]]]\n", argv[0]);
+        return 2;
+    }
+
+    OutputBuffer out(stdout);
+    bool interactive = !batch && !serving;
+    ConsoleRenderer console(out, interactive && isTerminal(stdout), interactive);
+    JsonLinesRenderer json(out);
+    CsvRenderer csv(out);
+    Renderer& renderer = format == "json" ? static_cast<Renderer&>(json) : format == "csv" ? static_cast<Renderer&>(csv) : console;
+
+    Library library(shardCount);
+    library.setLoanPeriod(loanDays * 86400);
+    library.setUndoDepth(undoDepth);
+    library.setPasswordCost(static_cast<uint32_t>(passwordCost));
+    LibraryConsole frontEnd(library, renderer, cin);
+    // Catalog state kept between runs: the last snapshot plus a log of later changes
+    if (!frontEnd.reportStorage(library.openStorage("library.snapshot", "library.wal"))) return 1;
+    unique_ptr<MetricsFileWriter> metrics;
+    if (!metricsPath.empty()) metrics.reset(new MetricsFileWriter(library, metricsPath, chrono::seconds(10)));
+    if (batch) frontEnd.runBatch();
+#ifdef __linux__
+    else if (serving) {
+        LibraryServer server(library, format == "json");
+        if (!server.listenOn(serveAddress)) {
+            renderer.status(Outcome::CannotOpen, "Cannot listen on " + serveAddress + ".");
+            renderer.flush();
+            return 1;
         }
-    } while (choice != 3);
+        renderer.status(Outcome::Done, "Serving on " + serveAddress + "; Ctrl+C to stop.");
+        renderer.flush();
+        server.run(serverThreads);
+        frontEnd.checkpoint();
+        renderer.flush();
+    }
+#endif
+    else frontEnd.run();
 
     return 0;
 }
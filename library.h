@@ -0,0 +1,4626 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+// Core of the library management system: the data structures, persistence and the
+// thread-safe Library API. The console front end is in "library management system.cpp".
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <string_view>
+#include <algorithm>
+#include <chrono>
+#include <initializer_list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <atomic>
+#include <unordered_map>
+#include <random>
+#include <cmath>
+#include <memory>
+#include <deque>
+#include <functional>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+// Memory pool for one node type. Objects are carved out of large chunks instead of being
+// allocated one by one, freed slots are threaded onto a free list and reused by the next
+// create(), and every object still alive is destroyed in bulk when the pool is released.
+// Objects of a chunk are contiguous, so forEach() walks memory sequentially.
+template <typename T, size_t CHUNK_SIZE = 1024>
+class ObjectPool {
+    private:
+    struct Slot {
+        alignas(T) unsigned char storage[sizeof(T)]; // The object, or the free-list link when unused
+        bool live = false;                           // Whether storage holds a constructed object
+    };
+    static_assert(sizeof(T) >= sizeof(Slot*), "a free slot must be able to hold the free-list link");
+
+    vector<Slot*> chunks;            // Arrays of CHUNK_SIZE slots, in allocation order
+    size_t usedInLast = CHUNK_SIZE;  // Slots handed out from the newest chunk
+    Slot* freeList = nullptr;        // Destroyed slots waiting for reuse
+    size_t liveCount = 0;            // Objects currently constructed
+
+    static Slot*& nextFree(Slot* slot) { return *reinterpret_cast<Slot**>(slot->storage); }
+
+    public:
+    ObjectPool() {}
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+    ~ObjectPool() { release(); }
+
+    // Constructs an object in a recycled slot, or in a fresh one from the newest chunk
+    template <typename... Args>
+    T* create(Args&&... args) {
+        Slot* slot;
+        if (freeList) {
+            slot = freeList;
+            freeList = nextFree(slot);
+        } else {
+            if (usedInLast == CHUNK_SIZE) { // One heap allocation per CHUNK_SIZE objects
+                chunks.push_back(new Slot[CHUNK_SIZE]);
+                usedInLast = 0;
+            }
+            slot = &chunks.back()[usedInLast++];
+        }
+        T* object = new (slot->storage) T(std::forward<Args>(args)...);
+        slot->live = true;
+        ++liveCount;
+        return object;
+    }
+
+    // Destroys an object created by this pool and puts its slot on the free list
+    void destroy(T* object) {
+        if (!object) return;
+        Slot* slot = reinterpret_cast<Slot*>(object); // storage is the first member of Slot
+        object->~T();
+        slot->live = false;
+        nextFree(slot) = freeList;
+        freeList = slot;
+        --liveCount;
+    }
+
+    // Calls visit(object) for every live object in memory order
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        for (size_t c = 0; c < chunks.size(); ++c) {
+            size_t used = c + 1 == chunks.size() ? usedInLast : CHUNK_SIZE;
+            for (size_t i = 0; i < used; ++i)
+                if (chunks[c][i].live) visit(reinterpret_cast<T*>(chunks[c][i].storage));
+        }
+    }
+
+    // Destroys every live object and returns all chunks to the heap
+    void release() {
+        forEach([](T* object) { object->~T(); });
+        for (Slot* chunk : chunks) delete[] chunk;
+        chunks.clear();
+        usedInLast = CHUNK_SIZE;
+        freeList = nullptr;
+        liveCount = 0;
+    }
+
+    size_t size() const { return liveCount; }             // Live objects
+    size_t chunkCount() const { return chunks.size(); }   // Heap allocations made for slots
+    size_t capacity() const { return chunks.size() * CHUNK_SIZE; }
+};
+
+class User;
+class Loan;
+
+// A reader waiting for a copy of a book
+class HoldNode {
+    public:
+    User* user;
+    HoldNode* next = nullptr; // Toward the rear of the queue
+    HoldNode* prev = nullptr; // Toward the front, so the newest hold can be withdrawn
+
+    HoldNode(User* u) : user(u) {}
+};
+typedef ObjectPool<HoldNode, 4096> HoldPool;
+
+// Readers waiting for one book, first come first served. Works like CustomQueue, but the
+// nodes come from a pool shared by every book, so a book nobody waits for pays only for
+// two pointers and a count, and serving the next reader is O(1) however many holds exist.
+class HoldQueue {
+    private:
+    HoldNode* front = nullptr;
+    HoldNode* rear = nullptr;
+    atomic<uint32_t> count{0}; // Read by listings that do not hold the commit lock
+
+    void unlink(HoldPool& pool, HoldNode* node) {
+        (node->prev ? node->prev->next : front) = node->next;
+        (node->next ? node->next->prev : rear) = node->prev;
+        pool.destroy(node);
+        count.store(count.load(memory_order_relaxed) - 1, memory_order_relaxed);
+    }
+
+    public:
+    // Adds a reader at the rear
+    void enqueue(HoldPool& pool, User* user) {
+        HoldNode* node = pool.create(user);
+        node->prev = rear;
+        (rear ? rear->next : front) = node;
+        rear = node;
+        count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    // Puts a reader back at the front (undoing a dequeue)
+    void pushFront(HoldPool& pool, User* user) {
+        HoldNode* node = pool.create(user);
+        node->next = front;
+        (front ? front->prev : rear) = node;
+        front = node;
+        count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    // Removes and returns the reader at the front, or nullptr if nobody is waiting
+    User* dequeue(HoldPool& pool) {
+        if (!front) return nullptr;
+        User* user = front->user;
+        unlink(pool, front);
+        return user;
+    }
+
+    // Removes the newest hold of a reader; the search starts at the rear, where undo finds it
+    bool remove(HoldPool& pool, const User* user) {
+        for (HoldNode* node = rear; node; node = node->prev)
+            if (node->user == user) {
+                unlink(pool, node);
+                return true;
+            }
+        return false;
+    }
+
+    // 1-based place of a reader in the queue, 0 if the reader is not waiting
+    size_t position(const User* user) const {
+        size_t place = 1;
+        for (const HoldNode* node = front; node; node = node->next, ++place)
+            if (node->user == user) return place;
+        return 0;
+    }
+
+    // Calls visit(user) for every waiting reader from front to rear
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        for (const HoldNode* node = front; node; node = node->next) visit(node->user);
+    }
+
+    // Gives every node back to the pool
+    void clear(HoldPool& pool) {
+        while (front) unlink(pool, front);
+    }
+
+    size_t size() const { return count.load(memory_order_relaxed); }
+};
+
+class Book  // Class for a Book
+{
+    public:
+    string title, author, isbn;                
+    uint32_t copies;            // Copies of this edition the library owns
+    atomic<uint32_t> available; // Copies on the shelf, changed atomically by issue and return
+    uint32_t searchId = UINT32_MAX; // Id of the book in the search index, UINT32_MAX if it has none
+    uint32_t historyRefs = 0;   // Undo records that refer to the book
+    uint64_t version = 0;       // Change number of the last action on the book
+    bool retired = false;       // Taken out of the catalog by an undo, kept for redo
+    HoldQueue holds;            // Readers waiting for a copy
+    Loan* loans = nullptr;      // Copies out on loan, most recently opened first
+    Book(string t, string a, string i, uint32_t c = 1, uint32_t onShelf = 1)
+	: title(move(t)), author(move(a)), isbn(move(i)), copies(c), available(min(onShelf, c)) {}
+    bool isAvailable() const { return available.load(memory_order_relaxed) > 0; }
+};
+
+//Hash Table Implementation
+// 64-bit string hash: FNV-1a over the bytes followed by a murmur-style finalizer so that
+// the low bits used for the bucket index depend on every character of the key
+inline uint64_t hashString(string_view key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : key) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash ? hash : 1; // 0 is reserved to mark an empty slot
+}
+
+// Hint that memory will be read soon; a no-op where the compiler has no prefetch builtin
+inline void prefetchRead(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address, 0, 1);
+#else
+    (void)address;
+#endif
+}
+
+// ISBN index: open addressing with Robin Hood probing in one flat array of 16-byte slots.
+// The table doubles once it is 7/8 full; the old array is then migrated a few slots per
+// insert/remove so no single operation pays for a full rehash.
+class HashTable {
+    private:
+    struct Slot {
+        uint64_t hash = 0;    // Cached hash of the ISBN, 0 if the slot is empty
+        Book* book = nullptr; // Book stored in the slot (nullptr with a non-zero hash = tombstone)
+    };
+    static const size_t MIN_CAPACITY = 16;
+    static const size_t MIGRATE_STEP = 64; // Old slots moved per mutation while rehashing
+
+    vector<Slot> table;    // Current table, capacity is a power of two
+    size_t mask = 0;       // table.size() - 1
+    size_t count = 0;      // Books stored in table
+    vector<Slot> oldTable; // Table being drained by an incremental rehash (empty otherwise)
+    size_t oldMask = 0;
+    size_t oldCount = 0;   // Books still waiting in oldTable
+    size_t migratePos = 0; // Next oldTable slot to migrate
+
+    static size_t probeDistance(size_t index, uint64_t hash, size_t m) {
+        return (index - hash) & m; // Distance of a slot from the home bucket of its hash
+    }
+
+    // Robin Hood insertion: an entry that is further from home takes the slot of a richer one
+    static void place(vector<Slot>& t, size_t m, Slot entry) {
+        size_t dist = 0;
+        for (size_t i = entry.hash & m;; i = (i + 1) & m, ++dist) {
+            if (!t[i].hash) {
+                t[i] = entry;
+                return;
+            }
+            size_t existing = probeDistance(i, t[i].hash, m);
+            if (existing < dist) {
+                swap(t[i], entry);
+                dist = existing;
+            }
+        }
+    }
+
+    // Probing stops at an empty slot or at a slot closer to home than the key would be
+    static Slot* find(vector<Slot>& t, size_t m, uint64_t hash, const string& key) {
+        if (t.empty()) return nullptr;
+        for (size_t i = hash & m, dist = 0;; i = (i + 1) & m, ++dist) {
+            Slot& current = t[i];
+            if (!current.hash || probeDistance(i, current.hash, m) < dist) return nullptr;
+            if (current.hash == hash && current.book && current.book->isbn == key) return &current;
+        }
+    }
+
+    // Moves the next batch of old slots into the new table; migrated slots become tombstones
+    // so that probe sequences for keys still in oldTable stay intact
+    void migrate() {
+        for (size_t n = 0; n < MIGRATE_STEP && migratePos < oldTable.size(); ++n, ++migratePos) {
+            Slot& slot = oldTable[migratePos];
+            if (!slot.book) continue;
+            place(table, mask, slot);
+            ++count;
+            --oldCount;
+            slot.book = nullptr;
+        }
+        if (migratePos == oldTable.size()) {
+            vector<Slot>().swap(oldTable); // Release the drained table
+            oldMask = oldCount = migratePos = 0;
+        }
+    }
+
+    void grow() {
+        while (!oldTable.empty()) migrate(); // Finish any rehash still in progress
+        size_t capacity = table.empty() ? MIN_CAPACITY : table.size() * 2;
+        oldTable.swap(table);
+        oldMask = mask;
+        oldCount = count;
+        table.assign(capacity, Slot());
+        mask = capacity - 1;
+        count = migratePos = 0;
+        if (!oldCount) vector<Slot>().swap(oldTable);
+    }
+
+    public:
+    // Insert a book into the hash table using its ISBN (key must be book->isbn).
+    // Returns false and leaves the table unchanged if the ISBN is already present.
+    bool insert(const string& key, Book* book) {
+        uint64_t hash = hashString(key);
+        if (find(table, mask, hash, key) || find(oldTable, oldMask, hash, key)) return false;
+        if ((count + oldCount + 1) * 8 > table.size() * 7) grow(); // Keep the load factor under 7/8
+        place(table, mask, Slot{hash, book});
+        ++count;
+        if (!oldTable.empty()) migrate();
+        return true;
+    }
+
+    Book* search(const string& key) {  // Search for a book by ISBN in the hash table
+        uint64_t hash = hashString(key);
+        Slot* slot = find(table, mask, hash, key);
+        if (!slot) slot = find(oldTable, oldMask, hash, key);
+        return slot ? slot->book : nullptr;   // Return nullptr if book is not found
+    }
+
+    // Looks up many keys at once: hashes a group of keys and prefetches their home slots,
+    // then probes, so the cache misses of the group overlap instead of running back to back.
+    // results[i] receives the book for keys[i], or nullptr.
+    void searchBatch(const vector<string>& keys, Book** results) {
+        const size_t GROUP = 16;
+        uint64_t hashes[GROUP];
+        for (size_t start = 0; start < keys.size(); start += GROUP) {
+            size_t end = min(keys.size(), start + GROUP);
+            for (size_t i = start; i < end; ++i) {
+                uint64_t hash = hashes[i - start] = hashString(keys[i]);
+                if (!table.empty()) prefetchRead(&table[hash & mask]);
+                if (!oldTable.empty()) prefetchRead(&oldTable[hash & oldMask]);
+            }
+            for (size_t i = start; i < end; ++i) {
+                Slot* slot = find(table, mask, hashes[i - start], keys[i]);
+                if (!slot) slot = find(oldTable, oldMask, hashes[i - start], keys[i]);
+                results[i] = slot ? slot->book : nullptr;
+            }
+        }
+    }
+
+    void remove(const string& key) {
+        uint64_t hash = hashString(key);
+        if (Slot* slot = find(table, mask, hash, key)) {
+            // Backward-shift deletion: pull the following displaced entries one slot closer to home
+            size_t i = slot - table.data();
+            for (size_t next = (i + 1) & mask; table[next].hash && probeDistance(next, table[next].hash, mask);
+                 i = next, next = (next + 1) & mask)
+                table[i] = table[next];
+            table[i] = Slot();
+            --count;
+        } else if (Slot* old = find(oldTable, oldMask, hash, key)) {
+            old->book = nullptr; // Leave a tombstone, the slot is skipped by migrate()
+            --oldCount;
+        } else {
+            return;
+        }
+        if (!oldTable.empty()) migrate();
+    }
+
+    // Grows the table in one step so that it can hold expectedCount books without rehashing;
+    // used before bulk loads, where incremental migration would only add overhead
+    void reserve(size_t expectedCount) {
+        size_t capacity = table.empty() ? MIN_CAPACITY : table.size();
+        while (expectedCount * 8 > capacity * 7) capacity *= 2;
+        if (capacity == table.size()) return;
+        while (!oldTable.empty()) migrate();
+        vector<Slot> previous(capacity);
+        previous.swap(table);
+        mask = capacity - 1;
+        for (const Slot& slot : previous)
+            if (slot.hash) place(table, mask, slot);
+    }
+
+    // Empties the index and releases its arrays (the books are not owned by the index)
+    void clear() {
+        vector<Slot>().swap(table);
+        vector<Slot>().swap(oldTable);
+        mask = count = oldMask = oldCount = migratePos = 0;
+    }
+
+    size_t size() const { return count + oldCount; } // Number of books indexed
+
+    // Probe lengths of the stored books (0 for a book in its home slot), counted by a scan of
+    // both tables for the stats dump
+    struct ProbeStats {
+        size_t books = 0, totalDistance = 0, longest = 0;
+    };
+    ProbeStats probeStats() const {
+        ProbeStats stats;
+        auto scan = [&stats](const vector<Slot>& t, size_t m) {
+            for (size_t i = 0; i < t.size(); ++i)
+                if (t[i].book) {
+                    size_t dist = probeDistance(i, t[i].hash, m);
+                    ++stats.books;
+                    stats.totalDistance += dist;
+                    stats.longest = max(stats.longest, dist);
+                }
+        };
+        scan(table, mask);
+        scan(oldTable, oldMask);
+        return stats;
+    }
+};
+
+// Title index: B+ tree with wide nodes keyed on (title, ISBN), so editions sharing a title
+// are distinct entries that sit next to each other. Leaves hold Book pointers in key order
+// and are linked to their neighbours for ordered scans; inner nodes hold copies of the
+// separator keys, so removing a book never leaves a dangling key behind. Every operation is
+// iterative, which keeps catalogs loaded in sorted order from degrading the tree.
+class TitleIndex {
+    private:
+    static const int LEAF_CAPACITY = 64;              // Books per leaf
+    static const int INNER_CAPACITY = 64;             // Separator keys per inner node
+    static const int LEAF_MIN = LEAF_CAPACITY / 2;    // Minimum fill of a non-root leaf
+    static const int INNER_MIN = INNER_CAPACITY / 2;  // Minimum fill of a non-root inner node
+    static const int MAX_HEIGHT = 24;                 // Far beyond any reachable height
+
+    struct Node {
+        bool isLeaf;
+        int count = 0; // Books in a leaf, separator keys in an inner node
+        Node(bool leaf) : isLeaf(leaf) {}
+    };
+    struct LeafNode : Node {
+        Book* books[LEAF_CAPACITY];
+        LeafNode* prev = nullptr; // Neighbouring leaves in title order
+        LeafNode* next = nullptr;
+        LeafNode() : Node(true) {}
+    };
+    struct Key {
+        string title, isbn;
+        void clear() { title.clear(); isbn.clear(); }
+    };
+    struct InnerNode : Node {
+        Key keys[INNER_CAPACITY];             // keys[i] separates children[i] and children[i + 1]
+        Node* children[INNER_CAPACITY + 1];
+        InnerNode() : Node(false) {}
+    };
+    struct PathEntry {
+        InnerNode* node; // Inner node visited on the way down
+        int index;       // Child taken from that node
+    };
+
+    Node* root = nullptr;
+    LeafNode* head = nullptr; // Leftmost leaf, start of in-order iteration
+    size_t bookCount = 0;
+    ObjectPool<LeafNode, 256> leafPool;   // Storage for the nodes of the tree
+    ObjectPool<InnerNode, 64> innerPool;
+
+    // Orders (title, isbn) pairs; an empty ISBN sorts before every edition of its title
+    static int compareKeys(const string& title1, const string& isbn1, const string& title2, const string& isbn2) {
+        int cmp = title1.compare(title2);
+        return cmp ? cmp : isbn1.compare(isbn2);
+    }
+
+    // Position of the first separator > (title, isbn), i.e. the child that may hold the key
+    static int searchKeys(const InnerNode* node, const string& title, const string& isbn) {
+        int lo = 0, hi = node->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (compareKeys(node->keys[mid].title, node->keys[mid].isbn, title, isbn) <= 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+    // Position of the first book >= (title, isbn) in a leaf
+    static int searchBooks(const LeafNode* leaf, const string& title, const string& isbn) {
+        int lo = 0, hi = leaf->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (compareKeys(leaf->books[mid]->title, leaf->books[mid]->isbn, title, isbn) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    // Walks from the root to the leaf that holds (or would hold) a key, recording the path
+    // when one is supplied
+    LeafNode* descend(const string& title, const string& isbn, PathEntry* path = nullptr, int* depth = nullptr) const {
+        Node* node = root;
+        int level = 0;
+        while (!node->isLeaf) {
+            InnerNode* inner = static_cast<InnerNode*>(node);
+            int index = searchKeys(inner, title, isbn);
+            if (path) path[level] = {inner, index};
+            ++level;
+            node = inner->children[index];
+        }
+        if (depth) *depth = level;
+        return static_cast<LeafNode*>(node);
+    }
+
+    // Removes keys[index] and children[index + 1] from an inner node
+    static void removeChild(InnerNode* node, int index) {
+        for (int i = index; i < node->count - 1; ++i) {
+            node->keys[i] = move(node->keys[i + 1]);
+            node->children[i + 1] = node->children[i + 2];
+        }
+        node->keys[--node->count].clear();
+    }
+
+    // Restores the minimum fill of a leaf after a removal by borrowing from or merging with
+    // a sibling, then walks up the path fixing any inner node that underflowed in turn
+    void rebalance(LeafNode* leaf, PathEntry* path, int depth) {
+        if (depth == 0) { // The leaf is the root
+            if (leaf->count == 0) {
+                leafPool.destroy(leaf);
+                root = head = nullptr;
+            }
+            return;
+        }
+        if (leaf->count >= LEAF_MIN) return;
+
+        InnerNode* parent = path[depth - 1].node;
+        int index = path[depth - 1].index;
+        LeafNode* left = index > 0 ? static_cast<LeafNode*>(parent->children[index - 1]) : nullptr;
+        LeafNode* right = index < parent->count ? static_cast<LeafNode*>(parent->children[index + 1]) : nullptr;
+        if (left && left->count > LEAF_MIN) { // Borrow the last book of the left sibling
+            for (int i = leaf->count; i > 0; --i) leaf->books[i] = leaf->books[i - 1];
+            leaf->books[0] = left->books[--left->count];
+            ++leaf->count;
+            parent->keys[index - 1] = {leaf->books[0]->title, leaf->books[0]->isbn};
+            return;
+        }
+        if (right && right->count > LEAF_MIN) { // Borrow the first book of the right sibling
+            leaf->books[leaf->count++] = right->books[0];
+            for (int i = 1; i < right->count; ++i) right->books[i - 1] = right->books[i];
+            --right->count;
+            parent->keys[index] = {right->books[0]->title, right->books[0]->isbn};
+            return;
+        }
+        if (!left) { // Merge the right sibling into this leaf instead
+            left = leaf;
+            leaf = right;
+            ++index;
+        }
+        for (int i = 0; i < leaf->count; ++i) left->books[left->count++] = leaf->books[i];
+        left->next = leaf->next;
+        if (left->next) left->next->prev = left;
+        leafPool.destroy(leaf);
+        removeChild(parent, index - 1);
+
+        // Propagate the underflow up the tree
+        InnerNode* node = parent;
+        for (int level = depth - 1;; --level) {
+            if (level == 0) { // Collapse a root left with a single child
+                if (node->count == 0) {
+                    root = node->children[0];
+                    innerPool.destroy(node);
+                }
+                return;
+            }
+            if (node->count >= INNER_MIN) return;
+
+            parent = path[level - 1].node;
+            index = path[level - 1].index;
+            InnerNode* leftInner = index > 0 ? static_cast<InnerNode*>(parent->children[index - 1]) : nullptr;
+            InnerNode* rightInner = index < parent->count ? static_cast<InnerNode*>(parent->children[index + 1]) : nullptr;
+            if (leftInner && leftInner->count > INNER_MIN) { // Rotate through the parent from the left
+                for (int i = node->count; i > 0; --i) {
+                    node->keys[i] = move(node->keys[i - 1]);
+                    node->children[i + 1] = node->children[i];
+                }
+                node->children[1] = node->children[0];
+                node->keys[0] = move(parent->keys[index - 1]);
+                node->children[0] = leftInner->children[leftInner->count];
+                parent->keys[index - 1] = move(leftInner->keys[--leftInner->count]);
+                ++node->count;
+                return;
+            }
+            if (rightInner && rightInner->count > INNER_MIN) { // Rotate through the parent from the right
+                node->keys[node->count] = move(parent->keys[index]);
+                node->children[++node->count] = rightInner->children[0];
+                parent->keys[index] = move(rightInner->keys[0]);
+                for (int i = 1; i < rightInner->count; ++i) {
+                    rightInner->keys[i - 1] = move(rightInner->keys[i]);
+                    rightInner->children[i - 1] = rightInner->children[i];
+                }
+                rightInner->children[rightInner->count - 1] = rightInner->children[rightInner->count];
+                rightInner->keys[--rightInner->count].clear();
+                return;
+            }
+            if (!leftInner) {
+                leftInner = node;
+                node = rightInner;
+                ++index;
+            }
+            // Pull the separator down and append the right node to the left one
+            leftInner->keys[leftInner->count] = move(parent->keys[index - 1]);
+            for (int i = 0; i < node->count; ++i) {
+                leftInner->keys[leftInner->count + 1 + i] = move(node->keys[i]);
+                leftInner->children[leftInner->count + 1 + i] = node->children[i];
+            }
+            leftInner->children[leftInner->count + 1 + node->count] = node->children[node->count];
+            leftInner->count += node->count + 1;
+            innerPool.destroy(node);
+            removeChild(parent, index - 1);
+            node = parent;
+        }
+    }
+
+    public:
+    TitleIndex() {}
+    TitleIndex(const TitleIndex&) = delete;
+    TitleIndex& operator=(const TitleIndex&) = delete;
+
+    // Inserts a book under (title, isbn); returns false if that exact key is already indexed
+    bool insert(Book* book) {
+        if (!root) root = head = leafPool.create();
+        PathEntry path[MAX_HEIGHT];
+        int depth;
+        LeafNode* leaf = descend(book->title, book->isbn, path, &depth);
+        int pos = searchBooks(leaf, book->title, book->isbn);
+        if (pos < leaf->count && leaf->books[pos]->title == book->title && leaf->books[pos]->isbn == book->isbn)
+            return false;
+        ++bookCount;
+        if (leaf->count < LEAF_CAPACITY) {
+            for (int i = leaf->count; i > pos; --i) leaf->books[i] = leaf->books[i - 1];
+            leaf->books[pos] = book;
+            ++leaf->count;
+            return true;
+        }
+
+        // Split the full leaf in half and link the new right half after it
+        Book* all[LEAF_CAPACITY + 1];
+        for (int i = 0, j = 0; i <= LEAF_CAPACITY; ++i) all[i] = i == pos ? book : leaf->books[j++];
+        LeafNode* right = leafPool.create();
+        leaf->count = (LEAF_CAPACITY + 1) / 2;
+        right->count = LEAF_CAPACITY + 1 - leaf->count;
+        for (int i = 0; i < leaf->count; ++i) leaf->books[i] = all[i];
+        for (int i = 0; i < right->count; ++i) right->books[i] = all[leaf->count + i];
+        right->next = leaf->next;
+        if (right->next) right->next->prev = right;
+        right->prev = leaf;
+        leaf->next = right;
+
+        // Insert the separator into the parents, splitting them as long as they are full
+        Key separator = {right->books[0]->title, right->books[0]->isbn};
+        Node* child = right;
+        while (depth > 0) {
+            InnerNode* parent = path[--depth].node;
+            int index = path[depth].index;
+            if (parent->count < INNER_CAPACITY) {
+                for (int i = parent->count; i > index; --i) {
+                    parent->keys[i] = move(parent->keys[i - 1]);
+                    parent->children[i + 1] = parent->children[i];
+                }
+                parent->keys[index] = move(separator);
+                parent->children[index + 1] = child;
+                ++parent->count;
+                return true;
+            }
+            Key keys[INNER_CAPACITY + 1];
+            Node* children[INNER_CAPACITY + 2];
+            children[0] = parent->children[0];
+            for (int i = 0, j = 0; i <= INNER_CAPACITY; ++i) {
+                if (i == index) {
+                    keys[i] = move(separator);
+                    children[i + 1] = child;
+                } else {
+                    keys[i] = move(parent->keys[j]);
+                    children[i + 1] = parent->children[j + 1];
+                    ++j;
+                }
+            }
+            int middle = (INNER_CAPACITY + 1) / 2; // keys[middle] moves up to the grandparent
+            InnerNode* sibling = innerPool.create();
+            parent->count = middle;
+            sibling->count = INNER_CAPACITY - middle;
+            for (int i = 0; i < middle; ++i) {
+                parent->keys[i] = move(keys[i]);
+                parent->children[i] = children[i];
+            }
+            parent->children[middle] = children[middle];
+            for (int i = 0; i < sibling->count; ++i) {
+                sibling->keys[i] = move(keys[middle + 1 + i]);
+                sibling->children[i] = children[middle + 1 + i];
+            }
+            sibling->children[sibling->count] = children[INNER_CAPACITY + 1];
+            for (int i = middle; i < INNER_CAPACITY; ++i) parent->keys[i].clear();
+            separator = move(keys[middle]);
+            child = sibling;
+        }
+
+        // The root itself was split: grow the tree by one level
+        InnerNode* newRoot = innerPool.create();
+        newRoot->keys[0] = move(separator);
+        newRoot->children[0] = root;
+        newRoot->children[1] = child;
+        newRoot->count = 1;
+        root = newRoot;
+        return true;
+    }
+
+    // Returns every book with the given title, ordered by ISBN, in one range scan
+    vector<Book*> search(const string& title) const {
+        vector<Book*> matches;
+        if (!root) return matches;
+        const LeafNode* leaf = descend(title, "");
+        for (int pos = searchBooks(leaf, title, ""); leaf; leaf = leaf->next, pos = 0) {
+            for (; pos < leaf->count; ++pos) {
+                if (leaf->books[pos]->title != title) return matches;
+                matches.push_back(leaf->books[pos]);
+            }
+        }
+        return matches;
+    }
+
+    // Removes exactly this book, located by its (title, isbn) key; returns false if absent
+    bool remove(const Book* book) {
+        if (!root) return false;
+        PathEntry path[MAX_HEIGHT];
+        int depth;
+        LeafNode* leaf = descend(book->title, book->isbn, path, &depth);
+        int pos = searchBooks(leaf, book->title, book->isbn);
+        if (pos == leaf->count || leaf->books[pos] != book) return false;
+        for (int i = pos + 1; i < leaf->count; ++i) leaf->books[i - 1] = leaf->books[i];
+        --leaf->count;
+        --bookCount;
+        rebalance(leaf, path, depth);
+        return true;
+    }
+
+    // Replaces the contents of the index with books already sorted by (title, isbn).
+    // Leaves are packed full and each level is built left to right in a single pass, which
+    // is much cheaper than inserting the books one at a time.
+    void bulkLoad(const vector<Book*>& sorted) {
+        clear();
+        if (sorted.empty()) return;
+        struct Entry {
+            Node* node;
+            Key firstKey; // Smallest key stored under node
+        };
+        vector<Entry> level;
+        size_t leafCount = (sorted.size() + LEAF_CAPACITY - 1) / LEAF_CAPACITY;
+        LeafNode* previous = nullptr;
+        for (size_t i = 0, pos = 0; i < leafCount; ++i) {
+            LeafNode* leaf = leafPool.create();
+            // Spread the books evenly so the last leaf never drops under the minimum fill
+            size_t take = (sorted.size() - pos) / (leafCount - i);
+            for (size_t j = 0; j < take; ++j) leaf->books[j] = sorted[pos + j];
+            leaf->count = static_cast<int>(take);
+            pos += take;
+            leaf->prev = previous;
+            if (previous) previous->next = leaf;
+            else head = leaf;
+            previous = leaf;
+            level.push_back({leaf, {leaf->books[0]->title, leaf->books[0]->isbn}});
+        }
+        while (level.size() > 1) { // Group each level under a new level of inner nodes
+            vector<Entry> parents;
+            size_t nodeCount = (level.size() + INNER_CAPACITY) / (INNER_CAPACITY + 1);
+            for (size_t i = 0, pos = 0; i < nodeCount; ++i) {
+                InnerNode* inner = innerPool.create();
+                size_t take = (level.size() - pos) / (nodeCount - i);
+                inner->children[0] = level[pos].node;
+                for (size_t j = 1; j < take; ++j) {
+                    inner->keys[j - 1] = move(level[pos + j].firstKey);
+                    inner->children[j] = level[pos + j].node;
+                }
+                inner->count = static_cast<int>(take - 1);
+                parents.push_back({inner, move(level[pos].firstKey)});
+                pos += take;
+            }
+            level.swap(parents);
+        }
+        root = level[0].node;
+        bookCount = sorted.size();
+    }
+
+    // Position in the chain of leaves. It is only valid while the tree is left unchanged, so
+    // callers iterate under the catalog lock and resume later from a key with upperBound.
+    class Cursor {
+        friend class TitleIndex;
+        const LeafNode* leaf = nullptr;
+        int pos = 0;
+
+        // Skips to the next leaf once the current one is used up
+        void settle() {
+            while (leaf && pos == leaf->count) {
+                leaf = leaf->next;
+                pos = 0;
+            }
+        }
+
+        public:
+        bool isValid() const { return leaf != nullptr; }
+        const Book* book() const { return leaf->books[pos]; }
+        void next() {
+            ++pos;
+            settle();
+        }
+    };
+
+    // Cursor at the first book in title order
+    Cursor begin() const {
+        Cursor cursor;
+        cursor.leaf = head;
+        cursor.settle();
+        return cursor;
+    }
+
+    // Cursor at the first book that sorts after (title, isbn), found with one descent
+    Cursor upperBound(const string& title, const string& isbn) const {
+        Cursor cursor;
+        if (!root) return cursor;
+        cursor.leaf = descend(title, isbn);
+        cursor.pos = searchBooks(cursor.leaf, title, isbn);
+        if (cursor.pos < cursor.leaf->count && cursor.book()->title == title && cursor.book()->isbn == isbn)
+            ++cursor.pos;
+        cursor.settle();
+        return cursor;
+    }
+
+    // Calls visit(book) for every book in title order
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        for (const LeafNode* leaf = head; leaf; leaf = leaf->next)
+            for (int i = 0; i < leaf->count; ++i) visit(leaf->books[i]);
+    }
+
+    // Frees every node of the tree in bulk (the books themselves are not owned by the index)
+    void clear() {
+        leafPool.release();
+        innerPool.release();
+        root = head = nullptr;
+        bookCount = 0;
+    }
+
+    bool isEmpty() const { return bookCount == 0; }
+    size_t size() const { return bookCount; }
+    int height() const { // Levels from the root to the leaves, 0 when empty
+        int levels = 0;
+        for (const Node* node = root; node; ++levels)
+            node = node->isLeaf ? nullptr : static_cast<const InnerNode*>(node)->children[0];
+        return levels;
+    }
+    size_t nodeCount() const { return leafPool.size() + innerPool.size(); }
+    size_t chunkCount() const { return leafPool.chunkCount() + innerPool.chunkCount(); }
+};
+
+// Search engine helpers. Titles and authors are matched word by word: a word is a run of
+// letters and digits, lower-cased (bytes from 0x80 up count as letters, so UTF-8 text stays
+// inside its word).
+template <typename Visitor>
+void forEachWord(string_view text, Visitor visit) {
+    string word;
+    for (size_t i = 0; i <= text.size(); ++i) {
+        unsigned char c = i < text.size() ? text[i] : ' ';
+        if (isalnum(c) || c >= 0x80) {
+            word += static_cast<char>(tolower(c));
+        } else if (!word.empty()) {
+            visit(word);
+            word.clear();
+        }
+    }
+}
+
+// Set of the letters in a word, one bit per letter or digit (other bytes share the high bits).
+// Every edit adds at most one letter to a word and removes at most one, so two words within k
+// edits differ by at most k letters each way; comparing signatures rules out most of the
+// vocabulary before any edit distance is computed.
+inline uint64_t letterSignature(string_view word) {
+    uint64_t signature = 0;
+    for (unsigned char c : word) {
+        unsigned bit = c >= 'a' && c <= 'z' ? c - 'a' : c >= '0' && c <= '9' ? 26 + (c - '0') : 36 + c % 28;
+        signature |= 1ULL << bit;
+    }
+    return signature;
+}
+
+inline unsigned popcount64(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(value);
+#else
+    unsigned count = 0;
+    for (; value; value &= value - 1) ++count;
+    return count;
+#endif
+}
+
+// Writes the positions of the signatures that may be within maxEdits of query to out and
+// returns how many there are
+inline size_t filterSignaturesScalar(const uint64_t* signatures, size_t count, uint64_t query, unsigned maxEdits, uint32_t* out) {
+    size_t found = 0;
+    for (size_t i = 0; i < count; ++i)
+        if (popcount64(query & ~signatures[i]) <= maxEdits && popcount64(signatures[i] & ~query) <= maxEdits)
+            out[found++] = static_cast<uint32_t>(i);
+    return found;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+// Per-lane popcount of four 64-bit words: nibble lookups with a byte shuffle, summed per lane
+__attribute__((target("avx2"))) inline __m256i popcountLanes(__m256i value) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowNibbles = _mm256_set1_epi8(0x0f);
+    __m256i low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(value, lowNibbles));
+    __m256i high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(value, 4), lowNibbles));
+    return _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256());
+}
+
+// AVX2 version of filterSignaturesScalar, four signatures per step
+__attribute__((target("avx2"))) inline size_t filterSignaturesAvx2(const uint64_t* signatures, size_t count, uint64_t query,
+                                                                   unsigned maxEdits, uint32_t* out) {
+    const __m256i wanted = _mm256_set1_epi64x(static_cast<long long>(query));
+    const __m256i limit = _mm256_set1_epi64x(maxEdits);
+    size_t found = 0, i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i candidate = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(signatures + i));
+        __m256i missing = popcountLanes(_mm256_andnot_si256(candidate, wanted)); // query & ~candidate
+        __m256i extra = popcountLanes(_mm256_andnot_si256(wanted, candidate));   // candidate & ~query
+        __m256i rejected = _mm256_or_si256(_mm256_cmpgt_epi64(missing, limit), _mm256_cmpgt_epi64(extra, limit));
+        unsigned keep = ~static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(rejected))) & 15;
+        for (; keep; keep &= keep - 1) out[found++] = static_cast<uint32_t>(i + __builtin_ctz(keep));
+    }
+    size_t tail = filterSignaturesScalar(signatures + i, count - i, query, maxEdits, out + found);
+    for (size_t j = found; j < found + tail; ++j) out[j] += static_cast<uint32_t>(i);  // Tail positions start at i
+    return found + tail;
+}
+#endif
+
+// Signature filter for this CPU: AVX2 when available, checked once
+inline size_t filterSignatures(const uint64_t* signatures, size_t count, uint64_t query, unsigned maxEdits, uint32_t* out) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2) return filterSignaturesAvx2(signatures, count, query, maxEdits, out);
+#endif
+    return filterSignaturesScalar(signatures, count, query, maxEdits, out);
+}
+
+// Edit distance (insertions, deletions, substitutions and swaps of neighbouring letters) if
+// it is at most maxEdits, otherwise maxEdits + 1. Stops as soon as a whole row exceeds the bound.
+inline unsigned boundedEditDistance(string_view a, string_view b, unsigned maxEdits) {
+    size_t n = a.size(), m = b.size();
+    if ((n > m ? n - m : m - n) > maxEdits) return maxEdits + 1;
+    unsigned rows[3 * 64];
+    vector<unsigned> longRows;
+    unsigned* before = rows;
+    if (m >= 64) {
+        longRows.resize(3 * (m + 1));
+        before = longRows.data();
+    }
+    unsigned* previous = before + m + 1;
+    unsigned* current = previous + m + 1;
+    for (size_t j = 0; j <= m; ++j) previous[j] = static_cast<unsigned>(j);
+    for (size_t i = 1; i <= n; ++i) {
+        current[0] = static_cast<unsigned>(i);
+        unsigned rowMin = current[0];
+        for (size_t j = 1; j <= m; ++j) {
+            unsigned cost = a[i - 1] == b[j - 1] ? 0 : 1;
+            current[j] = min({previous[j] + 1, current[j - 1] + 1, previous[j - 1] + cost});
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1])
+                current[j] = min(current[j], before[j - 2] + 1);
+            rowMin = min(rowMin, current[j]);
+        }
+        if (rowMin > maxEdits) return maxEdits + 1;
+        unsigned* recycled = before;
+        before = previous;
+        previous = current;
+        current = recycled;
+    }
+    return min(previous[m], maxEdits + 1);
+}
+
+// Typos tolerated in a query word: none in short words or in numbers (years, volumes)
+inline unsigned allowedEdits(string_view word) {
+    for (char c : word)
+        if (c >= '0' && c <= '9') return 0;
+    return word.size() < 4 ? 0 : word.size() < 7 ? 1 : 2;
+}
+
+// How well one word of a book matches one query word: 8 for the same word, 6 when the query
+// is a prefix, 4 when it occurs inside the word, 3 or 2 for a word one or two typos away,
+// 0 for no match
+inline int matchQuality(const string& query, string_view word) {
+    if (word.compare(0, query.size(), query) == 0) return word.size() == query.size() ? 8 : 6;
+    if (query.size() >= 3 && word.find(query) != string_view::npos) return 4;
+    unsigned maxEdits = allowedEdits(query);
+    if (!maxEdits || (query.size() > word.size() ? query.size() - word.size() : word.size() - query.size()) > maxEdits)
+        return 0;
+    unsigned distance = boundedEditDistance(query, word, maxEdits);
+    return distance <= maxEdits ? 4 - static_cast<int>(distance) : 0;
+}
+
+// Search index over the words of every title and author. Each distinct word (term) is stored
+// once with the ids of the books that contain it; the term vocabulary is what gets searched:
+// - prefixes by a range scan over the terms in sorted order,
+// - substrings through a trigram index mapping every three-letter sequence to its terms,
+// - typos by comparing letter signatures (bucketed by word length) and then edit distance.
+// Books get consecutive ids, so posting lists stay sorted by appending. Removed books leave
+// their id behind as nullptr and are skipped when results are collected; a book that undo
+// took out keeps its postings, so redo only puts it back in its slot. Once dead ids outnumber
+// the live ones the index is rebuilt from the live books.
+class SearchIndex {
+    private:
+    static constexpr size_t MAX_BUCKET = 32; // Words longer than this share the last length bucket
+    struct LengthBucket {
+        vector<uint64_t> signatures; // letterSignature of each term, scanned by filterSignatures
+        vector<uint32_t> terms;
+    };
+
+    vector<Book*> books;                // Book id -> book, nullptr once removed
+    unordered_map<uint32_t, Book*> parked; // Removed books that may be restored, by id
+    vector<uint32_t> bookTerms;         // Words of every book in id order: term id << 1 | 1 if in the title
+    vector<uint32_t> bookTermsStart;    // Book id -> first entry in bookTerms; one extra entry at the end
+    size_t liveBooks = 0;
+    string termText;                    // Characters of every term, back to back
+    vector<uint32_t> termStart;         // Term id -> offset in termText; one extra entry at the end
+    vector<uint32_t> termSlots;         // Open-addressing table of term ids by word, UINT32_MAX if empty
+    vector<vector<uint32_t>> postings;  // Term id -> ids of the books containing it, ascending
+    vector<uint32_t> sortedTerms;       // Term ids in word order
+    vector<uint32_t> recentTerms;       // Newer term ids, merged into sortedTerms in batches
+    unordered_map<uint32_t, vector<uint32_t>> trigramTerms; // Trigram -> ids of the terms containing it, ascending
+    LengthBucket buckets[MAX_BUCKET + 1];
+
+    static uint32_t trigram(const string& word, size_t i) {
+        return static_cast<unsigned char>(word[i]) << 16 | static_cast<unsigned char>(word[i + 1]) << 8 |
+               static_cast<unsigned char>(word[i + 2]);
+    }
+
+    string_view term(uint32_t id) const {
+        return string_view(termText).substr(termStart[id], termStart[id + 1] - termStart[id]);
+    }
+
+    uint32_t intern(const string& word) {
+        if (termSlots.empty()) termSlots.assign(1024, UINT32_MAX);
+        size_t mask = termSlots.size() - 1, slot = hashString(word) & mask;
+        for (; termSlots[slot] != UINT32_MAX; slot = (slot + 1) & mask)
+            if (term(termSlots[slot]) == word) return termSlots[slot];
+        uint32_t id = static_cast<uint32_t>(postings.size());
+        if (termStart.empty()) termStart.push_back(0);
+        termText += word;
+        termStart.push_back(static_cast<uint32_t>(termText.size()));
+        postings.emplace_back();
+        termSlots[slot] = id;
+        if ((id + 1) * 2 > termSlots.size()) {  // Keep the table at most half full
+            vector<uint32_t> grown(termSlots.size() * 2, UINT32_MAX);
+            for (uint32_t existing = 0; existing <= id; ++existing) {
+                size_t i = hashString(term(existing)) & (grown.size() - 1);
+                while (grown[i] != UINT32_MAX) i = (i + 1) & (grown.size() - 1);
+                grown[i] = existing;
+            }
+            termSlots.swap(grown);
+        }
+        for (size_t i = 0; i + 3 <= word.size(); ++i) {
+            vector<uint32_t>& list = trigramTerms[trigram(word, i)];
+            if (list.empty() || list.back() != id) list.push_back(id);
+        }
+        LengthBucket& bucket = buckets[min(word.size(), MAX_BUCKET)];
+        bucket.signatures.push_back(letterSignature(word));
+        bucket.terms.push_back(id);
+        recentTerms.push_back(id);
+        if (recentTerms.size() > max<size_t>(1024, sortedTerms.size() / 8)) mergeRecentTerms();
+        return id;
+    }
+
+    // Sorting new terms in batches keeps the amortized cost of an insert low
+    void mergeRecentTerms() {
+        auto byWord = [this](uint32_t a, uint32_t b) { return term(a) < term(b); };
+        sort(recentTerms.begin(), recentTerms.end(), byWord);
+        vector<uint32_t> merged(sortedTerms.size() + recentTerms.size());
+        std::merge(sortedTerms.begin(), sortedTerms.end(), recentTerms.begin(), recentTerms.end(), merged.begin(), byWord);
+        sortedTerms.swap(merged);
+        recentTerms.clear();
+    }
+
+    // Every term that can match the query word, found through the prefix range, the trigram
+    // index and the signature filter
+    void matchingTerms(const string& word, vector<uint32_t>& out) const {
+        auto low = lower_bound(sortedTerms.begin(), sortedTerms.end(), word,
+                               [this](uint32_t id, const string& key) { return term(id) < key; });
+        for (; low != sortedTerms.end() && term(*low).compare(0, word.size(), word) == 0; ++low) out.push_back(*low);
+        for (uint32_t id : recentTerms)
+            if (term(id).compare(0, word.size(), word) == 0) out.push_back(id);
+
+        if (word.size() >= 3) {
+            // Terms containing every trigram of the word, smallest posting list first
+            vector<const vector<uint32_t>*> lists;
+            for (size_t i = 0; i + 3 <= word.size(); ++i) {
+                auto found = trigramTerms.find(trigram(word, i));
+                if (found == trigramTerms.end()) {
+                    lists.clear();
+                    break;
+                }
+                lists.push_back(&found->second);
+            }
+            if (!lists.empty()) {
+                sort(lists.begin(), lists.end(), [](auto a, auto b) { return a->size() < b->size(); });
+                for (uint32_t id : *lists[0]) {
+                    bool inAll = true;
+                    for (size_t i = 1; i < lists.size() && inAll; ++i) inAll = binary_search(lists[i]->begin(), lists[i]->end(), id);
+                    if (inAll && term(id).find(word) != string_view::npos) out.push_back(id);
+                }
+            }
+        }
+
+        unsigned maxEdits = allowedEdits(word);
+        if (maxEdits) {
+            uint64_t signature = letterSignature(word);
+            vector<uint32_t> candidates;
+            size_t first = word.size() > maxEdits ? word.size() - maxEdits : 0;
+            for (size_t length = first; length <= min(word.size() + maxEdits, MAX_BUCKET); ++length) {
+                const LengthBucket& bucket = buckets[length];
+                candidates.resize(bucket.signatures.size());
+                size_t found = filterSignatures(bucket.signatures.data(), bucket.signatures.size(), signature, maxEdits, candidates.data());
+                for (size_t i = 0; i < found; ++i) {
+                    uint32_t id = bucket.terms[candidates[i]];
+                    if (boundedEditDistance(word, term(id), maxEdits) <= maxEdits) out.push_back(id);
+                }
+            }
+        }
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+    }
+
+    public:
+    void add(Book* book) {
+        uint32_t id = static_cast<uint32_t>(books.size());
+        books.push_back(book);
+        book->searchId = id;
+        ++liveBooks;
+        if (bookTermsStart.empty()) bookTermsStart.push_back(0);
+        uint32_t inTitle = 1;
+        auto index = [this, id, &inTitle](const string& word) {
+            uint32_t term = intern(word);
+            vector<uint32_t>& list = postings[term];
+            if (list.empty() || list.back() != id) list.push_back(id);
+            bookTerms.push_back(term << 1 | inTitle);
+        };
+        forEachWord(book->title, index);
+        inTitle = 0;
+        forEachWord(book->author, index);
+        bookTermsStart.push_back(static_cast<uint32_t>(bookTerms.size()));
+    }
+
+    void remove(Book* book) {
+        if (book->searchId < books.size() && books[book->searchId] == book) {
+            books[book->searchId] = nullptr;
+            parked[book->searchId] = book;
+            --liveBooks;
+            if (books.size() - liveBooks > max<size_t>(1024, liveBooks)) compact();
+        }
+    }
+
+    // Puts back a removed book under its old id, or adds it again if the id is gone
+    void restore(Book* book) {
+        auto found = parked.find(book->searchId);
+        if (found == parked.end() || found->second != book) return add(book);
+        books[book->searchId] = book;
+        parked.erase(found);
+        ++liveBooks;
+    }
+
+    // A removed book is about to be freed and will not be restored
+    void discard(const Book* book) {
+        auto found = parked.find(book->searchId);
+        if (found != parked.end() && found->second == book) parked.erase(found);
+    }
+
+    // Rebuilds the index from the live books, dropping the ids and postings of removed ones
+    void compact() {
+        vector<Book*> live;
+        live.reserve(liveBooks);
+        for (Book* book : books)
+            if (book) live.push_back(book);
+        for (auto& entry : parked) entry.second->searchId = UINT32_MAX;
+        clear();
+        for (Book* book : live) add(book);
+    }
+
+    // Ranked search over titles and authors. Every query word has to match a word of the
+    // book's title or author exactly, as a prefix, as a substring or within a typo or two;
+    // matches in the title count double. Books are ordered by score, then by shorter title.
+    // Puts results [offset, offset + limit) in page and returns the total number of matches.
+    size_t search(const string& query, size_t offset, size_t limit, vector<const Book*>& page) const {
+        page.clear();
+        vector<string> words;
+        forEachWord(query, [&words](const string& word) { words.push_back(word); });
+        if (words.empty()) return 0;
+
+        // The terms each query word matches, with the quality of the match. Candidates come
+        // from the query word whose terms have the fewest books.
+        vector<vector<pair<uint32_t, int>>> matched(words.size());
+        vector<uint32_t> terms;
+        size_t driver = 0, driverBooks = SIZE_MAX;
+        for (size_t w = 0; w < words.size(); ++w) {
+            terms.clear();
+            matchingTerms(words[w], terms);
+            size_t count = 0;
+            for (uint32_t id : terms) {
+                matched[w].emplace_back(id, matchQuality(words[w], term(id)));
+                count += postings[id].size();
+            }
+            if (count < driverBooks) {
+                driverBooks = count;
+                driver = w;
+            }
+        }
+        vector<uint32_t> candidates;
+        if (matched[driver].size() == 1) {
+            candidates = postings[matched[driver][0].first];  // Already sorted and unique
+        } else if (driverBooks > books.size() / 32) {
+            // Many candidates: deduplicate through a bitmap instead of sorting them
+            vector<uint64_t> seen((books.size() + 63) / 64);
+            for (const auto& term : matched[driver])
+                for (uint32_t id : postings[term.first]) seen[id >> 6] |= 1ULL << (id & 63);
+            for (size_t i = 0; i < seen.size(); ++i)
+                for (uint64_t bits = seen[i]; bits; bits &= bits - 1)
+                    candidates.push_back(static_cast<uint32_t>(i * 64 + popcount64((bits & -bits) - 1)));  // Index of the lowest set bit
+        } else {
+            candidates.reserve(driverBooks);
+            for (const auto& term : matched[driver])
+                candidates.insert(candidates.end(), postings[term.first].begin(), postings[term.first].end());
+            sort(candidates.begin(), candidates.end());
+            candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+        }
+
+        // Match quality of every matched term for every query word, in a small open-addressing
+        // table, so scoring a candidate costs one probe per word of the book
+        size_t matchedCount = 0;
+        for (const auto& terms : matched) matchedCount += terms.size();
+        size_t tableSize = 16;
+        while (tableSize < matchedCount * 2) tableSize <<= 1;
+        vector<uint32_t> tableTerms(tableSize, UINT32_MAX);
+        vector<int> tableQuality(tableSize * words.size());
+        auto slotOf = [&](uint32_t term) {
+            size_t slot = (term * 2654435761u) & (tableSize - 1);
+            while (tableTerms[slot] != term && tableTerms[slot] != UINT32_MAX) slot = (slot + 1) & (tableSize - 1);
+            return slot;
+        };
+        for (size_t w = 0; w < words.size(); ++w)
+            for (const auto& term : matched[w]) {
+                size_t slot = slotOf(term.first);
+                tableTerms[slot] = term.first;
+                tableQuality[slot * words.size() + w] = term.second;
+            }
+
+        // Score each candidate from its stored term ids, without looking at its text
+        vector<pair<int, const Book*>> hits;
+        vector<int> best(words.size());
+        for (uint32_t id : candidates) {
+            const Book* book = books[id];
+            if (!book) continue;
+            fill(best.begin(), best.end(), 0);
+            for (size_t i = bookTermsStart[id]; i < bookTermsStart[id + 1]; ++i) {
+                size_t slot = slotOf(bookTerms[i] >> 1);
+                if (tableTerms[slot] == UINT32_MAX) continue;
+                uint32_t inTitle = bookTerms[i] & 1;
+                for (size_t w = 0; w < words.size(); ++w)
+                    best[w] = max(best[w], tableQuality[slot * words.size() + w] << inTitle);
+            }
+            int score = 0;
+            for (int quality : best) {
+                if (!quality) {
+                    score = 0;
+                    break;
+                }
+                score += quality;
+            }
+            if (score) hits.emplace_back(score, book);
+        }
+
+        size_t end = min(hits.size(), offset + limit);
+        if (offset >= end) return hits.size();
+        partial_sort(hits.begin(), hits.begin() + end, hits.end(), [](const auto& a, const auto& b) {
+            if (a.first != b.first) return a.first > b.first;
+            if (a.second->title.size() != b.second->title.size()) return a.second->title.size() < b.second->title.size();
+            int cmp = a.second->title.compare(b.second->title);
+            return cmp ? cmp < 0 : a.second->isbn < b.second->isbn;
+        });
+        for (size_t i = offset; i < end; ++i) page.push_back(hits[i].second);
+        return hits.size();
+    }
+
+    // Empties the index and releases its memory
+    void clear() {
+        vector<Book*>().swap(books);
+        unordered_map<uint32_t, Book*>().swap(parked);
+        vector<uint32_t>().swap(bookTerms);
+        vector<uint32_t>().swap(bookTermsStart);
+        string().swap(termText);
+        vector<uint32_t>().swap(termStart);
+        vector<uint32_t>().swap(termSlots);
+        vector<vector<uint32_t>>().swap(postings);
+        vector<uint32_t>().swap(sortedTerms);
+        vector<uint32_t>().swap(recentTerms);
+        unordered_map<uint32_t, vector<uint32_t>>().swap(trigramTerms);
+        for (LengthBucket& bucket : buckets) bucket = LengthBucket();
+        liveBooks = 0;
+    }
+
+    size_t size() const { return liveBooks; }
+    size_t termCount() const { return postings.size(); }
+    size_t postingsSize() const { return bookTerms.size(); }
+
+    // Every term signature of the index, for benchmarking the candidate filter
+    vector<uint64_t> allSignatures() const {
+        vector<uint64_t> all;
+        for (const LengthBucket& bucket : buckets) all.insert(all.end(), bucket.signatures.begin(), bucket.signatures.end());
+        return all;
+    }
+};
+
+// Linked-list queue, single-threaded. The library now uses IssueQueue; this one is kept as
+// the baseline for --bench-queue.
+class QueueNode {
+    public:
+    Book* book; // Pointer to a Book object stored in this queue node
+    QueueNode* next = nullptr; // Pointer to the next node in the queue, initialized to nullptr
+    QueueNode* prev = nullptr; // Pointer to the previous node, lets the newest entry be withdrawn
+
+    // Constructor to initialize the node with a Book pointer
+    QueueNode(Book* b) : book(b) {}
+};
+
+class CustomQueue {
+    private:
+    QueueNode* front = nullptr; // Pointer to the front node
+    QueueNode* rear = nullptr;  // Pointer to the rear node
+    ObjectPool<QueueNode> nodePool; // Storage for the queue nodes
+
+    public:
+    // Adds a new book to the rear of the queue
+    void enqueue(Book* book) {
+        QueueNode* newNode = nodePool.create(book); // Create a new node with the book
+        if (!rear) // If the queue is empty, both front and rear point to the new node
+            front = rear = newNode;
+        else {
+            newNode->prev = rear;
+            rear = rear->next = newNode; // Otherwise, add the new node to the rear
+        }
+    }
+
+    // Removes and returns the book from the front of the queue
+    Book* dequeue() {
+        if (!front) return nullptr; // Return nullptr if the queue is empty
+        QueueNode* temp = front;    // Temporary pointer to the front node
+        front = front->next;        // Move the front pointer to the next node
+        if (!front) rear = nullptr; // If the queue is now empty, set rear to nullptr
+        else front->prev = nullptr;
+        Book* book = temp->book;    // Get the book from the removed node
+        nodePool.destroy(temp);     // Recycle the removed node
+        return book;                // Return the book
+    }
+
+    // Removes and returns the book at the rear of the queue (the most recent enqueue)
+    Book* removeRear() {
+        if (!rear) return nullptr;
+        QueueNode* temp = rear;
+        rear = rear->prev;
+        if (!rear) front = nullptr;
+        else rear->next = nullptr;
+        Book* book = temp->book;
+        nodePool.destroy(temp);
+        return book;
+    }
+
+    // Checks if the queue is empty
+    bool isEmpty() const { return !front; }
+    size_t size() const { return nodePool.size(); }
+
+    // Calls visit(book) for every queued book from front to rear
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        for (const QueueNode* node = front; node; node = node->next) visit(node->book);
+    }
+
+    // Removes every entry at once
+    void clear() {
+        nodePool.release();
+        front = rear = nullptr;
+    }
+    size_t chunkCount() const { return nodePool.chunkCount(); }
+};
+
+
+// Bounded lock-free multi-producer/multi-consumer queue of issued books: a ring of slots,
+// each with a sequence number that tells producers and consumers whose turn the slot is
+// (Vyukov's bounded MPMC queue). Enqueue and dequeue are one compare-and-swap on the
+// shared position plus a store to the slot; nothing is allocated after construction.
+class IssueQueue {
+    private:
+    struct Slot {
+        atomic<size_t> sequence;
+        Book* book;
+    };
+    Slot* slots;
+    size_t mask; // Capacity - 1; the capacity is a power of two
+    alignas(64) atomic<size_t> enqueuePos{0}; // Separate cache lines, so producers and
+    alignas(64) atomic<size_t> dequeuePos{0}; // consumers do not invalidate each other
+    alignas(64) atomic<size_t> waiters{0};    // Consumers blocked in waitDequeue
+    mutex waitLock;
+    condition_variable ready;
+
+    // Wakes blocked consumers; only takes the mutex when one is waiting
+    void notifyWaiters() {
+        atomic_thread_fence(memory_order_seq_cst);  // Pairs with the fence in waitDequeue
+        if (waiters.load(memory_order_relaxed) == 0) return;
+        lock_guard<mutex> guard(waitLock);
+        ready.notify_all();
+    }
+
+    public:
+    IssueQueue(size_t capacity = 65536) {
+        size_t rounded = 2;
+        while (rounded < capacity) rounded <<= 1;
+        slots = new Slot[rounded];
+        mask = rounded - 1;
+        for (size_t i = 0; i < rounded; ++i) slots[i].sequence.store(i, memory_order_relaxed);
+    }
+    IssueQueue(const IssueQueue&) = delete;
+    IssueQueue& operator=(const IssueQueue&) = delete;
+    ~IssueQueue() { delete[] slots; }
+
+    // Adds a book at the rear; false if the queue is full
+    bool enqueue(Book* book) {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[pos & mask];
+            size_t sequence = slot->sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;  // The slot still holds an entry from the previous lap
+            } else {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+        slot->book = book;
+        slot->sequence.store(pos + 1, memory_order_release);  // Publish the entry
+        notifyWaiters();
+        return true;
+    }
+
+    // Removes and returns the book at the front, or nullptr if the queue is empty
+    Book* dequeue() {
+        size_t pos = dequeuePos.load(memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[pos & mask];
+            size_t sequence = slot->sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return nullptr;  // Nothing published at this position yet
+            } else {
+                pos = dequeuePos.load(memory_order_relaxed);
+            }
+        }
+        Book* book = slot->book;
+        slot->sequence.store(pos + mask + 1, memory_order_release);  // Hand the slot to the next lap
+        return book;
+    }
+
+    // Like dequeue, but blocks until a book arrives or the timeout expires (nullptr then).
+    // Spins briefly first, since under load the next entry is usually microseconds away.
+    Book* waitDequeue(chrono::milliseconds timeout) {
+        for (int spin = 0; spin < 64; ++spin) {
+            if (Book* book = dequeue()) return book;
+            this_thread::yield();
+        }
+        auto deadline = chrono::steady_clock::now() + timeout;
+        unique_lock<mutex> guard(waitLock);
+        waiters.fetch_add(1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);  // Register before the final emptiness check
+        Book* book = nullptr;
+        ready.wait_until(guard, deadline, [this, &book] { return (book = dequeue()) != nullptr; });
+        waiters.fetch_sub(1, memory_order_relaxed);
+        return book;
+    }
+
+    // Checks if the queue is empty
+    bool isEmpty() const {
+        size_t pos = dequeuePos.load(memory_order_acquire);
+        return static_cast<intptr_t>(slots[pos & mask].sequence.load(memory_order_acquire)) -
+                   static_cast<intptr_t>(pos + 1) < 0;
+    }
+    size_t size() const {
+        size_t tail = enqueuePos.load(memory_order_acquire), head = dequeuePos.load(memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+    size_t capacity() const { return mask + 1; }
+
+    // The members below must not run concurrently with any other call.
+
+    // Removes the newest entry for this book, shifting later entries forward; used by undo
+    bool withdraw(const Book* book) {
+        size_t head = dequeuePos.load(memory_order_relaxed), tail = enqueuePos.load(memory_order_relaxed);
+        size_t pos = tail;
+        while (pos > head && slots[(pos - 1) & mask].book != book) --pos;
+        if (pos == head) return false;  // Already consumed
+        for (; pos < tail; ++pos) slots[(pos - 1) & mask].book = slots[pos & mask].book;
+        slots[(tail - 1) & mask].sequence.store(tail - 1, memory_order_relaxed);  // Free the last slot
+        enqueuePos.store(tail - 1, memory_order_relaxed);
+        return true;
+    }
+
+    // Calls visit(book) for every queued book from front to rear
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        size_t tail = enqueuePos.load(memory_order_acquire);
+        for (size_t pos = dequeuePos.load(memory_order_acquire); pos < tail; ++pos) visit(slots[pos & mask].book);
+    }
+
+    // Removes every entry at once
+    void clear() {
+        while (dequeue()) {}
+    }
+};
+
+// Password Hashing
+// SHA-256 (FIPS 180-4), fed in pieces of any size
+class Sha256 {
+private:
+    uint32_t state[8];
+    uint8_t block[64];
+    size_t used = 0;      // Bytes waiting in block
+    uint64_t total = 0;   // Bytes hashed so far
+
+    static uint32_t rotate(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+public:
+    static const size_t SIZE = 32;
+
+    // One block of the compression function
+    static void compress(uint32_t* state, const uint8_t* data) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = uint32_t(data[4 * i]) << 24 | uint32_t(data[4 * i + 1]) << 16 | uint32_t(data[4 * i + 2]) << 8 | data[4 * i + 3];
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+        }
+        state[0] += a, state[1] += b, state[2] += c, state[3] += d, state[4] += e, state[5] += f, state[6] += g, state[7] += h;
+    }
+
+    Sha256() {
+        static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(state, initial, sizeof state);
+    }
+
+    Sha256& update(const void* data, size_t length) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        total += length;
+        if (used) {
+            size_t take = min(length, 64 - used);
+            memcpy(block + used, bytes, take);
+            used += take, bytes += take, length -= take;
+            if (used < 64) return *this;
+            compress(state, block);
+            used = 0;
+        }
+        for (; length >= 64; bytes += 64, length -= 64) compress(state, bytes);
+        memcpy(block, bytes, length);
+        used = length;
+        return *this;
+    }
+
+    void finish(uint8_t* digest) {
+        uint64_t bits = total * 8;
+        uint8_t padding[72] = {0x80};
+        size_t padLength = (used < 56 ? 56 : 120) - used;
+        for (int i = 0; i < 8; ++i) padding[padLength + i] = uint8_t(bits >> (56 - 8 * i));
+        update(padding, padLength + 8);
+        for (int i = 0; i < 8; ++i)
+            for (int j = 0; j < 4; ++j) digest[4 * i + j] = uint8_t(state[i] >> (24 - 8 * j));
+    }
+
+    // The state after the 64-byte blocks hashed so far (only whole blocks, as HMAC keys are)
+    const uint32_t* words() const { return state; }
+};
+
+// HMAC-SHA256 with the keyed inner and outer states prepared once, so that each message
+// costs two compressions more than its own length (PBKDF2 hashes one per iteration)
+class HmacSha256 {
+private:
+    Sha256 inner, outer;
+
+public:
+    explicit HmacSha256(string_view key) {
+        uint8_t block[64] = {};
+        if (key.size() > 64) Sha256().update(key.data(), key.size()).finish(block);
+        else memcpy(block, key.data(), key.size());
+        uint8_t pad[64];
+        for (int i = 0; i < 64; ++i) pad[i] = block[i] ^ 0x36;
+        inner.update(pad, 64);
+        for (int i = 0; i < 64; ++i) pad[i] = block[i] ^ 0x5c;
+        outer.update(pad, 64);
+    }
+
+    void sign(const void* message, size_t length, uint8_t* mac) const {
+        Sha256 hash = inner;
+        hash.update(message, length).finish(mac);
+        hash = outer;
+        hash.update(mac, Sha256::SIZE).finish(mac);
+    }
+
+    // sign() for a 32-byte message, in place: each half is one padded block, compressed
+    // directly from the prepared state. This is the whole cost of a PBKDF2 iteration.
+    void signDigest(uint8_t* mac) const {
+        uint8_t block[64] = {};
+        block[32] = 0x80;
+        block[62] = 0x03;  // Message length: (64 + 32) * 8 = 768 bits
+        for (const Sha256* half : {&inner, &outer}) {
+            uint32_t state[8];
+            memcpy(state, half->words(), sizeof state);
+            memcpy(block, mac, Sha256::SIZE);
+            Sha256::compress(state, block);
+            for (int i = 0; i < 8; ++i)
+                for (int j = 0; j < 4; ++j) mac[4 * i + j] = uint8_t(state[i] >> (24 - 8 * j));
+        }
+    }
+};
+
+// Compares two digests in time that does not depend on where they differ
+inline bool sameDigest(const uint8_t* a, const uint8_t* b, size_t length) {
+    uint8_t difference = 0;
+    for (size_t i = 0; i < length; ++i) difference |= a[i] ^ b[i];
+    return difference == 0;
+}
+
+// A stored password: PBKDF2-HMAC-SHA256 with a random 16-byte salt. The iteration count is
+// the cost; it is kept with each hash, so raising it only affects passwords set afterwards.
+struct PasswordHash {
+    uint32_t iterations = 0;
+    uint8_t salt[16] = {};
+    uint8_t digest[Sha256::SIZE] = {};
+
+    static PasswordHash create(string_view password, uint32_t iterations) {
+        PasswordHash hash;
+        hash.iterations = max<uint32_t>(iterations, 1);
+        static thread_local mt19937_64 random(random_device{}());  // Salts need to be unique, not secret
+        for (size_t i = 0; i < sizeof hash.salt; i += 8) {
+            uint64_t word = random();
+            memcpy(hash.salt + i, &word, 8);
+        }
+        derive(password, hash.salt, hash.iterations, hash.digest);
+        return hash;
+    }
+
+    // Runs the slow hash and compares the result
+    bool matches(string_view password) const {
+        uint8_t computed[Sha256::SIZE];
+        derive(password, salt, iterations, computed);
+        return sameDigest(computed, digest, sizeof digest);
+    }
+
+    // Text form for the write-ahead log: pbkdf2-sha256$<iterations>$<salt hex>$<digest hex>
+    string toString() const {
+        static const char hexDigits[] = "0123456789abcdef";
+        string text = "pbkdf2-sha256$" + to_string(iterations) + "$";
+        for (uint8_t byte : salt) text += hexDigits[byte >> 4], text += hexDigits[byte & 15];
+        text += '$';
+        for (uint8_t byte : digest) text += hexDigits[byte >> 4], text += hexDigits[byte & 15];
+        return text;
+    }
+
+    static bool parse(string_view text, PasswordHash& hash) {
+        const string_view prefix = "pbkdf2-sha256$";
+        if (text.substr(0, prefix.size()) != prefix) return false;
+        text.remove_prefix(prefix.size());
+        size_t dollar = text.find('$');
+        if (dollar == string_view::npos || dollar == 0 || dollar > 10) return false;
+        uint64_t iterations = 0;
+        for (char c : text.substr(0, dollar)) {
+            if (c < '0' || c > '9') return false;
+            iterations = iterations * 10 + (c - '0');
+        }
+        text.remove_prefix(dollar + 1);
+        if (iterations == 0 || iterations > UINT32_MAX || text.size() != 2 * sizeof hash.salt + 1 + 2 * sizeof hash.digest ||
+            text[2 * sizeof hash.salt] != '$' || !parseHex(text.substr(0, 2 * sizeof hash.salt), hash.salt) ||
+            !parseHex(text.substr(2 * sizeof hash.salt + 1), hash.digest))
+            return false;
+        hash.iterations = static_cast<uint32_t>(iterations);
+        return true;
+    }
+
+private:
+    // PBKDF2 for a single 32-byte output block
+    static void derive(string_view password, const uint8_t* salt, uint32_t iterations, uint8_t* out) {
+        HmacSha256 mac(password);
+        uint8_t message[sizeof(PasswordHash::salt) + 4];
+        memcpy(message, salt, sizeof(PasswordHash::salt));
+        memcpy(message + sizeof(PasswordHash::salt), "\0\0\0\1", 4);  // Block index 1, big-endian
+        uint8_t u[Sha256::SIZE];
+        mac.sign(message, sizeof message, u);
+        memcpy(out, u, sizeof u);
+        for (uint32_t i = 1; i < iterations; ++i) {
+            mac.signDigest(u);
+            for (size_t j = 0; j < sizeof u; ++j) out[j] ^= u[j];
+        }
+    }
+
+    static bool parseHex(string_view text, uint8_t* out) {
+        auto nibble = [](char c) { return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1; };
+        for (size_t i = 0; i < text.size(); i += 2) {
+            int high = nibble(text[i]), low = nibble(text[i + 1]);
+            if (high < 0 || low < 0) return false;
+            out[i / 2] = uint8_t(high << 4 | low);
+        }
+        return true;
+    }
+};
+
+// Undo History Implementation
+// Undo actions, as kept in undo records and snapshots
+enum UndoAction : uint32_t {
+    UNDO_ADD_BOOK = 1,
+    UNDO_ISSUE_BOOK = 2,
+    UNDO_RETURN_BOOK = 3,
+    UNDO_BATCH = 4,   // Reported for a batch group; records keep their own actions
+    UNDO_HOLD = 5,    // A reader joined a hold queue
+    UNDO_HAND_OFF = 6 // A return went to the reader at the front of the hold queue
+};
+
+const uint8_t UNDO_JOINED = 1;   // Undone and redone together with the record below it
+const uint8_t UNDO_IN_BATCH = 2; // Written by a batch issue or return
+
+// One undoable change, 48 bytes. The book pointer is the record's handle on the ISBN: a book
+// stays allocated while records refer to it, even after an undo took it out of the catalog.
+// sequence and previous are the book's change numbers after and before the action.
+struct UndoRecord {
+    Book* book;
+    User* user;        // Reader of the loan or hold, nullptr if none
+    int64_t due;       // Due date of the loan the action opened or closed
+    uint64_t sequence;
+    uint64_t previous;
+    uint8_t action;    // UndoAction
+    uint8_t flags;     // UNDO_JOINED, UNDO_IN_BATCH
+};
+
+// One reader's undo and redo history in a ring of records: undoable records sit below top,
+// redoable ones above it. The depth counts actions, not records, so a batch of any size is
+// one entry: once depth actions are undoable, a new one drops the oldest whole, and the ring
+// only grows when a single batch needs more room. A new record drops the redoable ones.
+// Every record that leaves the history is passed to release.
+class UndoHistory {
+private:
+    vector<UndoRecord> ring;  // Allocated by the first push
+    uint64_t top = 0;         // Position after the newest undoable record
+    uint32_t undoable = 0, redoable = 0;    // Records
+    uint32_t undoGroups = 0, redoGroups = 0; // Actions
+
+    UndoRecord& at(uint64_t position) { return ring[position % ring.size()]; }
+    const UndoRecord& at(uint64_t position) const { return ring[position % ring.size()]; }
+
+    // Makes room for one more record, doubling the ring when it is full
+    void reserve(size_t depth) {
+        if (ring.empty()) ring.resize(max<size_t>(depth, 1));
+        if (undoable + redoable < ring.size()) return;
+        vector<UndoRecord> grown(ring.size() * 2);
+        for (uint64_t position = top - undoable; position < top + redoable; ++position)
+            grown[position % grown.size()] = at(position);
+        ring.swap(grown);
+    }
+
+public:
+    template <typename Release>
+    void push(const UndoRecord& record, size_t depth, Release release) {
+        dropRedoable(release);
+        if (!(record.flags & UNDO_JOINED) || !undoable) {
+            while (undoGroups >= max<size_t>(depth, 1)) {  // Also trims a history after the depth was lowered
+                do {
+                    release(at(top - undoable));  // The oldest record, then the rest of its group
+                    --undoable;
+                } while (undoable && (at(top - undoable).flags & UNDO_JOINED));
+                --undoGroups;
+            }
+            ++undoGroups;
+        }
+        reserve(depth);
+        at(top++) = record;
+        ++undoable;
+    }
+
+    // Adds a redoable record above the others (loading a snapshot, which holds no more than
+    // the live history did)
+    void pushRedoable(const UndoRecord& record, size_t depth) {
+        reserve(depth);
+        if (!(record.flags & UNDO_JOINED) || !redoable) ++redoGroups;
+        at(top + redoable++) = record;
+    }
+
+    // Records in the newest undoable group, 0 if there is none
+    size_t undoGroup() const {
+        for (size_t count = 1; count <= undoable; ++count)
+            if (!(at(top - count).flags & UNDO_JOINED)) return count;
+        return 0;
+    }
+
+    // Records in the oldest redoable group
+    size_t redoGroup() const {
+        size_t count = redoable ? 1 : 0;
+        while (count < redoable && (at(top + count).flags & UNDO_JOINED)) ++count;
+        return count;
+    }
+
+    const UndoRecord& undoRecord(size_t i) const { return at(top - 1 - i); }  // 0 is the newest
+    const UndoRecord& redoRecord(size_t i) const { return at(top + i); }      // 0 is the next to redo
+
+    // Moves a group between the two sides after it was undone or redone
+    void undone(size_t count) {
+        top -= count;
+        undoable -= count;
+        redoable += count;
+        --undoGroups;
+        ++redoGroups;
+    }
+    void redone(size_t count) {
+        top += count;
+        undoable += count;
+        redoable -= count;
+        ++undoGroups;
+        --redoGroups;
+    }
+
+    // Forgets the newest undoable group; the redoable records above it go too
+    template <typename Release>
+    void dropUndoGroup(size_t count, Release release) {
+        dropRedoable(release);
+        for (; count; --count, --undoable) release(at(--top));
+        --undoGroups;
+    }
+
+    template <typename Release>
+    void dropRedoable(Release release) {
+        for (; redoable; --redoable) release(at(top + redoable - 1));
+        redoGroups = 0;
+    }
+
+    // Calls visit(record, redoable) from the oldest undoable record to the last redoable one
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        for (uint64_t position = top - undoable; position < top + redoable; ++position) visit(at(position), position >= top);
+    }
+
+    size_t size() const { return undoable + redoable; }
+    size_t memoryUsed() const { return ring.capacity() * sizeof(UndoRecord); }
+
+    template <typename Release>
+    void clear(Release release) {
+        dropRedoable(release);
+        for (; undoable; --undoable) release(at(top - undoable));
+        undoGroups = 0;
+    }
+};
+
+// User Class
+class User {
+public:
+    string username; //string to store username
+    PasswordHash password; // Salted slow hash; the password itself is never stored
+    Loan* loans = nullptr;    // Books the user has out, oldest first
+    Loan* lastLoan = nullptr;
+    size_t loanCount = 0;
+    UndoHistory history;      // The user's own actions, for undo and redo
+
+    User(string u, const PasswordHash& p) : username(move(u)), password(p) {}
+};
+
+// One copy of a book out with a reader. A loan sits in two lists at once: the reader's
+// loans and the book's loans, so either side is answered without scanning anybody else's.
+class Loan {
+public:
+    Book* book;
+    User* user;
+    int64_t due;             // Seconds since the epoch
+    Loan* userPrev = nullptr;
+    Loan* userNext = nullptr;
+    Loan* bookPrev = nullptr;
+    Loan* bookNext = nullptr;
+    size_t slot = 0;         // Index in the due-date heap, or in the overdue list once overdue
+    bool overdue = false;
+
+    Loan(Book* b, User* u, int64_t d) : book(b), user(u), due(d) {}
+};
+
+// Due dates of open loans. Loans not yet due live in a binary min-heap keyed by due date;
+// a sweep pops only the ones that have expired and moves them to the overdue list, so it
+// costs O(expired log n) however many loans are open. Every loan knows its slot, so a
+// return takes its loan out of either structure in O(log n).
+class LoanSchedule {
+private:
+    vector<Loan*> heap;
+    vector<Loan*> overdueLoans;
+
+    void place(size_t index, Loan* loan) {
+        heap[index] = loan;
+        loan->slot = index;
+    }
+
+    void siftUp(size_t index) {
+        Loan* loan = heap[index];
+        while (index > 0) {
+            size_t parent = (index - 1) / 2;
+            if (heap[parent]->due <= loan->due) break;
+            place(index, heap[parent]);
+            index = parent;
+        }
+        place(index, loan);
+    }
+
+    void siftDown(size_t index) {
+        Loan* loan = heap[index];
+        for (;;) {
+            size_t child = 2 * index + 1;
+            if (child >= heap.size()) break;
+            if (child + 1 < heap.size() && heap[child + 1]->due < heap[child]->due) ++child;
+            if (loan->due <= heap[child]->due) break;
+            place(index, heap[child]);
+            index = child;
+        }
+        place(index, loan);
+    }
+
+    void markOverdue(Loan* loan) {
+        loan->overdue = true;
+        loan->slot = overdueLoans.size();
+        overdueLoans.push_back(loan);
+    }
+
+public:
+    // Schedules a loan; one restored as already overdue goes straight to the overdue list
+    void add(Loan* loan) {
+        if (loan->overdue) {
+            markOverdue(loan);
+            return;
+        }
+        heap.push_back(loan);
+        siftUp(heap.size() - 1);
+    }
+
+    void remove(Loan* loan) {
+        if (loan->overdue) {  // Swap the last overdue loan into its place
+            Loan* last = overdueLoans.back();
+            overdueLoans[loan->slot] = last;
+            last->slot = loan->slot;
+            overdueLoans.pop_back();
+            return;
+        }
+        size_t index = loan->slot;
+        Loan* last = heap.back();
+        heap.pop_back();
+        if (last == loan) return;
+        place(index, last);
+        if (index > 0 && heap[(index - 1) / 2]->due > last->due) siftUp(index);
+        else siftDown(index);
+    }
+
+    // Moves every loan due before now to the overdue list, calling onOverdue(loan) for each;
+    // returns how many there were
+    template <typename OnOverdue>
+    size_t sweep(int64_t now, OnOverdue onOverdue) {
+        size_t expired = 0;
+        while (!heap.empty() && heap[0]->due < now) {
+            Loan* loan = heap[0];
+            Loan* last = heap.back();
+            heap.pop_back();
+            if (!heap.empty()) {
+                place(0, last);
+                siftDown(0);
+            }
+            markOverdue(loan);
+            onOverdue(loan);
+            ++expired;
+        }
+        return expired;
+    }
+
+    const vector<Loan*>& overdue() const { return overdueLoans; }
+    size_t size() const { return heap.size() + overdueLoans.size(); }
+
+    void clear() {
+        heap.clear();
+        overdueLoans.clear();
+    }
+};
+
+// Hash Table for Users
+// Username index: open addressing with linear probing over (hash, User*) slots, doubled once
+// 3/4 full. The users themselves live in a pool and never move, so the User* that holds,
+// loans and undo records keep stays valid however far the table grows.
+class UserHashTable {
+private:
+    struct Slot {
+        uint64_t hash = 0;    // hashString of the username, 0 if the slot is empty
+        User* user = nullptr;
+    };
+    static constexpr size_t MIN_CAPACITY = 64;
+
+    vector<Slot> table;
+    size_t mask = 0;
+    ObjectPool<User, 1024> users;  // Registration order, which forEach and snapshots follow
+
+    void place(Slot entry) {
+        size_t i = entry.hash & mask;
+        while (table[i].hash) i = (i + 1) & mask;
+        table[i] = entry;
+    }
+
+    void resize(size_t capacity) {
+        vector<Slot> old(capacity);
+        old.swap(table);
+        mask = capacity - 1;
+        for (const Slot& slot : old)
+            if (slot.hash) place(slot);
+    }
+
+public:
+    // Adds a user; returns nullptr if the username is taken
+    User* insert(const string& username, const PasswordHash& password) {
+        if (search(username)) return nullptr;
+        if ((users.size() + 1) * 4 > table.size() * 3) resize(max(MIN_CAPACITY, table.size() * 2));
+        User* user = users.create(username, password);
+        place({hashString(username), user});
+        return user;
+    }
+
+    // Searches for a User object in the hash table based on the username
+    User* search(string_view username) const {
+        if (table.empty()) return nullptr;
+        uint64_t hash = hashString(username);
+        for (size_t i = hash & mask; table[i].hash; i = (i + 1) & mask)
+            if (table[i].hash == hash && table[i].user->username == username) return table[i].user;
+        return nullptr;
+    }
+
+    // Sizes the table for a known number of users (loading a snapshot)
+    void reserve(size_t count) {
+        size_t capacity = MIN_CAPACITY;
+        while (capacity * 3 < count * 4) capacity *= 2;
+        if (capacity > table.size()) resize(capacity);
+    }
+
+    size_t size() const { return users.size(); }
+
+    // Calls visit(user) for every stored user, in registration order
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        users.forEach([&visit](const User* user) { visit(user); });
+    }
+
+    // Deletes every user
+    void clear() {
+        users.release();
+        table.clear();
+        mask = 0;
+    }
+};
+
+// Logins verified recently. A repeated login with the same password is checked against a
+// keyed SHA-256 of it (two compressions) instead of the slow password hash. The cache is
+// direct-mapped and fixed in size: a user's entry simply replaces whatever shared its slot,
+// and every entry expires after a while, so a password change of the future needs no
+// bookkeeping beyond clear().
+class LoginCache {
+private:
+    struct Entry {
+        const User* user = nullptr;
+        int64_t expires = 0;       // Steady-clock seconds
+        uint8_t digest[Sha256::SIZE];
+    };
+    static const size_t SIZE = 4096;  // Entries, a power of two
+
+    vector<Entry> entries;
+    HmacSha256 mac;                   // Keyed with random bytes drawn at startup
+    mutex lock;
+
+    static string randomKey() {
+        random_device random;
+        string key(32, '\0');
+        for (char& c : key) c = static_cast<char>(random());
+        return key;
+    }
+
+    Entry& slot(string_view username) { return entries[hashString(username) & (SIZE - 1)]; }
+
+    void sign(string_view username, string_view password, uint8_t* digest) const {
+        string message(username);
+        message += '\0';
+        message.append(password.data(), password.size());
+        mac.sign(message.data(), message.size(), digest);
+    }
+
+public:
+    static const int64_t LIFETIME = 15 * 60; // Seconds an entry stays valid
+
+    LoginCache() : entries(SIZE), mac(randomKey()) {}
+
+    static int64_t now() {
+        return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Whether the user logged in with this password within the lifetime of the entry. The
+    // user is only compared, never dereferenced, so callers need not hold the user lock.
+    bool check(const User* user, string_view username, string_view password) {
+        uint8_t digest[Sha256::SIZE];
+        sign(username, password, digest);
+        lock_guard<mutex> guard(lock);
+        const Entry& entry = slot(username);
+        return entry.user == user && entry.expires > now() && sameDigest(entry.digest, digest, sizeof digest);
+    }
+
+    void remember(const User* user, string_view username, string_view password) {
+        Entry fresh;
+        fresh.user = user;
+        fresh.expires = now() + LIFETIME;
+        sign(username, password, fresh.digest);
+        lock_guard<mutex> guard(lock);
+        slot(username) = fresh;
+    }
+
+    void clear() {
+        lock_guard<mutex> guard(lock);
+        for (Entry& entry : entries) entry.user = nullptr;
+    }
+};
+
+// Streaming reader for CSV/TSV catalog files. The file is read in large chunks and every
+// field is returned as a string_view into the chunk buffer, so a row costs no allocation.
+// Quoted CSV fields may contain delimiters, newlines and doubled quotes; those are unescaped
+// in place inside the buffer.
+class CatalogReader {
+    private:
+    static const size_t CHUNK_SIZE = 1 << 20; // Bytes requested from the file per read
+
+    FILE* file = nullptr;
+    vector<char> buffer;
+    size_t begin = 0;  // Start of the unparsed data in buffer
+    size_t end = 0;    // End of the valid data in buffer
+    bool eof = false;
+    char delimiter;
+
+    // Moves the unparsed tail to the front of the buffer and appends the next chunk
+    bool refill() {
+        if (eof) return false;
+        if (begin > 0) {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (buffer.size() - end < CHUNK_SIZE) buffer.resize(end + CHUNK_SIZE); // A record larger than a chunk
+        size_t got = fread(buffer.data() + end, 1, buffer.size() - end, file);
+        if (got == 0) eof = true;
+        end += got;
+        return got > 0;
+    }
+
+    // Finds the end of the record starting at begin; returns false if it is not in the buffer yet
+    bool findRecordEnd(size_t& recordEnd, bool& quoted) const {
+        const char* start = buffer.data() + begin;
+        const char* newline = static_cast<const char*>(memchr(start, '\n', end - begin));
+        size_t lineLength = newline ? newline - start : end - begin;
+        quoted = delimiter != '\t' && memchr(start, '"', lineLength);
+        if (!quoted) {
+            if (!newline && !eof) return false;
+            recordEnd = begin + lineLength;
+            return true;
+        }
+        bool inQuotes = false; // Slow path: newlines inside quotes do not end the record
+        for (size_t i = begin; i < end; ++i) {
+            if (buffer[i] == '"') inQuotes = !inQuotes;
+            else if (buffer[i] == '\n' && !inQuotes) {
+                recordEnd = i;
+                return true;
+            }
+        }
+        if (!eof) return false;
+        recordEnd = end;
+        return true;
+    }
+
+    // Splits buffer[from, to) into fields, unescaping quoted fields in place
+    void split(size_t from, size_t to, bool quoted, vector<string_view>& fields) {
+        char* data = buffer.data();
+        if (to > from && data[to - 1] == '\r') --to;
+        if (!quoted) {
+            for (;;) {
+                const char* next = static_cast<const char*>(memchr(data + from, delimiter, to - from));
+                size_t fieldEnd = next ? next - data : to;
+                fields.emplace_back(data + from, fieldEnd - from);
+                if (!next) return;
+                from = fieldEnd + 1;
+            }
+        }
+        for (;;) {
+            size_t out = from;
+            size_t i = from;
+            if (i < to && data[i] == '"') { // Quoted field: copy it down over the quotes
+                for (++i; i < to; ++i) {
+                    if (data[i] == '"') {
+                        if (i + 1 < to && data[i + 1] == '"') ++i;
+                        else {
+                            ++i;
+                            break;
+                        }
+                    }
+                    data[out++] = data[i];
+                }
+                while (i < to && data[i] != delimiter) data[out++] = data[i++]; // Text after the closing quote
+            } else {
+                while (i < to && data[i] != delimiter) ++i;
+                out = i;
+            }
+            fields.emplace_back(data + from, out - from);
+            if (i >= to) return;
+            from = i + 1;
+        }
+    }
+
+    public:
+    // delimiter 0 picks tab for *.tsv files and comma otherwise
+    CatalogReader(const string& path, char fieldDelimiter = 0) : delimiter(fieldDelimiter) {
+        file = fopen(path.c_str(), "rb");
+        if (!delimiter)
+            delimiter = path.size() >= 4 && path.compare(path.size() - 4, 4, ".tsv") == 0 ? '\t' : ',';
+    }
+    CatalogReader(const CatalogReader&) = delete;
+    CatalogReader& operator=(const CatalogReader&) = delete;
+    ~CatalogReader() {
+        if (file) fclose(file);
+    }
+
+    bool isOpen() const { return file != nullptr; }
+
+    // Reads the next non-empty record; the views stay valid until the following call
+    bool next(vector<string_view>& fields) {
+        fields.clear();
+        while (file) {
+            size_t recordEnd;
+            bool quoted;
+            if (begin == end && !refill()) return false;
+            if (!findRecordEnd(recordEnd, quoted)) {
+                refill();
+                continue;
+            }
+            size_t from = begin;
+            begin = recordEnd < end ? recordEnd + 1 : end;
+            if (recordEnd == from || (recordEnd == from + 1 && buffer[from] == '\r')) continue; // Blank line
+            split(from, recordEnd, quoted, fields);
+            return true;
+        }
+        return false;
+    }
+};
+
+// Binary snapshot format. A file is a SnapshotHeader followed by fixed-size record arrays
+// (books in title order, users, issue queue, holds, loans, undo histories) and a
+// string pool. Records refer to their strings by (offset, length) inside the pool, so a
+// memory-mapped snapshot is used in place: no record is tokenized or parsed on load.
+const uint32_t SNAPSHOT_VERSION = 6;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304; // Detects files written on the other endianness
+
+struct SnapshotHeader {
+    char magic[8];           // "LMSSNAP"
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t checksum;       // checksum64 of every byte after the header
+    uint64_t fileSize;
+    uint64_t bookCount;
+    uint64_t retiredCount;   // Books only undo history refers to, stored after the catalog
+    uint64_t userCount;
+    uint64_t queueCount;
+    uint64_t holdCount;
+    uint64_t loanCount;
+    uint64_t undoCount;
+    uint64_t stringPoolSize;
+    uint64_t walSequence;    // Last write-ahead log record reflected in the snapshot
+    uint64_t changeCounter;  // Last book change number handed out
+};
+
+// A string in the pool: offset in the upper 40 bits, length in the lower 24
+typedef uint64_t SnapshotString;
+
+struct SnapshotBook {
+    SnapshotString title, author, isbn;
+    uint32_t copies;
+    uint32_t available;      // Copies on the shelf
+    uint64_t version;        // Change number of the last action on the book
+};
+
+struct SnapshotUser {
+    SnapshotString username;
+    uint32_t iterations;     // PasswordHash fields
+    uint32_t reserved;
+    uint8_t salt[16];
+    uint8_t digest[32];
+};
+
+// One waiting reader; the holds of a book are stored front to rear
+struct SnapshotHold {
+    SnapshotString isbn, username;
+};
+
+// One open loan; each reader's loans are stored oldest first
+struct SnapshotLoan {
+    SnapshotString isbn, username;
+    int64_t due;
+    uint32_t flags;          // SNAPSHOT_OVERDUE
+    uint32_t reserved;
+};
+const uint32_t SNAPSHOT_OVERDUE = 1;
+
+// One undo record; each owner's history is stored oldest first, redoable records last
+struct SnapshotUndo {
+    SnapshotString owner;    // Reader whose history holds the record
+    SnapshotString user;     // Reader of the loan or hold, empty if none
+    uint64_t book;           // Index of the book in the book records (catalog, then retired)
+    int64_t due;
+    uint64_t sequence, previous;
+    uint32_t action;         // UndoAction code
+    uint32_t flags;          // UNDO_JOINED, UNDO_IN_BATCH, SNAPSHOT_REDOABLE
+};
+const uint32_t SNAPSHOT_REDOABLE = 0x100;
+
+// Streaming 64-bit checksum over 8-byte words; bytes may be fed in pieces of any size
+class Checksum {
+    private:
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
+    uint64_t total = 0;       // Bytes consumed
+    unsigned char carry[8];   // Bytes of an incomplete word
+    size_t carried = 0;
+
+    void mix(uint64_t word) {
+        hash ^= word;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash = (hash << 29) | (hash >> 35);
+    }
+
+    public:
+    void update(const char* data, size_t size) {
+        total += size;
+        if (carried) {
+            size_t take = min(size, 8 - carried);
+            memcpy(carry + carried, data, take);
+            carried += take;
+            data += take;
+            size -= take;
+            if (carried < 8) return;  // Still an incomplete word
+            uint64_t word;
+            memcpy(&word, carry, 8);
+            mix(word);
+            carried = 0;
+        }
+        for (; size >= 8; data += 8, size -= 8) {
+            uint64_t word;
+            memcpy(&word, data, 8);
+            mix(word);
+        }
+        memcpy(carry, data, size);
+        carried = size;
+    }
+
+    uint64_t value() const {
+        uint64_t result = hash;
+        for (size_t i = 0; i < carried; ++i) result = (result ^ carry[i]) * 0x100000001b3ULL;
+        result ^= total;
+        result ^= result >> 33;
+        result *= 0xc4ceb9fe1a85ec53ULL;
+        return result ^ (result >> 33);
+    }
+};
+
+// Read-only view of a whole file: memory-mapped where the platform supports it, read into
+// memory otherwise
+class MappedFile {
+    private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    vector<char> contents;
+#endif
+
+    public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+#ifndef _WIN32
+        if (bytes) munmap(const_cast<char*>(bytes), length);
+#endif
+    }
+
+    bool open(const string& path) {
+#ifdef _WIN32
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) return false;
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        contents.resize(size > 0 ? size : 0);
+        bool ok = size >= 0 && fread(contents.data(), 1, contents.size(), file) == contents.size();
+        fclose(file);
+        bytes = contents.data();
+        length = contents.size();
+        return ok;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // The mapping stays valid after the descriptor is closed
+        if (mapping == MAP_FAILED) return false;
+        madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+        bytes = static_cast<const char*>(mapping);
+        length = info.st_size;
+        return true;
+#endif
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Buffered writer for snapshot files that checksums everything after the header as it goes
+class SnapshotWriter {
+    private:
+    FILE* file;
+    vector<char> buffer;
+    Checksum checksum;
+    bool failed = false;
+
+    public:
+    SnapshotWriter(FILE* f) : file(f) { buffer.reserve(1 << 20); }
+
+    void write(const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        if (buffer.size() + size > buffer.capacity()) flush();
+        if (size > buffer.capacity()) {
+            checksum.update(bytes, size);
+            failed |= fwrite(bytes, 1, size, file) != size;
+            return;
+        }
+        buffer.insert(buffer.end(), bytes, bytes + size);
+    }
+
+    void flush() {
+        checksum.update(buffer.data(), buffer.size());
+        failed |= fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size();
+        buffer.clear();
+    }
+
+    uint64_t value() const { return checksum.value(); }
+    bool ok() const { return !failed; }
+};
+
+// Operations recorded in the write-ahead log
+enum WalOp : uint8_t {
+    WAL_REGISTER = 1,    // username, password hash (PasswordHash::toString)
+    WAL_ADD_BOOK = 2,    // title, author, isbn, copies on the shelf, copies owned, the user who added it
+    WAL_ISSUE_BOOK = 3,  // isbn, username, due date
+    WAL_RETURN_BOOK = 4, // isbn, username, due date of a loan handed to a waiting reader
+    WAL_UNDO = 5,        // username
+    WAL_ISSUE_BATCH = 6, // username, due date, isbn of every book the batch issued
+    WAL_RETURN_BATCH = 7, // username, due date for hand-offs, isbn of every book the batch returned
+    WAL_HOLD = 8,        // isbn, username
+    WAL_CANCEL_HOLD = 9, // isbn, username
+    WAL_REDO = 10        // username
+};
+
+// Append-only write-ahead log with group commit. append() only copies the record into a
+// memory buffer; a background thread writes whatever has accumulated and fsyncs it once
+// per commit interval, so many operations share one fsync and none of them waits for it.
+// Record layout: uint32 payload length, uint32 payload checksum, then the payload itself:
+// uint64 sequence number, uint8 operation, and for each field a uint32 length plus its bytes.
+class WriteAheadLog {
+    private:
+    static const size_t FLUSH_THRESHOLD = 1 << 20; // Buffered bytes that commit before the interval ends
+    static const size_t RECORD_HEADER = 8;         // Length and checksum in front of each payload
+
+    FILE* file = nullptr;
+    mutex lock;
+    condition_variable wake;       // Wakes the flusher thread
+    condition_variable durable;    // Wakes threads waiting in sync()
+    vector<char> pending;          // Records appended since the last commit
+    uint64_t nextSequence = 1;
+    uint64_t appendedSequence = 0; // Sequence number of the newest appended record
+    uint64_t durableSequence = 0;  // Sequence number of the newest record known to be on disk
+    bool stopping = false;
+    bool syncRequested = false;
+    bool failed = false;
+    chrono::milliseconds interval;
+    thread flusher;
+
+    static bool syncFile(FILE* f) {
+        if (fflush(f) != 0) return false;
+#ifdef _WIN32
+        return _commit(_fileno(f)) == 0;
+#else
+        return fsync(fileno(f)) == 0;
+#endif
+    }
+
+    // Flusher thread: waits for the first record of a group, lets the group fill for one
+    // commit interval, then writes and fsyncs it as a single batch
+    void run() {
+        vector<char> writing;
+        unique_lock<mutex> guard(lock);
+        for (;;) {
+            wake.wait(guard, [this] { return stopping || syncRequested || !pending.empty(); });
+            if (!stopping && !syncRequested)
+                wake.wait_for(guard, interval, [this] {
+                    return stopping || syncRequested || pending.size() >= FLUSH_THRESHOLD;
+                });
+            syncRequested = false;
+            if (pending.empty()) {
+                durable.notify_all();
+                if (stopping) return;
+                continue;
+            }
+            writing.swap(pending);
+            uint64_t batchSequence = appendedSequence;
+            guard.unlock();
+            bool ok = fwrite(writing.data(), 1, writing.size(), file) == writing.size() && syncFile(file);
+            writing.clear();
+            guard.lock();
+            failed |= !ok;
+            durableSequence = batchSequence;
+            durable.notify_all();
+        }
+    }
+
+    static void putU32(char* out, uint32_t value) { memcpy(out, &value, 4); }
+
+    public:
+    WriteAheadLog(chrono::milliseconds commitInterval = chrono::milliseconds(5)) : interval(commitInterval) {}
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+    ~WriteAheadLog() { close(); }
+
+    // Opens the log for appending; records get sequence numbers from firstSequence on.
+    // truncate discards the current contents, which compaction does once they are in a snapshot.
+    bool open(const string& path, uint64_t firstSequence, bool truncate = false) {
+        close();
+        file = fopen(path.c_str(), truncate ? "wb" : "ab");
+        if (!file) return false;
+        nextSequence = firstSequence;
+        appendedSequence = durableSequence = firstSequence - 1;
+        failed = false;
+        flusher = thread(&WriteAheadLog::run, this);
+        return true;
+    }
+
+    bool isOpen() const { return file != nullptr; }
+
+    // Queues one record and returns its sequence number without waiting for the disk
+    uint64_t append(uint8_t op, initializer_list<string_view> fields) { return appendRecord(op, fields); }
+    uint64_t append(uint8_t op, const vector<string_view>& fields) { return appendRecord(op, fields); }
+
+    private:
+    template <typename Fields>
+    uint64_t appendRecord(uint8_t op, const Fields& fields) {
+        size_t payloadLength = 8 + 1;
+        for (string_view field : fields) payloadLength += 4 + field.size();
+        lock_guard<mutex> guard(lock);
+        uint64_t sequence = nextSequence++;
+        size_t start = pending.size();
+        pending.resize(start + RECORD_HEADER + payloadLength);
+        char* payload = pending.data() + start + RECORD_HEADER;
+        char* out = payload;
+        memcpy(out, &sequence, 8);
+        out[8] = static_cast<char>(op);
+        out += 9;
+        for (string_view field : fields) {
+            putU32(out, static_cast<uint32_t>(field.size()));
+            memcpy(out + 4, field.data(), field.size());
+            out += 4 + field.size();
+        }
+        Checksum checksum;
+        checksum.update(payload, payloadLength);
+        putU32(pending.data() + start, static_cast<uint32_t>(payloadLength));
+        putU32(pending.data() + start + 4, static_cast<uint32_t>(checksum.value()));
+        appendedSequence = sequence;
+        if (pending.size() >= FLUSH_THRESHOLD) wake.notify_one();
+        return sequence;
+    }
+
+    public:
+
+    // Blocks until every record appended so far is on disk; false if a write failed
+    bool sync() {
+        unique_lock<mutex> guard(lock);
+        if (!file) return true;
+        uint64_t target = appendedSequence;
+        syncRequested = true;
+        wake.notify_one();
+        durable.wait(guard, [this, target] { return durableSequence >= target || failed; });
+        return !failed;
+    }
+
+    // Commits whatever is buffered, stops the flusher thread and closes the file
+    void close() {
+        if (!file) return;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+        fclose(file);
+        file = nullptr;
+        stopping = false;
+    }
+
+    // Reads a log and calls apply(sequence, op, fields) for every intact record newer than
+    // afterSequence. A torn or corrupt tail (a crash in the middle of a write) ends the
+    // replay and is cut off so that new records are appended after the last good one.
+    // Returns the number of records applied.
+    template <typename Apply>
+    static size_t replay(const string& path, uint64_t afterSequence, Apply apply) {
+        MappedFile log;
+        if (!log.open(path)) return 0;  // Missing or empty log
+        const char* data = log.data();
+        size_t size = log.size(), offset = 0, applied = 0;
+        vector<string_view> fields;
+        while (size - offset >= RECORD_HEADER) {
+            uint32_t payloadLength, expected;
+            memcpy(&payloadLength, data + offset, 4);
+            memcpy(&expected, data + offset + 4, 4);
+            if (payloadLength < 9 || payloadLength > size - offset - RECORD_HEADER) break;
+            const char* payload = data + offset + RECORD_HEADER;
+            Checksum checksum;
+            checksum.update(payload, payloadLength);
+            if (static_cast<uint32_t>(checksum.value()) != expected) break;
+
+            uint64_t sequence;
+            memcpy(&sequence, payload, 8);
+            uint8_t op = static_cast<uint8_t>(payload[8]);
+            fields.clear();
+            bool intact = true;
+            for (size_t pos = 9; pos < payloadLength;) {
+                uint32_t fieldLength;
+                if (payloadLength - pos < 4) {
+                    intact = false;
+                    break;
+                }
+                memcpy(&fieldLength, payload + pos, 4);
+                if (fieldLength > payloadLength - pos - 4) {
+                    intact = false;
+                    break;
+                }
+                fields.emplace_back(payload + pos + 4, fieldLength);
+                pos += 4 + fieldLength;
+            }
+            if (!intact) break;
+            if (sequence > afterSequence) {
+                apply(sequence, op, fields);
+                ++applied;
+            }
+            offset += RECORD_HEADER + payloadLength;
+        }
+        if (offset < size) { // Rewrite the intact prefix over the damaged log
+            string intactPrefix(data, offset);
+            if (FILE* rewrite = fopen(path.c_str(), "wb")) {
+                fwrite(intactPrefix.data(), 1, intactPrefix.size(), rewrite);
+                syncFile(rewrite);
+                fclose(rewrite);
+            }
+        }
+        return applied;
+    }
+};
+
+// Outcome of a library operation
+enum class Outcome {
+    Done,
+    Duplicate,     // The ISBN or username already exists
+    NotFound,      // No book with that ISBN
+    NotAvailable,  // Every copy of the book is issued
+    Held,          // No copy was free, so the reader joined the book's hold queue
+    NotIssued,     // The book was not issued, so it cannot be returned
+    NothingToUndo,
+    NothingToRedo,
+    Conflict,      // Another reader has changed the book since, so the action cannot be undone or redone
+    NotLoggedIn,   // The session has no user
+    InvalidCredentials,
+    CannotOpen,    // A file could not be read or written
+    Corrupt,       // A snapshot failed validation or is from an incompatible version
+    Invalid        // A command or its arguments were not understood
+};
+
+// Per-client context: the user a desk or connection is logged in as. Every client keeps its
+// own Session, so any number of them can use one Library at the same time.
+class Session {
+public:
+    string username; // Empty when nobody is logged in
+    bool isLoggedIn() const { return !username.empty(); }
+};
+
+// Copy of a book's fields, safe to keep after the catalog lock has been released
+struct BookInfo {
+    string title, author, isbn;
+    uint32_t copies, available; // Copies owned and copies on the shelf
+    size_t holds;               // Readers waiting for a copy
+    bool isAvailable() const { return available > 0; }
+};
+
+// Copy of a loan's fields
+struct LoanInfo {
+    string title, isbn, username;
+    int64_t due;   // Seconds since the epoch
+    bool overdue;  // Found past due by a sweep
+};
+
+// What loading a snapshot (and replaying the log after it) found
+struct StorageSummary {
+    Outcome outcome = Outcome::Done; // Done, CannotOpen or Corrupt
+    string path;                     // File the outcome refers to
+    size_t books = 0, users = 0;     // Loaded from the snapshot
+    size_t replayed = 0;             // Log records applied after the snapshot
+};
+
+struct ImportSummary {
+    Outcome outcome = Outcome::Done; // Done, NotLoggedIn or CannotOpen
+    size_t imported = 0, duplicates = 0, malformed = 0;
+    long long milliseconds = 0;
+};
+
+// Where a page of the catalog listing starts: after the book with this (title, isbn) key, or
+// at the beginning when both are empty. A key stays meaningful while books come and go.
+struct ListCursor {
+    string title, isbn;
+    bool atStart() const { return title.empty() && isbn.empty(); }
+};
+
+// Books a listing keeps; checked while the title index is scanned
+struct ListFilter {
+    bool availableOnly = false;
+    string author;  // Empty for any author, otherwise matched whole and case-insensitively
+
+    bool accepts(const Book* book) const {
+        if (availableOnly && !book->isAvailable()) return false;
+        if (author.empty()) return true;
+        if (book->author.size() != author.size()) return false;
+        for (size_t i = 0; i < author.size(); ++i)
+            if (tolower(static_cast<unsigned char>(book->author[i])) != tolower(static_cast<unsigned char>(author[i])))
+                return false;
+        return true;
+    }
+};
+
+// Object counts of the library's pools and indexes
+struct MemoryStats {
+    size_t books, bookChunks, titleNodes, titleChunks, isbnEntries, queueEntries, queueCapacity,
+        undoRecords, undoBytes, searchTerms, searchPostings;
+};
+
+// Reader-writer lock split into cache-line-sized stripes. A reader locks only the stripe
+// assigned to its thread, so lookups running on different cores never write to a shared
+// lock word; a writer takes every stripe.
+class StripedSharedMutex {
+    private:
+    static const size_t STRIPES = 16;
+    struct alignas(64) Stripe {
+        shared_mutex mutex;
+    };
+    Stripe stripes[STRIPES];
+
+    static size_t threadStripe() {
+        static atomic<size_t> nextStripe{0};
+        thread_local size_t stripe = nextStripe.fetch_add(1, memory_order_relaxed) % STRIPES;
+        return stripe;
+    }
+
+    public:
+    size_t lockShared() { // Returns the stripe to pass to unlockShared
+        size_t stripe = threadStripe();
+        stripes[stripe].mutex.lock_shared();
+        return stripe;
+    }
+    void unlockShared(size_t stripe) { stripes[stripe].mutex.unlock_shared(); }
+    void lock() {
+        for (Stripe& stripe : stripes) stripe.mutex.lock();
+    }
+    void unlock() {
+        for (size_t i = STRIPES; i-- > 0;) stripes[i].mutex.unlock();
+    }
+};
+
+// Scoped shared lock on a StripedSharedMutex
+class ReadGuard {
+    private:
+    StripedSharedMutex& mutex;
+    size_t stripe;
+
+    public:
+    ReadGuard(StripedSharedMutex& m) : mutex(m), stripe(m.lockShared()) {}
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+    ~ReadGuard() { mutex.unlockShared(stripe); }
+};
+
+// Operation metrics. Each thread records into its own block of counters and latency
+// histograms, so a measured operation costs two clock reads and a few stores to memory no
+// other core writes; a stats dump adds the blocks up. Blocks of threads that have exited
+// are folded into one, so their counts are kept.
+enum MetricOp { OP_LOGIN, OP_ADD_BOOK, OP_ISSUE, OP_RETURN, OP_FIND_ISBN, OP_FIND_TITLE, OP_SEARCH, OP_UNDO, OP_REDO, OP_COUNT };
+
+inline const char* metricOpName(int op) {
+    static const char* const names[OP_COUNT] = {"login", "add_book", "issue", "return", "find_isbn",
+                                                "find_title", "search", "undo", "redo"};
+    return names[op];
+}
+
+const int OUTCOME_COUNT = static_cast<int>(Outcome::Invalid) + 1;
+
+inline const char* outcomeLabel(Outcome outcome) {
+    static const char* const labels[OUTCOME_COUNT] = {
+        "done", "duplicate", "not_found", "not_available", "held", "not_issued", "nothing_to_undo",
+        "nothing_to_redo", "conflict", "not_logged_in", "invalid_credentials", "cannot_open", "corrupt", "invalid"};
+    return labels[static_cast<int>(outcome)];
+}
+
+// Outcome recorded for operations that return data instead of an Outcome
+inline Outcome metricOutcome(Outcome outcome) { return outcome; }
+inline Outcome metricOutcome(bool found) { return found ? Outcome::Done : Outcome::NotFound; }
+inline Outcome metricOutcome(size_t matches) { return matches ? Outcome::Done : Outcome::NotFound; }
+template <typename T>
+Outcome metricOutcome(const vector<T>& results) { return results.empty() ? Outcome::NotFound : Outcome::Done; }
+
+inline int floorLog2(uint64_t value) { // value > 0
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(value);
+#else
+    int log = 0;
+    while (value >>= 1) ++log;
+    return log;
+#endif
+}
+
+// Latency histogram in the HDR style: 16 linear buckets per power of two of nanoseconds, so
+// every value is kept to within 1/16 from 1 ns up to 2^41 ns (about 37 minutes) in a fixed
+// 4.8 KB array. Written by one thread, read by any: counts are relaxed atomics updated with
+// a plain load and store, never a locked read-modify-write.
+class LatencyHistogram {
+    public:
+    static constexpr int SUB_BITS = 4, SUB_BUCKETS = 1 << SUB_BITS, MAX_LOG = 40;
+    static const int BUCKETS = (MAX_LOG - SUB_BITS + 2) * SUB_BUCKETS;
+
+    private:
+    atomic<uint64_t> counts[BUCKETS] = {};
+    atomic<uint64_t> totalNanos{0};
+
+    static void bump(atomic<uint64_t>& counter, uint64_t by) {
+        counter.store(counter.load(memory_order_relaxed) + by, memory_order_relaxed);
+    }
+
+    public:
+    static int bucketOf(uint64_t nanos) {
+        if (nanos < SUB_BUCKETS) return static_cast<int>(nanos);
+        int log = min(floorLog2(nanos), MAX_LOG);
+        uint64_t sub = min<uint64_t>(nanos >> (log - SUB_BITS), 2 * SUB_BUCKETS - 1); // 16..31
+        return (log - SUB_BITS) * SUB_BUCKETS + static_cast<int>(sub);
+    }
+    static uint64_t bucketLimit(int bucket) { // Largest value recorded in the bucket
+        if (bucket < SUB_BUCKETS) return bucket;
+        int log = bucket / SUB_BUCKETS + SUB_BITS - 1;
+        uint64_t sub = bucket % SUB_BUCKETS + SUB_BUCKETS;
+        return ((sub + 1) << (log - SUB_BITS)) - 1;
+    }
+
+    void record(uint64_t nanos) {
+        bump(counts[bucketOf(nanos)], 1);
+        bump(totalNanos, nanos);
+    }
+
+    // Adds another histogram's counts; the caller must be the only writer of this one
+    void add(const LatencyHistogram& other) {
+        for (int i = 0; i < BUCKETS; ++i) bump(counts[i], other.counts[i].load(memory_order_relaxed));
+        bump(totalNanos, other.totalNanos.load(memory_order_relaxed));
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (const atomic<uint64_t>& c : counts) total += c.load(memory_order_relaxed);
+        return total;
+    }
+    uint64_t sumNanos() const { return totalNanos.load(memory_order_relaxed); }
+
+    // Smallest recorded bound that at least the given fraction of values are at or below
+    uint64_t quantile(double fraction) const {
+        uint64_t total = count(), seen = 0;
+        if (!total) return 0;
+        uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(fraction * total)));
+        for (int i = 0; i < BUCKETS; ++i)
+            if ((seen += counts[i].load(memory_order_relaxed)) >= rank) return bucketLimit(i);
+        return bucketLimit(BUCKETS - 1);
+    }
+};
+
+// One thread's share of the metrics
+struct ThreadMetrics {
+    LatencyHistogram latency[OP_COUNT];
+    atomic<uint64_t> outcomes[OP_COUNT][OUTCOME_COUNT] = {};
+
+    void add(const ThreadMetrics& other) {
+        for (int op = 0; op < OP_COUNT; ++op) {
+            latency[op].add(other.latency[op]);
+            for (int o = 0; o < OUTCOME_COUNT; ++o)
+                outcomes[op][o].store(outcomes[op][o].load(memory_order_relaxed) +
+                                          other.outcomes[op][o].load(memory_order_relaxed),
+                                      memory_order_relaxed);
+        }
+    }
+};
+
+// Process-wide list of the threads' blocks. A thread registers its block on its first
+// measured operation and folds it into retired when it exits.
+class MetricsRegistry {
+    private:
+    mutex lock;
+    vector<ThreadMetrics*> live;
+    ThreadMetrics retired;
+
+    struct Registration {
+        MetricsRegistry& registry;
+        ThreadMetrics* block;
+        Registration(MetricsRegistry& r) : registry(r), block(new ThreadMetrics) {
+            lock_guard<mutex> guard(registry.lock);
+            registry.live.push_back(block);
+        }
+        ~Registration() {
+            lock_guard<mutex> guard(registry.lock);
+            registry.retired.add(*block);
+            registry.live.erase(find(registry.live.begin(), registry.live.end(), block));
+            delete block;
+        }
+    };
+
+    public:
+    static MetricsRegistry& instance() {
+        static MetricsRegistry registry;
+        return registry;
+    }
+
+    ThreadMetrics& local() {
+        thread_local Registration registration(*this);
+        return *registration.block;
+    }
+
+    // Sum of every thread's block so far; counts of operations still running may be missing
+    void merge(ThreadMetrics& total) {
+        lock_guard<mutex> guard(lock);
+        total.add(retired);
+        for (const ThreadMetrics* block : live) total.add(*block);
+    }
+};
+
+// Times one operation from construction to finish() into the calling thread's block
+class OperationTimer {
+    private:
+    MetricOp op;
+    chrono::steady_clock::time_point started;
+
+    public:
+    explicit OperationTimer(MetricOp o) : op(o), started(chrono::steady_clock::now()) {}
+
+    void finish(Outcome outcome) {
+        uint64_t nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count();
+        ThreadMetrics& metrics = MetricsRegistry::instance().local();
+        metrics.latency[op].record(nanos);
+        atomic<uint64_t>& counter = metrics.outcomes[op][static_cast<int>(outcome)];
+        counter.store(counter.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+};
+
+// Fixed set of worker threads for scatter-gather over the catalog shards. Every worker has
+// its own task deque: parallelFor deals its tasks round-robin onto the deques, a worker
+// takes from the front of its own deque and, once that is empty, steals from the back of
+// the others. The calling thread runs tasks as well, so a parallelFor finishes even when
+// every worker is busy with another caller's tasks (or there are no workers at all).
+class WorkStealingPool {
+    private:
+    struct Task {
+        const function<void(size_t)>* body;
+        size_t index;
+        atomic<size_t>* remaining;  // Tasks of the same parallelFor not yet finished
+    };
+    struct alignas(64) Queue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<Queue>> queues;  // One per worker, plus one for callers
+    vector<thread> workers;
+    atomic<size_t> queued{0};          // Tasks waiting in any deque
+    atomic<size_t> nextQueue{0};       // Where the next parallelFor starts dealing
+    mutex sleepLock;
+    condition_variable wake;           // Tasks were queued, or the pool is stopping
+    condition_variable finished;       // The last task of some parallelFor is done
+    bool stopping = false;
+
+    bool take(size_t home, Task& task) {
+        for (size_t i = 0; i < queues.size(); ++i) {
+            Queue& queue = *queues[(home + i) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty()) continue;
+            if (i == 0) {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            } else {  // Steal from the other end, away from where the owner is working
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            queued.fetch_sub(1, memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void run(const Task& task) {
+        (*task.body)(task.index);
+        if (task.remaining->fetch_sub(1, memory_order_acq_rel) == 1) {
+            lock_guard<mutex> guard(sleepLock);  // The caller may be about to wait
+            finished.notify_all();
+        }
+    }
+
+    void work(size_t home) {
+        for (;;) {
+            Task task;
+            if (take(home, task)) {
+                run(task);
+                continue;
+            }
+            unique_lock<mutex> guard(sleepLock);
+            wake.wait(guard, [this] { return stopping || queued.load(memory_order_relaxed) > 0; });
+            if (stopping) return;
+        }
+    }
+
+    public:
+    explicit WorkStealingPool(size_t threadCount) {
+        for (size_t i = 0; i <= threadCount; ++i) queues.emplace_back(new Queue);
+        for (size_t i = 0; i < threadCount; ++i) workers.emplace_back([this, i] { work(i); });
+    }
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers) worker.join();
+    }
+
+    size_t threadCount() const { return workers.size(); }
+
+    // Runs body(0) ... body(count - 1) on the workers and the calling thread; returns once
+    // all of them have finished
+    void parallelFor(size_t count, const function<void(size_t)>& body) {
+        atomic<size_t> remaining(count);
+        size_t start = nextQueue.fetch_add(1, memory_order_relaxed);
+        for (size_t i = 0; i < count; ++i) {
+            Queue& queue = *queues[(start + i) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back({&body, i, &remaining});
+        }
+        queued.fetch_add(count, memory_order_relaxed);
+        {
+            lock_guard<mutex> guard(sleepLock);
+        }
+        wake.notify_all();
+        Task task;
+        while (remaining.load(memory_order_acquire) && take(queues.size() - 1, task)) run(task);
+        unique_lock<mutex> guard(sleepLock);
+        finished.wait(guard, [&remaining] { return remaining.load(memory_order_acquire) == 0; });
+    }
+};
+
+// One partition of the catalog: the books whose ISBN hashes to it, with their own title
+// and ISBN indexes
+struct CatalogShard {
+    TitleIndex titleIndex;
+    HashTable isbnTable;
+};
+
+// Library Management System Class
+class Library {
+    private:
+    vector<unique_ptr<CatalogShard>> shards;  // Title and ISBN indexes, books split by ISBN hash
+    unique_ptr<WorkStealingPool> shardPool;   // Scans the shards in parallel (when there are several)
+    SearchIndex searchIndex;  // Words of every title and author, for partial and misspelled searches
+    IssueQueue issueQueue;    // Recently issued books, oldest first
+    UserHashTable userTable;  // Hash table for storing user information  
+    LoginCache loginCache;    // Recent logins, which skip the slow password hash
+    atomic<uint32_t> passwordCost{100000}; // PBKDF2 iterations for passwords set from now on
+    ObjectPool<Book, 4096> bookPool; // Owns every Book; records are stored contiguously per chunk
+    HoldPool holdPool;        // Nodes of every book's hold queue
+    ObjectPool<Loan, 4096> loanPool; // Every open loan
+    LoanSchedule loanSchedule;       // Due dates of the open loans
+    int64_t loanPeriod = 14 * 86400; // Seconds from issue to due date
+    size_t undoDepth = 100;          // Actions in each reader's undo history
+    uint64_t changeCounter = 0;      // Last change number given to a book
+    WriteAheadLog wal;        // Log of mutations since the last snapshot
+    uint64_t appliedSequence = 0; // Last log sequence number reflected in memory
+    string snapshotPath, logPath; // Storage opened with openStorage
+
+    // Locks, always acquired in this order. catalogLock guards the indexes and the book pool:
+    // lookups share it, adding or removing books takes it exclusively. userLock guards the
+    // user table. historyLock serializes the short commit step of every mutation (state
+    // change, undo record, log append) so history and log follow one order; hold queues are
+    // only touched in that step. The issue queue
+    // is lock-free and needs neither; it is only walked or edited under the exclusive lock.
+    StripedSharedMutex catalogLock;
+    shared_mutex userLock;
+    mutex historyLock;
+
+    // Exclusive access to the whole library, for snapshots, imports and replay
+    struct ExclusiveLock {
+        lock_guard<StripedSharedMutex> catalog;
+        unique_lock<shared_mutex> users;
+        lock_guard<mutex> history;
+        ExclusiveLock(Library& library)
+            : catalog(library.catalogLock), users(library.userLock), history(library.historyLock) {}
+    };
+
+    static BookInfo toInfo(const Book* book) {
+        return {book->title, book->author, book->isbn, book->copies, book->available.load(), book->holds.size()};
+    }
+
+    static LoanInfo toInfo(const Loan* loan) {
+        return {loan->book->title, loan->book->isbn, loan->user->username, loan->due, loan->overdue};
+    }
+
+    // Case-insensitive comparison of a header cell with a column name
+    static bool isColumn(string_view field, const char* name) {
+        size_t length = strlen(name);
+        if (field.size() != length) return false;
+        for (size_t i = 0; i < length; ++i)
+            if (tolower(static_cast<unsigned char>(field[i])) != name[i]) return false;
+        return true;
+    }
+
+    // Anything but an explicit no/false/0 counts as available
+    static bool parseAvailability(string_view field) {
+        return !(field == "0" || isColumn(field, "no") || isColumn(field, "n") || isColumn(field, "false"));
+    }
+
+    // Seconds since the epoch, the unit of due dates
+    static int64_t currentTime() {
+        return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static int64_t parseTime(string_view field) { return strtoll(string(field).c_str(), nullptr, 10); }
+
+    // Decimal count of copies; anything that is not a plain number counts as 0
+    static uint32_t parseCount(string_view field) {
+        uint64_t value = 0;
+        for (char c : field) {
+            if (c < '0' || c > '9') return 0;
+            value = min<uint64_t>(value * 10 + (c - '0'), UINT32_MAX);
+        }
+        return static_cast<uint32_t>(value);
+    }
+
+    // Sorts books by (title, isbn) with a multikey sort: 8 title bytes at a time are packed
+    // into an integer key, the keys are sorted, and only runs that still tie are refined with
+    // the next 8 bytes. Each level touches every string once instead of once per comparison.
+    static bool titleOrder(const Book* a, const Book* b) {
+        int cmp = a->title.compare(b->title);
+        return cmp ? cmp < 0 : a->isbn < b->isbn;
+    }
+
+    static void sortByTitle(vector<Book*>& books) {
+        struct SortKey {
+            uint64_t prefix; // Title bytes [depth, depth + 8) of the current level, big-endian
+            Book* book;
+        };
+        struct Range {
+            size_t first, last, depth;
+        };
+        vector<SortKey> keys(books.size());
+        for (size_t i = 0; i < books.size(); ++i) keys[i].book = books[i];
+        auto fullLess = [](const SortKey& a, const SortKey& b) {
+            if (a.prefix != b.prefix) return a.prefix < b.prefix;
+            int cmp = a.book->title.compare(b.book->title);
+            return cmp ? cmp < 0 : a.book->isbn < b.book->isbn;
+        };
+
+        vector<Range> pending;
+        if (!keys.empty()) pending.push_back({0, keys.size(), 0});
+        while (!pending.empty()) {
+            Range range = pending.back();
+            pending.pop_back();
+            bool allEnded = true; // Every title in the range ends within this level's bytes
+            for (size_t i = range.first; i < range.last; ++i) {
+                const string& title = keys[i].book->title;
+                uint64_t prefix = 0;
+                for (size_t j = range.depth; j < range.depth + 8; ++j)
+                    prefix = prefix << 8 | (j < title.size() ? static_cast<unsigned char>(title[j]) : 0);
+                keys[i].prefix = prefix;
+                if (title.size() > range.depth + 8) allEnded = false;
+            }
+            if (allEnded) { // Prefix ties are now true title ties, settled by the full comparison
+                sort(keys.begin() + range.first, keys.begin() + range.last, fullLess);
+                continue;
+            }
+            sort(keys.begin() + range.first, keys.begin() + range.last,
+                 [](const SortKey& a, const SortKey& b) { return a.prefix < b.prefix; });
+            for (size_t runStart = range.first, i = range.first + 1; i <= range.last; ++i) {
+                if (i < range.last && keys[i].prefix == keys[runStart].prefix) continue;
+                if (i - runStart > 1) pending.push_back({runStart, i, range.depth + 8});
+                runStart = i;
+            }
+        }
+        for (size_t i = 0; i < books.size(); ++i) books[i] = keys[i].book;
+    }
+
+    // Actions an undo record can hold
+    static bool isRecordAction(uint32_t code) {
+        return code >= UNDO_ADD_BOOK && code <= UNDO_HAND_OFF && code != UNDO_BATCH;
+    }
+
+    // Checks the header, section sizes, checksum and every string reference of a mapped
+    // snapshot before any of it is applied
+    static bool validateSnapshot(const MappedFile& file) {
+        if (file.size() < sizeof(SnapshotHeader)) return false;
+        SnapshotHeader header;
+        memcpy(&header, file.data(), sizeof header);
+        if (memcmp(header.magic, "LMSSNAP", 8) != 0 || header.version != SNAPSHOT_VERSION ||
+            header.byteOrder != SNAPSHOT_BYTE_ORDER || header.fileSize != file.size())
+            return false;
+        uint64_t available = file.size() - sizeof header;
+        if (header.bookCount > available / sizeof(SnapshotBook) || header.retiredCount > available / sizeof(SnapshotBook) ||
+            header.userCount > available / sizeof(SnapshotUser) ||
+            header.queueCount > available / sizeof(SnapshotString) || header.holdCount > available / sizeof(SnapshotHold) ||
+            header.loanCount > available / sizeof(SnapshotLoan) || header.undoCount > available / sizeof(SnapshotUndo))
+            return false;
+        uint64_t bookRecords = header.bookCount + header.retiredCount;
+        uint64_t records = bookRecords * sizeof(SnapshotBook) + header.userCount * sizeof(SnapshotUser) +
+                           header.queueCount * sizeof(SnapshotString) + header.holdCount * sizeof(SnapshotHold) +
+                           header.loanCount * sizeof(SnapshotLoan) + header.undoCount * sizeof(SnapshotUndo);
+        if (records > available || available - records != header.stringPoolSize) return false;
+
+        Checksum checksum;
+        checksum.update(file.data() + sizeof header, available);
+        if (checksum.value() != header.checksum) return false;
+
+        // Every record is an array of string references followed by fixed fields; check them all
+        auto inPool = [&header](SnapshotString ref) { return (ref >> 24) + (ref & 0xffffff) <= header.stringPoolSize; };
+        const char* cursor = file.data() + sizeof header;
+        const SnapshotBook* books = reinterpret_cast<const SnapshotBook*>(cursor);
+        for (uint64_t i = 0; i < bookRecords; ++i)
+            if (!inPool(books[i].title) || !inPool(books[i].author) || !inPool(books[i].isbn)) return false;
+        cursor += bookRecords * sizeof(SnapshotBook);
+        const SnapshotUser* users = reinterpret_cast<const SnapshotUser*>(cursor);
+        for (uint64_t i = 0; i < header.userCount; ++i)
+            if (!inPool(users[i].username) || users[i].iterations == 0) return false;
+        cursor += header.userCount * sizeof(SnapshotUser);
+        const SnapshotString* queue = reinterpret_cast<const SnapshotString*>(cursor);
+        for (uint64_t i = 0; i < header.queueCount; ++i)
+            if (!inPool(queue[i])) return false;
+        cursor += header.queueCount * sizeof(SnapshotString);
+        const SnapshotHold* holds = reinterpret_cast<const SnapshotHold*>(cursor);
+        for (uint64_t i = 0; i < header.holdCount; ++i)
+            if (!inPool(holds[i].isbn) || !inPool(holds[i].username)) return false;
+        cursor += header.holdCount * sizeof(SnapshotHold);
+        const SnapshotLoan* loans = reinterpret_cast<const SnapshotLoan*>(cursor);
+        for (uint64_t i = 0; i < header.loanCount; ++i)
+            if (!inPool(loans[i].isbn) || !inPool(loans[i].username)) return false;
+        cursor += header.loanCount * sizeof(SnapshotLoan);
+        const SnapshotUndo* undo = reinterpret_cast<const SnapshotUndo*>(cursor);
+        for (uint64_t i = 0; i < header.undoCount; ++i)
+            if (!inPool(undo[i].owner) || !inPool(undo[i].user) || undo[i].book >= bookRecords ||
+                !isRecordAction(undo[i].action))
+                return false;
+        return true;
+    }
+
+    // Mutations without any output. The public commands call these, and so does log replay,
+    // which must rebuild exactly the same state (undo history included) without printing.
+    Outcome applyRegister(const string& username, const PasswordHash& password) {
+        return userTable.insert(username, password) ? Outcome::Done : Outcome::Duplicate;
+    }
+
+    Outcome applyAddBook(const string& title, const string& author, const string& isbn, uint32_t copies, uint32_t available,
+                         User* owner) {
+        Book* book = insertBook(title, author, isbn, copies, available);
+        if (!book) return Outcome::Duplicate;
+        recordChange(owner, UNDO_ADD_BOOK, book);
+        return Outcome::Done;
+    }
+
+    // Opens a loan and links it into the reader's list, the book's list and the schedule
+    void openLoan(Book* book, User* user, int64_t due, bool overdue = false) {
+        Loan* loan = loanPool.create(book, user, due);
+        loan->overdue = overdue;
+        loan->userPrev = user->lastLoan;
+        (user->lastLoan ? user->lastLoan->userNext : user->loans) = loan;
+        user->lastLoan = loan;
+        ++user->loanCount;
+        loan->bookNext = book->loans;
+        if (book->loans) book->loans->bookPrev = loan;
+        book->loans = loan;
+        loanSchedule.add(loan);
+    }
+
+    void closeLoan(Loan* loan) {
+        User* user = loan->user;
+        (loan->userPrev ? loan->userPrev->userNext : user->loans) = loan->userNext;
+        (loan->userNext ? loan->userNext->userPrev : user->lastLoan) = loan->userPrev;
+        --user->loanCount;
+        (loan->bookPrev ? loan->bookPrev->bookNext : loan->book->loans) = loan->bookNext;
+        if (loan->bookNext) loan->bookNext->bookPrev = loan->bookPrev;
+        loanSchedule.remove(loan);
+        loanPool.destroy(loan);
+    }
+
+    // The loan a return of this book closes: the reader's own loan of it, or else (a return
+    // handed in for someone else) the book's loan that is due first. Only the book's list is
+    // walked, since a book has at most its copy count out while a reader may have thousands.
+    static Loan* loanToClose(const Book* book, const User* user) {
+        for (Loan* loan = book->loans; loan; loan = loan->bookNext)
+            if (loan->user == user) return loan;
+        Loan* first = book->loans;
+        for (Loan* loan = first; loan; loan = loan->bookNext)
+            if (loan->due < first->due) first = loan;
+        return first;
+    }
+
+    // Issue and return take the book already looked up, so callers can do the lookup under
+    // the shared catalog lock. The shelf count is changed with compare-and-swap: of two desks
+    // issuing the last copy, exactly one succeeds. The copy goes out on a loan to user, due
+    // at the given time.
+    Outcome applyIssue(Book* book, User* user, int64_t due, uint8_t flags = 0) {
+        if (!book) return Outcome::NotFound;
+        if (!user) return Outcome::NotLoggedIn;
+        uint32_t onShelf = book->available.load(memory_order_relaxed);
+        do {
+            if (onShelf == 0) return Outcome::NotAvailable;
+        } while (!book->available.compare_exchange_weak(onShelf, onShelf - 1));
+        openLoan(book, user, due);
+        recordChange(user, UNDO_ISSUE_BOOK, book, user, due, flags);
+        return Outcome::Done;
+    }
+
+    // Closes the loan of the returned copy (see loanToClose). The copy then goes straight to
+    // the reader at the front of the hold queue on a new loan due at holderDue, if anybody is
+    // waiting (handedTo receives that reader), or back on the shelf otherwise.
+    Outcome applyReturn(Book* book, User* user, int64_t holderDue, User** handedTo = nullptr, uint8_t flags = 0) {
+        if (!book) return Outcome::NotFound;
+        uint32_t onShelf = book->available.load(memory_order_relaxed);
+        if (onShelf >= book->copies) return Outcome::NotIssued;
+        User* next = book->holds.dequeue(holdPool);
+        if (!next) {
+            do {
+                if (onShelf >= book->copies) return Outcome::NotIssued;
+            } while (!book->available.compare_exchange_weak(onShelf, onShelf + 1));
+        }
+        if (Loan* loan = loanToClose(book, user)) {
+            recordChange(user, UNDO_RETURN_BOOK, book, loan->user, loan->due, flags);
+            closeLoan(loan);
+        } else {
+            recordChange(user, UNDO_RETURN_BOOK, book, nullptr, 0, flags);  // A copy that was out without a loan record
+        }
+        if (next) {  // The hand-off is undone together with the return it passed on
+            openLoan(book, next, holderDue);
+            recordChange(user, UNDO_HAND_OFF, book, next, holderDue, flags | UNDO_JOINED);
+            if (handedTo) *handedTo = next;
+        }
+        return Outcome::Done;
+    }
+
+    // Puts a reader in the hold queue of a book with no copy on the shelf
+    Outcome applyHold(Book* book, User* user, size_t* position = nullptr) {
+        if (!book) return Outcome::NotFound;
+        if (!user) return Outcome::NotLoggedIn;
+        if (book->isAvailable()) return Outcome::Invalid;  // Issue it instead
+        if (size_t place = book->holds.position(user)) {
+            if (position) *position = place;
+            return Outcome::Duplicate;
+        }
+        book->holds.enqueue(holdPool, user);
+        recordChange(user, UNDO_HOLD, book, user);
+        if (position) *position = book->holds.size();
+        return Outcome::Held;
+    }
+
+    // Withdraws a reader from a hold queue. Not undoable, like logging out.
+    Outcome applyCancelHold(Book* book, User* user) {
+        if (!book) return Outcome::NotFound;
+        if (!user || !book->holds.remove(holdPool, user)) return Outcome::NotIssued;
+        book->version = ++changeCounter;  // Earlier actions on the book can no longer be undone
+        return Outcome::Done;
+    }
+
+    // Closes the newest loan of a book to a reader, if there is one
+    void closeNewestLoan(Book* book, const User* user) {
+        for (Loan* loan = user ? user->lastLoan : nullptr; loan; loan = loan->userPrev)
+            if (loan->book == book) {
+                closeLoan(loan);
+                return;
+            }
+    }
+
+    // Gives the book a new change number and files the undo record in the owner's history.
+    // Changes made on nobody's behalf (owner is nullptr) are not undoable.
+    void recordChange(User* owner, uint8_t action, Book* book, User* user = nullptr, int64_t due = 0, uint8_t flags = 0) {
+        UndoRecord record = {book, user, due, ++changeCounter, book->version, action, flags};
+        book->version = record.sequence;
+        if (!owner) return;
+        ++book->historyRefs;
+        owner->history.push(record, undoDepth, [this](const UndoRecord& old) { releaseRecord(old); });
+    }
+
+    // A record left its history; a book that undo took out of the catalog is freed with its last record
+    void releaseRecord(const UndoRecord& record) {
+        Book* book = record.book;
+        if (--book->historyRefs == 0 && book->retired) {
+            searchIndex.discard(book);
+            bookPool.destroy(book);
+        }
+    }
+
+    // Whether the books of a group are still exactly as the group left them (undo) or found
+    // them (redo), that is nobody changed them in between. Records are checked in the order
+    // they would be applied, each moving its book's change number on as it would.
+    template <typename Record>
+    static bool unchangedSince(size_t count, Record record, bool undoing) {
+        size_t matched = 0;
+        for (; matched < count; ++matched) {
+            const UndoRecord& r = record(matched);
+            if (r.book->version != (undoing ? r.sequence : r.previous)) break;
+            r.book->version = undoing ? r.previous : r.sequence;
+        }
+        bool unchanged = matched == count;
+        while (matched-- > 0) {
+            const UndoRecord& r = record(matched);
+            r.book->version = undoing ? r.sequence : r.previous;
+        }
+        return unchanged;
+    }
+
+    // Reverts one record
+    void revert(const UndoRecord& record) {
+        Book* book = record.book;
+        if (record.action == UNDO_ADD_BOOK) {
+            book->holds.clear(holdPool);
+            while (book->loans) closeLoan(book->loans);
+            shardOf(book->isbn).titleIndex.remove(book);  // Remove exactly this edition from the title index
+            searchIndex.remove(book);
+            removeFromHashTable(book->isbn);  // Remove the book from the hash table
+            book->retired = true;  // Freed once no record refers to it
+        } else if (record.action == UNDO_ISSUE_BOOK) {
+            if (book->available < book->copies) ++book->available;  // Put the copy back on the shelf
+            closeNewestLoan(book, record.user);
+            issueQueue.withdraw(book);  // Withdraw the entry the issue added to the queue
+        } else if (record.action == UNDO_RETURN_BOOK) {
+            if (book->available > 0) --book->available;  // Take the copy off the shelf again
+            if (record.user) openLoan(book, record.user, record.due);  // Reopen the loan with its old due date
+        } else if (record.action == UNDO_HOLD) {
+            book->holds.remove(holdPool, record.user);
+        } else if (record.action == UNDO_HAND_OFF) {
+            closeNewestLoan(book, record.user);
+            book->holds.pushFront(holdPool, record.user);  // Back to the front of the queue
+            ++book->available;  // The copy is back as the return left it
+        }
+        book->version = record.previous;
+    }
+
+    // Applies one record again after it was undone
+    void reapply(const UndoRecord& record) {
+        Book* book = record.book;
+        if (record.action == UNDO_ADD_BOOK) {
+            book->retired = false;
+            CatalogShard& shard = shardOf(book->isbn);
+            shard.titleIndex.insert(book);
+            searchIndex.restore(book);  // Its postings are still in the index
+            shard.isbnTable.insert(book->isbn, book);
+        } else if (record.action == UNDO_ISSUE_BOOK) {
+            if (book->available > 0) --book->available;
+            openLoan(book, record.user, record.due);
+            queueIssued(book);
+        } else if (record.action == UNDO_RETURN_BOOK) {
+            Loan* loan = nullptr;
+            for (Loan* open = book->loans; open && !loan; open = open->bookNext)
+                if (open->user == record.user && open->due == record.due) loan = open;
+            if (loan) closeLoan(loan);
+            if (book->available < book->copies) ++book->available;
+        } else if (record.action == UNDO_HOLD) {
+            book->holds.enqueue(holdPool, record.user);
+        } else if (record.action == UNDO_HAND_OFF) {
+            book->holds.dequeue(holdPool);  // The reader is at the front again
+            if (book->available > 0) --book->available;
+            openLoan(book, record.user, record.due);
+        }
+        book->version = record.sequence;
+    }
+
+    // Reverts the owner's most recent action, together with the rest of its group; action
+    // receives its UndoAction code. If another reader has changed one of its books since, the
+    // group is dropped instead and the outcome is Outcome::Conflict.
+    Outcome applyUndo(User* owner, uint32_t& action) {
+        if (!owner) return Outcome::NotLoggedIn;
+        UndoHistory& history = owner->history;
+        size_t count = history.undoGroup();
+        if (!count) return Outcome::NothingToUndo;
+        const UndoRecord& newest = history.undoRecord(0);
+        action = newest.flags & UNDO_IN_BATCH ? uint32_t(UNDO_BATCH) : newest.action;
+        if (!unchangedSince(count, [&history](size_t i) -> const UndoRecord& { return history.undoRecord(i); }, true)) {
+            history.dropUndoGroup(count, [this](const UndoRecord& old) { releaseRecord(old); });
+            return Outcome::Conflict;
+        }
+        for (size_t i = 0; i < count; ++i) revert(history.undoRecord(i));  // Newest first
+        history.undone(count);
+        return Outcome::Done;
+    }
+
+    // Applies the owner's most recently undone group again. If its books have changed since
+    // the undo, every redoable record of the owner is dropped and the outcome is Outcome::Conflict.
+    Outcome applyRedo(User* owner, uint32_t& action) {
+        if (!owner) return Outcome::NotLoggedIn;
+        UndoHistory& history = owner->history;
+        size_t count = history.redoGroup();
+        if (!count) return Outcome::NothingToRedo;
+        const UndoRecord& last = history.redoRecord(count - 1);
+        action = last.flags & UNDO_IN_BATCH ? uint32_t(UNDO_BATCH) : last.action;
+        bool unchanged = unchangedSince(count, [&history](size_t i) -> const UndoRecord& { return history.redoRecord(i); }, false);
+        for (size_t i = 0; i < count && unchanged; ++i) {
+            const UndoRecord& record = history.redoRecord(i);
+            if (record.action == UNDO_ADD_BOOK && findBook(record.book->isbn)) unchanged = false;  // The ISBN was added again
+        }
+        if (!unchanged) {
+            history.dropRedoable([this](const UndoRecord& old) { releaseRecord(old); });
+            return Outcome::Conflict;
+        }
+        for (size_t i = 0; i < count; ++i) reapply(history.redoRecord(i));  // Oldest first
+        history.redone(count);
+        return Outcome::Done;
+    }
+
+    // Issues or returns a batch of looked-up books (nullptr for ISBNs not found) for one user;
+    // results[i] receives the outcome for books[i]. The changes are recorded as one undo
+    // group, so they are undone and redone together. Returns the number applied.
+    size_t applyBatch(const vector<Book*>& books, bool issuing, User* user, int64_t due, Outcome* results) {
+        size_t applied = 0;
+        for (size_t i = 0; i < books.size(); ++i) {
+            uint8_t flags = applied ? UNDO_IN_BATCH | UNDO_JOINED : UNDO_IN_BATCH;
+            results[i] = issuing ? applyIssue(books[i], user, due, flags) : applyReturn(books[i], user, due, nullptr, flags);
+            if (results[i] == Outcome::Done) ++applied;
+        }
+        return applied;
+    }
+
+    Outcome stepHistory(Session& session, bool undoing, uint32_t* action) {
+        if (!session.isLoggedIn()) return Outcome::NotLoggedIn;
+        lock_guard<StripedSharedMutex> catalog(catalogLock);  // Undoing an addition removes a book
+        shared_lock<shared_mutex> users(userLock);
+        lock_guard<mutex> history(historyLock);
+        User* user = userTable.search(session.username);
+        uint32_t done = 0;
+        Outcome outcome = undoing ? applyUndo(user, done) : applyRedo(user, done);
+        if (outcome == Outcome::Done || outcome == Outcome::Conflict)  // Both change the history
+            logOperation(undoing ? WAL_UNDO : WAL_REDO, {session.username});
+        if (action) *action = done;
+        return outcome;
+    }
+
+    vector<Outcome> circulateBatch(Session& session, const vector<string>& isbns, bool issuing) {
+        vector<Outcome> results(isbns.size(), Outcome::NotLoggedIn);
+        if (!session.isLoggedIn()) return results;
+        ReadGuard catalog(catalogLock);
+        vector<Book*> books(isbns.size());
+        findBooks(isbns, books.data());  // All lookups before taking the commit lock
+        {
+            shared_lock<shared_mutex> users(userLock);
+            User* user = userTable.search(session.username);
+            if (!user) return results;
+            lock_guard<mutex> history(historyLock);
+            int64_t due = currentTime() + loanPeriod;
+            if (!applyBatch(books, issuing, user, due, results.data())) return results;
+            string dueText = to_string(due);
+            vector<string_view> applied = {session.username, dueText};
+            for (size_t i = 0; i < isbns.size(); ++i)
+                if (results[i] == Outcome::Done) applied.push_back(isbns[i]);
+            logOperation(issuing ? WAL_ISSUE_BATCH : WAL_RETURN_BATCH, applied);
+        }
+        if (issuing)
+            for (size_t i = 0; i < books.size(); ++i)
+                if (results[i] == Outcome::Done) queueIssued(books[i]);
+        return results;
+    }
+
+    // Adds a book to the issue queue. With nobody draining it, the queue keeps the most
+    // recent issues: when it is full the oldest entry makes room.
+    void queueIssued(Book* book) {
+        while (!issueQueue.enqueue(book)) issueQueue.dequeue();
+    }
+
+    // Appends a completed mutation to the write-ahead log, if one is open (historyLock held)
+    void logOperation(uint8_t op, initializer_list<string_view> fields) {
+        if (wal.isOpen()) appliedSequence = wal.append(op, fields);
+    }
+    void logOperation(uint8_t op, const vector<string_view>& fields) {
+        if (wal.isOpen()) appliedSequence = wal.append(op, fields);
+    }
+
+    // Applies one logged mutation during startup replay
+    void replayOperation(uint8_t op, const vector<string_view>& fields) {
+        uint32_t action;
+        if (op == WAL_REGISTER && fields.size() == 2) {
+            PasswordHash password;
+            if (PasswordHash::parse(fields[1], password)) applyRegister(string(fields[0]), password);
+        }
+        else if (op == WAL_ADD_BOOK && fields.size() == 6)
+            applyAddBook(string(fields[0]), string(fields[1]), string(fields[2]), parseCount(fields[4]),
+                         parseCount(fields[3]), userTable.search(string(fields[5])));
+        else if (op == WAL_ISSUE_BOOK && fields.size() == 3) {
+            Book* book = findBook(string(fields[0]));
+            if (applyIssue(book, userTable.search(string(fields[1])), parseTime(fields[2])) == Outcome::Done)
+                queueIssued(book);
+        }
+        else if (op == WAL_RETURN_BOOK && fields.size() == 3)
+            applyReturn(findBook(string(fields[0])), userTable.search(string(fields[1])), parseTime(fields[2]));
+        else if (op == WAL_UNDO && fields.size() == 1) applyUndo(userTable.search(string(fields[0])), action);
+        else if (op == WAL_REDO && fields.size() == 1) applyRedo(userTable.search(string(fields[0])), action);
+        else if ((op == WAL_HOLD || op == WAL_CANCEL_HOLD) && fields.size() == 2) {
+            Book* book = findBook(string(fields[0]));
+            User* user = userTable.search(string(fields[1]));
+            if (op == WAL_HOLD) applyHold(book, user);
+            else applyCancelHold(book, user);
+        }
+        else if ((op == WAL_ISSUE_BATCH || op == WAL_RETURN_BATCH) && fields.size() >= 2) {
+            vector<Book*> books;
+            for (size_t i = 2; i < fields.size(); ++i) books.push_back(findBook(string(fields[i])));
+            vector<Outcome> results(books.size());
+            applyBatch(books, op == WAL_ISSUE_BATCH, userTable.search(string(fields[0])), parseTime(fields[1]), results.data());
+            if (op == WAL_ISSUE_BATCH)
+                for (size_t i = 0; i < books.size(); ++i)
+                    if (results[i] == Outcome::Done) queueIssued(books[i]);
+        }
+    }
+
+    // Create a book and index it, without recording undo history or printing anything.
+    // Returns nullptr if the ISBN is already in the catalog.
+    Book* insertBook(const string& title, const string& author, const string& isbn, uint32_t copies = 1, uint32_t available = 1) {
+        CatalogShard& shard = shardOf(isbn);
+        if (shard.isbnTable.search(isbn)) return nullptr;  // ISBNs are unique keys of the catalog
+        Book* newBook = bookPool.create(title, author, isbn, copies, available);  // Create a new book object
+        shard.titleIndex.insert(newBook);  // Insert the book into the title index
+        searchIndex.add(newBook);
+        shard.isbnTable.insert(isbn, newBook);  // Add the book to the hash table
+        return newBook;
+    }
+
+    // Drop every book, user, issued entry and undo record
+    void clearState() {
+        for (auto& shard : shards) {
+            shard->titleIndex.clear();
+            shard->isbnTable.clear();
+        }
+        searchIndex.clear();
+        issueQueue.clear();
+        userTable.clear();  // Undo histories go with their users
+        loginCache.clear();
+        bookPool.release();
+        holdPool.release();
+        loanPool.release();
+        loanSchedule.clear();
+        changeCounter = 0;
+    }
+
+    // Write the whole library state to a snapshot file. The file is written under a
+    // temporary name and renamed into place, so an interrupted save keeps the old snapshot.
+    bool writeSnapshot(const string& path) {
+        string tempPath = path + ".tmp";
+        FILE* file = fopen(tempPath.c_str(), "wb");
+        if (!file) return false;
+
+        SnapshotHeader header = {};
+        memcpy(header.magic, "LMSSNAP", 8);
+        header.version = SNAPSHOT_VERSION;
+        header.byteOrder = SNAPSHOT_BYTE_ORDER;
+        header.bookCount = catalogSize();
+        userTable.forEach([&header](const User*) { ++header.userCount; });
+        header.queueCount = issueQueue.size();
+        vector<pair<const Book*, const User*>> holds;  // Every waiting reader, book by book in title order
+        forEachInTitleOrder([&holds](const Book* book) {
+            if (book->holds.size()) book->holds.forEach([&](const User* user) { holds.emplace_back(book, user); });
+        });
+        header.holdCount = holds.size();
+        vector<const Loan*> loans;  // Reader by reader, oldest loan first
+        loans.reserve(loanPool.size());
+        userTable.forEach([&loans](const User* user) {
+            for (const Loan* loan = user->loans; loan; loan = loan->userNext) loans.push_back(loan);
+        });
+        header.loanCount = loans.size();
+        struct HistoryEntry {
+            const User* owner;
+            const UndoRecord* record;
+            bool redoable;
+        };
+        vector<HistoryEntry> history;  // Owner by owner, oldest record first
+        unordered_map<const Book*, uint64_t> bookIndex;  // Position in the book records of every book a record refers to
+        vector<const Book*> retired;   // Books only the history still refers to
+        userTable.forEach([&](const User* user) {
+            user->history.forEach([&](const UndoRecord& record, bool redoable) {
+                history.push_back({user, &record, redoable});
+                if (bookIndex.emplace(record.book, header.bookCount + retired.size()).second && record.book->retired)
+                    retired.push_back(record.book);
+            });
+        });
+        header.retiredCount = retired.size();
+        header.undoCount = history.size();
+        header.walSequence = appliedSequence;
+        header.changeCounter = changeCounter;
+        bool ok = fwrite(&header, sizeof header, 1, file) == 1;  // Placeholder, rewritten at the end
+
+        // Records first, assigning pool offsets in the order the strings are written afterwards
+        SnapshotWriter out(file);
+        uint64_t poolSize = 0;
+        auto ref = [&poolSize, &ok](const string& text) {
+            if (text.size() > 0xffffff) ok = false;  // Longer than a SnapshotString can describe
+            SnapshotString result = poolSize << 24 | text.size();
+            poolSize += text.size();
+            return result;
+        };
+        uint64_t position = 0;
+        auto writeBook = [&](const Book* book) {
+            SnapshotBook record = {ref(book->title), ref(book->author), ref(book->isbn), book->copies, book->available.load(),
+                                   book->version};
+            out.write(&record, sizeof record);
+            if (book->historyRefs && !book->retired) bookIndex[book] = position;
+            ++position;
+        };
+        forEachInTitleOrder(writeBook);
+        for (const Book* book : retired) writeBook(book);
+        userTable.forEach([&](const User* user) {
+            SnapshotUser record = {ref(user->username), user->password.iterations, 0, {}, {}};
+            memcpy(record.salt, user->password.salt, sizeof record.salt);
+            memcpy(record.digest, user->password.digest, sizeof record.digest);
+            out.write(&record, sizeof record);
+        });
+        issueQueue.forEach([&](const Book* book) {
+            SnapshotString record = ref(book->isbn);
+            out.write(&record, sizeof record);
+        });
+        for (const auto& hold : holds) {
+            SnapshotHold record = {ref(hold.first->isbn), ref(hold.second->username)};
+            out.write(&record, sizeof record);
+        }
+        for (const Loan* loan : loans) {
+            SnapshotLoan record = {ref(loan->book->isbn), ref(loan->user->username), loan->due,
+                                   loan->overdue ? SNAPSHOT_OVERDUE : 0, 0};
+            out.write(&record, sizeof record);
+        }
+        for (const HistoryEntry& entry : history) {
+            const UndoRecord& undo = *entry.record;
+            SnapshotUndo record = {ref(entry.owner->username), ref(undo.user ? undo.user->username : string()),
+                                   bookIndex[undo.book], undo.due, undo.sequence, undo.previous, undo.action,
+                                   undo.flags | (entry.redoable ? SNAPSHOT_REDOABLE : 0)};
+            out.write(&record, sizeof record);
+        }
+
+        // String pool
+        auto text = [&out](const string& value) { out.write(value.data(), value.size()); };
+        auto bookText = [&](const Book* book) {
+            text(book->title);
+            text(book->author);
+            text(book->isbn);
+        };
+        forEachInTitleOrder(bookText);
+        for (const Book* book : retired) bookText(book);
+        userTable.forEach([&](const User* user) { text(user->username); });
+        issueQueue.forEach([&](const Book* book) { text(book->isbn); });
+        for (const auto& hold : holds) {
+            text(hold.first->isbn);
+            text(hold.second->username);
+        }
+        for (const Loan* loan : loans) {
+            text(loan->book->isbn);
+            text(loan->user->username);
+        }
+        for (const HistoryEntry& entry : history) {
+            text(entry.owner->username);
+            if (entry.record->user) text(entry.record->user->username);
+        }
+        out.flush();
+
+        header.checksum = out.value();
+        header.stringPoolSize = poolSize;
+        header.fileSize = sizeof header + (header.bookCount + header.retiredCount) * sizeof(SnapshotBook) +
+                          header.userCount * sizeof(SnapshotUser) +
+                          header.queueCount * sizeof(SnapshotString) + header.holdCount * sizeof(SnapshotHold) +
+                          header.loanCount * sizeof(SnapshotLoan) + header.undoCount * sizeof(SnapshotUndo) + poolSize;
+        ok = ok && out.ok() && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof header, 1, file) == 1 &&
+             fflush(file) == 0;
+#ifndef _WIN32
+        ok = ok && fsync(fileno(file)) == 0;
+#endif
+        ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+        if (ok) remove(path.c_str());  // rename() does not replace an existing file on Windows
+#endif
+        ok = ok && rename(tempPath.c_str(), path.c_str()) == 0;
+        if (!ok) remove(tempPath.c_str());
+        return ok;
+    }
+
+    // Replace the library state with a snapshot. The file is mapped and its fixed-size
+    // records are read in place; books are stored in title order, so the title index is
+    // rebuilt bottom-up without sorting.
+    Outcome readSnapshot(const string& path, StorageSummary& summary) {
+        summary.path = path;
+        MappedFile file;
+        if (!file.open(path)) return summary.outcome = Outcome::CannotOpen;
+        if (!validateSnapshot(file)) return summary.outcome = Outcome::Corrupt;
+        clearState();
+
+        SnapshotHeader header;
+        memcpy(&header, file.data(), sizeof header);
+        appliedSequence = header.walSequence;
+        changeCounter = header.changeCounter;
+        const char* cursor = file.data() + sizeof header;
+        const SnapshotBook* books = reinterpret_cast<const SnapshotBook*>(cursor);
+        cursor += (header.bookCount + header.retiredCount) * sizeof(SnapshotBook);
+        const SnapshotUser* users = reinterpret_cast<const SnapshotUser*>(cursor);
+        cursor += header.userCount * sizeof(SnapshotUser);
+        const SnapshotString* queue = reinterpret_cast<const SnapshotString*>(cursor);
+        cursor += header.queueCount * sizeof(SnapshotString);
+        const SnapshotHold* holds = reinterpret_cast<const SnapshotHold*>(cursor);
+        cursor += header.holdCount * sizeof(SnapshotHold);
+        const SnapshotLoan* loans = reinterpret_cast<const SnapshotLoan*>(cursor);
+        cursor += header.loanCount * sizeof(SnapshotLoan);
+        const SnapshotUndo* undo = reinterpret_cast<const SnapshotUndo*>(cursor);
+        cursor += header.undoCount * sizeof(SnapshotUndo);
+        const char* pool = cursor;
+        auto text = [pool](SnapshotString ref) { return string(pool + (ref >> 24), ref & 0xffffff); };
+
+        vector<Book*> sorted;  // The catalog in title order, then the retired books
+        sorted.reserve(header.bookCount + header.retiredCount);
+        for (uint64_t i = 0; i < header.bookCount + header.retiredCount; ++i) {
+            const SnapshotBook& record = books[i];
+            sorted.push_back(bookPool.create(text(record.title), text(record.author), text(record.isbn), record.copies,
+                                             record.available));
+            sorted.back()->version = record.version;
+            sorted.back()->retired = i >= header.bookCount;
+        }
+        vector<Book*> retired(sorted.begin() + header.bookCount, sorted.end());
+        sorted.resize(header.bookCount);
+        loadShards(sorted);  // Separate pass: the random table writes would evict the streamed records
+        for (Book* book : sorted) searchIndex.add(book);
+        userTable.reserve(header.userCount);
+        for (uint64_t i = 0; i < header.userCount; ++i) {
+            PasswordHash password;
+            password.iterations = users[i].iterations;
+            memcpy(password.salt, users[i].salt, sizeof password.salt);
+            memcpy(password.digest, users[i].digest, sizeof password.digest);
+            userTable.insert(text(users[i].username), password);
+        }
+        for (uint64_t i = 0; i < header.queueCount; ++i)
+            if (Book* book = findBook(text(queue[i]))) queueIssued(book);
+        for (uint64_t i = 0; i < header.holdCount; ++i) {
+            Book* book = findBook(text(holds[i].isbn));
+            User* user = userTable.search(text(holds[i].username));
+            if (book && user) book->holds.enqueue(holdPool, user);
+        }
+        for (uint64_t i = 0; i < header.loanCount; ++i) {
+            Book* book = findBook(text(loans[i].isbn));
+            User* user = userTable.search(text(loans[i].username));
+            if (book && user) openLoan(book, user, loans[i].due, (loans[i].flags & SNAPSHOT_OVERDUE) != 0);
+        }
+        auto forget = [](const UndoRecord& old) { --old.book->historyRefs; };  // Retired books are freed below
+        for (uint64_t i = 0; i < header.undoCount; ++i) {
+            const SnapshotUndo& record = undo[i];
+            User* owner = userTable.search(text(record.owner));
+            if (!owner) continue;
+            Book* book = record.book < header.bookCount ? sorted[record.book] : retired[record.book - header.bookCount];
+            User* user = (record.user & 0xffffff) ? userTable.search(text(record.user)) : nullptr;
+            UndoRecord loaded = {book, user, record.due, record.sequence, record.previous, static_cast<uint8_t>(record.action),
+                                 static_cast<uint8_t>(record.flags)};
+            ++book->historyRefs;
+            if (record.flags & SNAPSHOT_REDOABLE) owner->history.pushRedoable(loaded, undoDepth);
+            else owner->history.push(loaded, undoDepth, forget);
+        }
+        for (Book* book : retired)
+            if (!book->historyRefs) bookPool.destroy(book);
+        summary.books = header.bookCount;
+        summary.users = header.userCount;
+        return summary.outcome = Outcome::Done;
+    }
+
+    bool checkpointLocked() {
+        if (!wal.isOpen()) return false;
+        if (!wal.sync() || !writeSnapshot(snapshotPath)) return false;
+        return wal.open(logPath, appliedSequence + 1, true);
+    }
+
+    // Runs one API call and records its latency and outcome in the calling thread's metrics
+    template <typename Operation>
+    static auto measured(MetricOp op, Operation operation) {
+        OperationTimer timer(op);
+        auto result = operation();
+        timer.finish(metricOutcome(result));
+        return result;
+    }
+
+    //function to remove a book from the hash table
+    void removeFromHashTable(const string& isbn) {
+        shardOf(isbn).isbnTable.remove(isbn);
+    }
+
+    // Shard of an ISBN. The high half of the hash picks it, since the ISBN table of the shard
+    // indexes its slots with the low bits.
+    size_t shardIndex(const string& isbn) const {
+        return shards.size() == 1 ? 0 : ((hashString(isbn) >> 32) * shards.size()) >> 32;
+    }
+    CatalogShard& shardOf(const string& isbn) { return *shards[shardIndex(isbn)]; }
+
+    Book* findBook(const string& isbn) { return shardOf(isbn).isbnTable.search(isbn); }
+
+    // Batched lookup: the ISBNs are grouped by shard and each group is looked up with
+    // prefetching; results[i] is the book of isbns[i] or nullptr
+    void findBooks(const vector<string>& isbns, Book** results) {
+        if (shards.size() == 1) return shards[0]->isbnTable.searchBatch(isbns, results);
+        vector<vector<string>> keys(shards.size());
+        vector<vector<size_t>> positions(shards.size());
+        for (size_t i = 0; i < isbns.size(); ++i) {
+            size_t shard = shardIndex(isbns[i]);
+            keys[shard].push_back(isbns[i]);
+            positions[shard].push_back(i);
+        }
+        vector<Book*> found;
+        for (size_t s = 0; s < shards.size(); ++s) {
+            found.resize(keys[s].size());
+            shards[s]->isbnTable.searchBatch(keys[s], found.data());
+            for (size_t i = 0; i < found.size(); ++i) results[positions[s][i]] = found[i];
+        }
+    }
+
+    size_t catalogSize() const {
+        size_t books = 0;
+        for (const auto& shard : shards) books += shard->titleIndex.size();
+        return books;
+    }
+
+    // Runs task(shard) for every shard: in parallel on the pool once the catalog is big
+    // enough to pay for the hand-off, otherwise one after the other on this thread
+    void forEachShard(const function<void(size_t)>& task) {
+        static const size_t PARALLEL_MIN_BOOKS = 16384;
+        if (shardPool && catalogSize() >= PARALLEL_MIN_BOOKS) shardPool->parallelFor(shards.size(), task);
+        else
+            for (size_t s = 0; s < shards.size(); ++s) task(s);
+    }
+
+    // Calls visit(book) for the whole catalog in title order, merging the shards' trees
+    template <typename Visitor>
+    void forEachInTitleOrder(Visitor visit) const {
+        if (shards.size() == 1) return shards[0]->titleIndex.forEach(visit);
+        vector<TitleIndex::Cursor> cursors;
+        for (const auto& shard : shards) {
+            TitleIndex::Cursor cursor = shard->titleIndex.begin();
+            if (cursor.isValid()) cursors.push_back(cursor);
+        }
+        auto later = [](const TitleIndex::Cursor& a, const TitleIndex::Cursor& b) { return titleOrder(b.book(), a.book()); };
+        make_heap(cursors.begin(), cursors.end(), later);
+        while (!cursors.empty()) {
+            pop_heap(cursors.begin(), cursors.end(), later);
+            TitleIndex::Cursor& first = cursors.back();
+            visit(first.book());
+            first.next();
+            if (first.isValid()) push_heap(cursors.begin(), cursors.end(), later);
+            else cursors.pop_back();
+        }
+    }
+
+    // Replaces the title indexes with books sorted by (title, isbn), split among the shards
+    // with their order kept, and adds the books to the ISBN indexes
+    void loadShards(const vector<Book*>& sorted) {
+        vector<vector<Book*>> parts(shards.size());
+        for (Book* book : sorted) parts[shardIndex(book->isbn)].push_back(book);
+        forEachShard([&](size_t s) {
+            CatalogShard& shard = *shards[s];
+            shard.isbnTable.reserve(shard.isbnTable.size() + parts[s].size());
+            for (Book* book : parts[s]) shard.isbnTable.insert(book->isbn, book);
+            shard.titleIndex.bulkLoad(parts[s]);
+        });
+    }
+
+public:
+    // Constructor. The catalog is split into shardCount shards by ISBN hash; with more than
+    // one, title lookups and listings scan the shards in parallel on up to one thread per core.
+    explicit Library(size_t shardCount = 1) {
+        shardCount = max<size_t>(shardCount, 1);
+        for (size_t i = 0; i < shardCount; ++i) shards.emplace_back(new CatalogShard);
+        size_t cores = max<unsigned>(thread::hardware_concurrency(), 1);
+        if (shardCount > 1) shardPool.reset(new WorkStealingPool(min(shardCount, cores) - 1));  // The caller is one more
+    }
+
+    size_t shardCount() const { return shards.size(); }
+
+    // Thread-safe API. Any number of threads may call these at once, each with its own Session.
+
+    // Register a new user. Only a salted hash of the password is kept, and logged.
+    Outcome signUp(const string& username, const string& password) {
+        {
+            shared_lock<shared_mutex> users(userLock);
+            if (userTable.search(username)) return Outcome::Duplicate;
+        }
+        PasswordHash hash = PasswordHash::create(password, passwordCost);  // The slow part, before any lock
+        unique_lock<shared_mutex> users(userLock);
+        lock_guard<mutex> history(historyLock);
+        if (applyRegister(username, hash) == Outcome::Duplicate) return Outcome::Duplicate;
+        logOperation(WAL_REGISTER, {username, hash.toString()});
+        return Outcome::Done;
+    }
+
+    // Log a session in; the session is left unchanged if the credentials are wrong. The
+    // password hash runs outside the user lock, and not at all for a user who logged in with
+    // the same password recently (see LoginCache).
+    Outcome login(Session& session, const string& username, const string& password) {
+        return measured(OP_LOGIN, [&] {
+            const User* user;
+            PasswordHash stored;
+            {
+                shared_lock<shared_mutex> users(userLock);
+                user = userTable.search(username);
+                if (user) stored = user->password;
+            }
+            if (!user) {  // Spend the same time as a wrong password, so names cannot be probed
+                static const PasswordHash unknown = PasswordHash::create("", passwordCost);
+                unknown.matches(password);
+                return Outcome::InvalidCredentials;
+            }
+            if (!loginCache.check(user, username, password)) {
+                if (!stored.matches(password)) return Outcome::InvalidCredentials;
+                loginCache.remember(user, username, password);
+            }
+            session.username = username;
+            return Outcome::Done;
+        });
+    }
+
+    // PBKDF2 iterations for passwords registered from now on. Existing hashes keep their own.
+    void setPasswordCost(uint32_t iterations) {
+        passwordCost = max<uint32_t>(iterations, 1);
+    }
+
+    void logout(Session& session) { session.username.clear(); }
+
+    // Adds an edition with the given number of copies, all of them on the shelf
+    Outcome addBook(Session& session, const string& title, const string& author, const string& isbn, uint32_t copies = 1) {
+        return measured(OP_ADD_BOOK, [&] {
+            if (!session.isLoggedIn()) return Outcome::NotLoggedIn;
+            if (copies == 0) return Outcome::Invalid;
+            lock_guard<StripedSharedMutex> catalog(catalogLock);  // Adding a book reshapes the indexes
+            shared_lock<shared_mutex> users(userLock);            // The undo record goes to the user's history
+            lock_guard<mutex> history(historyLock);
+            if (applyAddBook(title, author, isbn, copies, copies, userTable.search(session.username)) == Outcome::Duplicate)
+                return Outcome::Duplicate;
+            string count = to_string(copies);
+            logOperation(WAL_ADD_BOOK, {title, author, isbn, count, count, session.username});
+            return Outcome::Done;
+        });
+    }
+
+    // Issue and return only change counters, queues and loan lists, so they share the
+    // catalog lock with lookups. The copy is lent to the session's user until the loan period
+    // is over. When no copy is on the shelf the user joins the book's hold queue instead
+    // (Outcome::Held, with the 1-based place in the queue in position).
+    Outcome issueBook(Session& session, const string& isbn, size_t* position = nullptr) {
+        return measured(OP_ISSUE, [&] {
+            if (!session.isLoggedIn()) return Outcome::NotLoggedIn;
+            ReadGuard catalog(catalogLock);
+            Book* book = findBook(isbn);
+            if (!book) return Outcome::NotFound;
+            {
+                shared_lock<shared_mutex> users(userLock);  // The loan links to the user's record
+                User* user = userTable.search(session.username);
+                if (!user) return Outcome::NotLoggedIn;
+                lock_guard<mutex> history(historyLock);
+                int64_t due = currentTime() + loanPeriod;
+                Outcome outcome = applyIssue(book, user, due);
+                if (outcome == Outcome::NotAvailable) {
+                    outcome = applyHold(book, user, position);
+                    if (outcome == Outcome::Held) logOperation(WAL_HOLD, {isbn, session.username});
+                }
+                if (outcome != Outcome::Done) return outcome;
+                logOperation(WAL_ISSUE_BOOK, {isbn, session.username, to_string(due)});
+            }
+            queueIssued(book);  // Lock-free; the shared catalog lock keeps the book alive
+            return Outcome::Done;
+        });
+    }
+
+    // Returns a copy and closes its loan; if readers are waiting, the copy is lent to the
+    // first of them and handedTo receives that reader's name
+    Outcome returnBook(Session& session, const string& isbn, string* handedTo = nullptr) {
+        return measured(OP_RETURN, [&] {
+            if (!session.isLoggedIn()) return Outcome::NotLoggedIn;
+            ReadGuard catalog(catalogLock);
+            Book* book = findBook(isbn);
+            if (!book) return Outcome::NotFound;
+            if (book->available.load(memory_order_relaxed) >= book->copies) return Outcome::NotIssued;
+            shared_lock<shared_mutex> users(userLock);
+            lock_guard<mutex> history(historyLock);
+            int64_t due = currentTime() + loanPeriod;
+            User* next = nullptr;
+            Outcome outcome = applyReturn(book, userTable.search(session.username), due, &next);
+            if (outcome == Outcome::Done) logOperation(WAL_RETURN_BOOK, {isbn, session.username, to_string(due)});
+            if (next && handedTo) *handedTo = next->username;
+            return outcome;
+        });
+    }
+
+    // Seconds from issue to due date for loans made from now on
+    void setLoanPeriod(int64_t seconds) {
+        lock_guard<mutex> history(historyLock);
+        loanPeriod = seconds;
+    }
+
+    // Actions kept in each user's undo history; a batch counts as one. Keep it the same
+    // across restarts: log replay must drop the same old actions as the live run did.
+    void setUndoDepth(size_t actions) {
+        lock_guard<mutex> history(historyLock);
+        undoDepth = max<size_t>(actions, 1);
+    }
+
+    // Books a user has out, oldest loan first; NotFound if there is no such user
+    Outcome loansOf(const string& username, vector<LoanInfo>& loans) {
+        ReadGuard catalog(catalogLock);
+        shared_lock<shared_mutex> users(userLock);
+        lock_guard<mutex> history(historyLock);
+        loans.clear();
+        const User* user = userTable.search(username);
+        if (!user) return Outcome::NotFound;
+        loans.reserve(user->loanCount);
+        for (const Loan* loan = user->loans; loan; loan = loan->userNext) loans.push_back(toInfo(loan));
+        return Outcome::Done;
+    }
+
+    // Overdue sweep (run nightly, or before listing overdue loans): moves every loan that fell
+    // due before now from the schedule to the overdue list and returns the newly overdue
+    // ones. Costs O(expired log n), not O(open loans).
+    vector<LoanInfo> sweepOverdue(int64_t now = currentTime()) {
+        ReadGuard catalog(catalogLock);
+        shared_lock<shared_mutex> users(userLock);
+        lock_guard<mutex> history(historyLock);
+        vector<LoanInfo> expired;
+        loanSchedule.sweep(now, [&](const Loan* loan) { expired.push_back(toInfo(loan)); });
+        return expired;
+    }
+
+    // Every loan found overdue by the sweeps so far and not yet returned
+    vector<LoanInfo> overdueLoans() {
+        ReadGuard catalog(catalogLock);
+        shared_lock<shared_mutex> users(userLock);
+        lock_guard<mutex> history(historyLock);
+        vector<LoanInfo> loans;
+        loans.reserve(loanSchedule.overdue().size());
+        for (const Loan* loan : loanSchedule.overdue()) loans.push_back(toInfo(loan));
+        return loans;
+    }
+
+    // Leaves the hold queue of a book; NotIssued if the reader was not waiting for it
+    Outcome cancelHold(Session& session, const string& isbn) {
+        if (!session.isLoggedIn()) return Outcome::NotLoggedIn;
+        ReadGuard catalog(catalogLock);
+        shared_lock<shared_mutex> users(userLock);
+        lock_guard<mutex> history(historyLock);
+        Outcome outcome = applyCancelHold(findBook(isbn), userTable.search(session.username));
+        if (outcome == Outcome::Done) logOperation(WAL_CANCEL_HOLD, {isbn, session.username});
+        return outcome;
+    }
+
+    // Ranked search of titles and authors by whole words, prefixes, substrings or words with
+    // a typo or two. Fills page with results [offset, offset + limit) and returns the number
+    // of matches.
+    size_t searchBooks(const string& query, size_t offset, size_t limit, vector<BookInfo>& page) {
+        return measured(OP_SEARCH, [&] {
+            ReadGuard catalog(catalogLock);
+            vector<const Book*> books;
+            size_t total = searchIndex.search(query, offset, limit, books);
+            page.clear();
+            for (const Book* book : books) page.push_back(toInfo(book));
+            return total;
+        });
+    }
+
+    // Batch circulation for self-checkout kiosks and return bins. All lookups are done first,
+    // with prefetching; the books that can be issued (or returned) are then changed in one
+    // commit step, so no other change lands in the middle of the batch, and a single undo
+    // reverts all of them. results[i] is the outcome for isbns[i]; nothing is printed.
+    vector<Outcome> issueBooks(Session& session, const vector<string>& isbns) {
+        return circulateBatch(session, isbns, true);
+    }
+
+    vector<Outcome> returnBooks(Session& session, const vector<string>& isbns) {
+        return circulateBatch(session, isbns, false);
+    }
+
+    // Undo the session user's last action; action receives its UndoAction code. Each user
+    // undoes only their own actions, and only while nobody else has changed the books since.
+    Outcome undo(Session& session, uint32_t* action = nullptr) {
+        return measured(OP_UNDO, [&] { return stepHistory(session, true, action); });
+    }
+
+    // Redo the session user's last undone action
+    Outcome redo(Session& session, uint32_t* action = nullptr) {
+        return measured(OP_REDO, [&] { return stepHistory(session, false, action); });
+    }
+
+    bool findByIsbn(const string& isbn, BookInfo& info) {
+        return measured(OP_FIND_ISBN, [&] {
+            ReadGuard catalog(catalogLock);
+            const Book* book = findBook(isbn);
+            if (!book) return false;
+            info = toInfo(book);
+            return true;
+        });
+    }
+
+    // Every edition with the given title
+    vector<BookInfo> findByTitle(const string& title) {
+        return measured(OP_FIND_TITLE, [&] {
+            ReadGuard catalog(catalogLock);
+            vector<vector<Book*>> found(shards.size());
+            forEachShard([&](size_t s) { found[s] = shards[s]->titleIndex.search(title); });  // Range scan over each title index
+            vector<const Book*> books;
+            for (const vector<Book*>& part : found) books.insert(books.end(), part.begin(), part.end());
+            if (shards.size() > 1) sort(books.begin(), books.end(), titleOrder);
+            vector<BookInfo> results;
+            results.reserve(books.size());
+            for (const Book* book : books) results.push_back(toInfo(book));
+            return results;
+        });
+    }
+
+    // Import a CSV or TSV catalog (tab-separated if the file ends in .tsv). Columns are
+    // title, author, isbn, then optionally availability (a yes/no flag or the number of
+    // copies on the shelf) and the number of copies owned, or are matched by name when the
+    // first row is a header. Books are indexed in bulk: no undo records, no per-book output.
+    // Like adding a book, importing needs a logged-in session.
+    ImportSummary importCatalog(Session& session, const string& path) {
+        ImportSummary summary;
+        if (!session.isLoggedIn()) {
+            summary.outcome = Outcome::NotLoggedIn;
+            return summary;
+        }
+        ExclusiveLock exclusive(*this);
+        auto started = chrono::steady_clock::now();
+        CatalogReader reader(path);
+        if (!reader.isOpen()) {
+            summary.outcome = Outcome::CannotOpen;
+            return summary;
+        }
+
+        size_t titleColumn = 0, authorColumn = 1, isbnColumn = 2, availableColumn = 3, copiesColumn = 4;
+        vector<string_view> fields;
+        vector<Book*> added;
+        size_t& malformed = summary.malformed;
+        size_t& duplicates = summary.duplicates;
+        for (bool firstRow = true; reader.next(fields); firstRow = false) {
+            if (firstRow) { // A header row names the columns
+                bool header = false;
+                for (size_t i = 0; i < fields.size(); ++i) {
+                    if (isColumn(fields[i], "title")) titleColumn = i, header = true;
+                    else if (isColumn(fields[i], "author")) authorColumn = i, header = true;
+                    else if (isColumn(fields[i], "isbn")) isbnColumn = i, header = true;
+                    else if (isColumn(fields[i], "available")) availableColumn = i, header = true;
+                    else if (isColumn(fields[i], "copies")) copiesColumn = i, header = true;
+                }
+                if (header) continue;
+            }
+            if (fields.size() <= max(titleColumn, max(authorColumn, isbnColumn)) || fields[isbnColumn].empty()) {
+                ++malformed;
+                continue;
+            }
+            uint32_t copies = copiesColumn < fields.size() ? max<uint32_t>(parseCount(fields[copiesColumn]), 1) : 1;
+            uint32_t available = copies;
+            if (availableColumn < fields.size()) {
+                string_view field = fields[availableColumn];
+                bool numeric = !field.empty() && field.find_first_not_of("0123456789") == string_view::npos;
+                available = numeric ? parseCount(field) : parseAvailability(field) ? copies : 0;
+            }
+            added.push_back(bookPool.create(string(fields[titleColumn]), string(fields[authorColumn]),
+                                            string(fields[isbnColumn]), copies, available));
+        }
+
+        // ISBN indexes: one resize per shard up front, then plain inserts that also weed out duplicates
+        vector<size_t> shardSizes(shards.size());
+        for (Book* book : added) ++shardSizes[shardIndex(book->isbn)];
+        for (size_t s = 0; s < shards.size(); ++s) shards[s]->isbnTable.reserve(shards[s]->isbnTable.size() + shardSizes[s]);
+        size_t kept = 0;
+        for (Book* book : added) {
+            if (shardOf(book->isbn).isbnTable.insert(book->isbn, book)) added[kept++] = book;
+            else {
+                bookPool.destroy(book);
+                ++duplicates;
+            }
+        }
+        added.resize(kept);
+        for (Book* book : added) searchIndex.add(book);
+
+        // Title indexes: sort each shard's new books, merge them with its existing ones and
+        // rebuild the tree bottom-up
+        vector<vector<Book*>> parts(shards.size());
+        for (Book* book : added) parts[shardIndex(book->isbn)].push_back(book);
+        forEachShard([&](size_t s) {
+            TitleIndex& index = shards[s]->titleIndex;
+            vector<Book*>& part = parts[s];
+            sortByTitle(part);
+            if (!index.isEmpty()) {
+                vector<Book*> existing;
+                existing.reserve(index.size());
+                index.forEach([&existing](const Book* book) { existing.push_back(const_cast<Book*>(book)); });
+                vector<Book*> merged(existing.size() + part.size());
+                std::merge(existing.begin(), existing.end(), part.begin(), part.end(), merged.begin(), titleOrder);
+                part.swap(merged);
+            }
+            index.bulkLoad(part);
+        });
+        if (wal.isOpen() && kept) checkpointLocked();  // Persist the import as a snapshot instead of logging every row
+
+        summary.imported = kept;
+        summary.milliseconds = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+        return summary;
+    }
+
+    // Open persistent storage: load the snapshot if there is one, replay the log records
+    // written after it, and log every further mutation
+    StorageSummary openStorage(const string& snapshotFile, const string& logFile) {
+        ExclusiveLock exclusive(*this);
+        snapshotPath = snapshotFile;
+        logPath = logFile;
+        StorageSummary summary;
+        if (FILE* existing = fopen(snapshotPath.c_str(), "rb")) {
+            fclose(existing);
+            if (readSnapshot(snapshotPath, summary) != Outcome::Done) return summary;
+        }
+        summary.replayed = WriteAheadLog::replay(logPath, appliedSequence,
+            [this](uint64_t sequence, uint8_t op, const vector<string_view>& fields) {
+                replayOperation(op, fields);
+                appliedSequence = sequence;
+            });
+        if (!wal.open(logPath, appliedSequence + 1)) {
+            summary.outcome = Outcome::CannotOpen;
+            summary.path = logPath;
+        }
+        return summary;
+    }
+
+    // Compaction: fold everything logged so far into a new snapshot and start an empty log
+    bool checkpoint() {
+        ExclusiveLock exclusive(*this);
+        return checkpointLocked();
+    }
+
+    // Drop every book, user, issued entry and undo record
+    void clear() {
+        ExclusiveLock exclusive(*this);
+        clearState();
+    }
+
+    // Write the whole library state to a snapshot file
+    Outcome saveSnapshot(const string& path) {
+        ExclusiveLock exclusive(*this);
+        return writeSnapshot(path) ? Outcome::Done : Outcome::CannotOpen;
+    }
+
+    // Replace the library state with a snapshot file
+    StorageSummary loadSnapshot(const string& path) {
+        ExclusiveLock exclusive(*this);
+        StorageSummary summary;
+        readSnapshot(path, summary);
+        return summary;
+    }
+
+    // One page of the catalog in title order: up to limit books that sort after the cursor and
+    // pass the filter, which is applied as the leaves are scanned. Sets next to the key to
+    // resume from and more to false once the scan has reached the end of the catalog; a limit
+    // of 0 is Invalid. The read lock is dropped every SCAN_WINDOW books, so a filter that
+    // matches little cannot hold off writers for the length of the whole catalog.
+    // Every shard is scanned from the cursor (in parallel when there are several) and the
+    // matches are merged. A shard that stopped early bounds the page: past the last book it
+    // scanned, some of its matches could still be missing.
+    Outcome listPage(const ListCursor& after, size_t limit, const ListFilter& filter, vector<BookInfo>& page,
+                     ListCursor& next, bool& more) {
+        static const size_t SCAN_WINDOW = 4096;  // Books per shard
+        struct ShardScan {
+            vector<const Book*> matches;  // In title order
+            const Book* last = nullptr;   // Last book scanned
+            bool exhausted = false;       // The scan reached the end of the shard
+        };
+        vector<ShardScan> scans(shards.size());
+        vector<const Book*> matches;
+        page.clear();
+        next = after;
+        more = false;
+        if (limit == 0) return Outcome::Invalid;
+        for (;;) {
+            ReadGuard catalog(catalogLock);
+            size_t wanted = limit - page.size();
+            forEachShard([&](size_t s) {
+                ShardScan& scan = scans[s];
+                const TitleIndex& index = shards[s]->titleIndex;
+                TitleIndex::Cursor cursor = next.atStart() ? index.begin() : index.upperBound(next.title, next.isbn);
+                scan.matches.clear();
+                scan.last = nullptr;
+                for (size_t scanned = 0; cursor.isValid() && scan.matches.size() < wanted && scanned < SCAN_WINDOW; ++scanned) {
+                    scan.last = cursor.book();
+                    if (filter.accepts(scan.last)) scan.matches.push_back(scan.last);
+                    cursor.next();
+                }
+                scan.exhausted = !cursor.isValid();
+            });
+            const Book* bound = nullptr;     // Earliest stopping point of a shard with more books
+            const Book* furthest = nullptr;  // Last book scanned in any shard
+            matches.clear();
+            for (const ShardScan& scan : scans) {
+                if (!scan.exhausted && (!bound || titleOrder(scan.last, bound))) bound = scan.last;
+                if (scan.last && (!furthest || titleOrder(furthest, scan.last))) furthest = scan.last;
+                matches.insert(matches.end(), scan.matches.begin(), scan.matches.end());
+            }
+            if (shards.size() > 1) sort(matches.begin(), matches.end(), titleOrder);
+            size_t taken = 0;
+            for (; taken < matches.size() && taken < wanted && (!bound || !titleOrder(bound, matches[taken])); ++taken)
+                page.push_back(toInfo(matches[taken]));
+            if (page.size() == limit) {
+                const Book* last = matches[taken - 1];
+                next = {last->title, last->isbn};
+                more = bound || titleOrder(last, furthest);
+                return Outcome::Done;
+            }
+            if (!bound) {  // Every shard is done
+                if (furthest) next = {furthest->title, furthest->isbn};
+                return Outcome::Done;
+            }
+            next = {bound->title, bound->isbn};
+        }
+    }
+
+    // Streams the catalog in title order, calling onChunk with up to chunkSize books at a
+    // time. Each chunk is copied under the read lock and handed over after releasing it, so
+    // rendering a long listing never blocks writers.
+    template <typename OnChunk>
+    size_t listBooks(size_t chunkSize, const ListFilter& filter, OnChunk onChunk) {
+        vector<BookInfo> chunk;
+        chunk.reserve(chunkSize);
+        ListCursor cursor;
+        size_t listed = 0;
+        for (bool more = true; more;) {
+            listPage(cursor, chunkSize, filter, chunk, cursor, more);
+            listed += chunk.size();
+            if (!chunk.empty()) onChunk(chunk);
+        }
+        return listed;
+    }
+
+    size_t bookCount() {
+        ReadGuard catalog(catalogLock);
+        return catalogSize();
+    }
+
+    MemoryStats memoryStats() {
+        ReadGuard catalog(catalogLock);
+        shared_lock<shared_mutex> users(userLock);
+        lock_guard<mutex> history(historyLock);
+        size_t undoRecords = 0, undoBytes = 0;
+        userTable.forEach([&](const User* user) {
+            undoRecords += user->history.size();
+            undoBytes += user->history.memoryUsed();
+        });
+        size_t titleNodes = 0, titleChunks = 0, isbnEntries = 0;
+        for (const auto& shard : shards) {
+            titleNodes += shard->titleIndex.nodeCount();
+            titleChunks += shard->titleIndex.chunkCount();
+            isbnEntries += shard->isbnTable.size();
+        }
+        return {bookPool.size(), bookPool.chunkCount(), titleNodes, titleChunks, isbnEntries, issueQueue.size(), issueQueue.capacity(), undoRecords, undoBytes,
+                searchIndex.termCount(), searchIndex.postingsSize()};
+    }
+
+    // Stats dump in the Prometheus text format: operation counts by outcome and latency
+    // quantiles (merged over every thread of the process), then gauges read from the indexes.
+    // The probe lengths come from a scan of the ISBN table, so the dump is O(books).
+    string metricsText() {
+        unique_ptr<ThreadMetrics> total(new ThreadMetrics);
+        MetricsRegistry::instance().merge(*total);
+        string text;
+        char line[256];
+        auto family = [&](const char* name, const char* type, const char* help) {
+            snprintf(line, sizeof line, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+            text += line;
+        };
+        family("lms_operations_total", "counter", "Library API calls by operation and outcome.");
+        for (int op = 0; op < OP_COUNT; ++op)
+            for (int o = 0; o < OUTCOME_COUNT; ++o) {
+                uint64_t count = total->outcomes[op][o].load(memory_order_relaxed);
+                if (!count) continue;
+                snprintf(line, sizeof line, "lms_operations_total{op=\"%s\",outcome=\"%s\"} %llu\n", metricOpName(op),
+                         outcomeLabel(static_cast<Outcome>(o)), static_cast<unsigned long long>(count));
+                text += line;
+            }
+        family("lms_operation_duration_seconds", "summary", "Latency of Library API calls.");
+        for (int op = 0; op < OP_COUNT; ++op) {
+            const LatencyHistogram& latency = total->latency[op];
+            bool empty = latency.count() == 0;
+            for (double q : {0.5, 0.9, 0.99, 0.999}) {
+                snprintf(line, sizeof line, "lms_operation_duration_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n",
+                         metricOpName(op), q, empty ? NAN : latency.quantile(q) * 1e-9);
+                text += line;
+            }
+            snprintf(line, sizeof line,
+                     "lms_operation_duration_seconds_sum{op=\"%s\"} %.9f\nlms_operation_duration_seconds_count{op=\"%s\"} %llu\n",
+                     metricOpName(op), latency.sumNanos() * 1e-9, metricOpName(op),
+                     static_cast<unsigned long long>(latency.count()));
+            text += line;
+        }
+
+        ReadGuard catalog(catalogLock);
+        shared_lock<shared_mutex> users(userLock);
+        lock_guard<mutex> history(historyLock);
+        HashTable::ProbeStats probes;
+        int height = 0;
+        for (const auto& shard : shards) {
+            HashTable::ProbeStats part = shard->isbnTable.probeStats();
+            probes.books += part.books;
+            probes.totalDistance += part.totalDistance;
+            probes.longest = max(probes.longest, part.longest);
+            height = max(height, shard->titleIndex.height());
+        }
+        size_t undoRecords = 0;
+        userTable.forEach([&](const User* user) { undoRecords += user->history.size(); });
+        auto gauge = [&](const char* name, const char* help, double value) {
+            family(name, "gauge", help);
+            snprintf(line, sizeof line, "%s %.9g\n", name, value);
+            text += line;
+        };
+        gauge("lms_books", "Editions in the catalog.", double(catalogSize()));
+        gauge("lms_catalog_shards", "Shards the catalog is split into.", double(shards.size()));
+        gauge("lms_isbn_probe_length_mean", "Mean probe length of the ISBN table (0 = home slot).",
+              probes.books ? double(probes.totalDistance) / probes.books : 0.0);
+        gauge("lms_isbn_probe_length_max", "Longest probe length of the ISBN table.", double(probes.longest));
+        gauge("lms_title_index_height", "Levels of the tallest title B+ tree.", height);
+        gauge("lms_issue_queue_depth", "Entries in the issue queue.", double(issueQueue.size()));
+        gauge("lms_holds", "Readers waiting in hold queues.", double(holdPool.size()));
+        gauge("lms_loans", "Open loans.", double(loanPool.size()));
+        gauge("lms_undo_records", "Records in all undo histories.", double(undoRecords));
+        return text;
+    }
+
+    // Writes metricsText() to path through a temporary file, so a collector reading the file
+    // never sees half a dump
+    bool writeMetrics(const string& path) {
+        string text = metricsText();
+        string tempPath = path + ".tmp";
+        FILE* file = fopen(tempPath.c_str(), "wb");
+        if (!file) return false;
+        bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+        ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+        if (ok) remove(path.c_str());  // rename() does not replace an existing file on Windows
+#endif
+        ok = ok && rename(tempPath.c_str(), path.c_str()) == 0;
+        if (!ok) remove(tempPath.c_str());
+        return ok;
+    }
+};
+
+#endif // LIBRARY_H
@@ -0,0 +1,80 @@
+// Undo and redo of added books against the search index: redo puts a book back under its old
+// id instead of indexing it again, and the dead ids of removed books are compacted away.
+#include <cstdio>
+
+#include "library.h"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++failures;                                                        \
+        }                                                                      \
+    } while (0)
+
+size_t matches(Library& library, const string& query) {
+    vector<BookInfo> page;
+    return library.searchBooks(query, 0, 10, page);
+}
+
+// Many undo/redo cycles of one addition leave the index the size it was
+void testUndoRedoCycles() {
+    Library library;
+    library.setPasswordCost(10);
+    Session session;
+    library.signUp("alice", "secret");
+    library.login(session, "alice", "secret");
+    library.addBook(session, "Dune", "Frank Herbert", "111");
+    library.addBook(session, "Emma", "Jane Austen", "222");
+    MemoryStats before = library.memoryStats();
+    for (int i = 0; i < 1000; ++i) {
+        CHECK(library.undo(session) == Outcome::Done);
+        CHECK(matches(library, "emma") == 0);
+        CHECK(library.redo(session) == Outcome::Done);
+        CHECK(matches(library, "emma") == 1);
+    }
+    MemoryStats after = library.memoryStats();
+    CHECK(after.searchPostings == before.searchPostings);
+    CHECK(after.searchTerms == before.searchTerms);
+    CHECK(matches(library, "dune") == 1);
+}
+
+// Undoing most of the catalog compacts the index; the books still come back on redo, and
+// books that fall out of the undo history are freed without being restored
+void testCompaction() {
+    const int BOOKS = 3000, UNDONE = 2500;
+    Library library;
+    library.setPasswordCost(10);
+    library.setUndoDepth(BOOKS);
+    Session session;
+    library.signUp("alice", "secret");
+    library.login(session, "alice", "secret");
+    for (int i = 0; i < BOOKS; ++i)
+        library.addBook(session, "Volume " + to_string(i), "Author", to_string(1000000 + i));
+    MemoryStats full = library.memoryStats();
+    for (int i = 0; i < UNDONE; ++i) CHECK(library.undo(session) == Outcome::Done);
+    CHECK(library.memoryStats().searchPostings < full.searchPostings);  // Dead ids were dropped
+    CHECK(matches(library, "volume") == BOOKS - UNDONE);
+    for (int i = 0; i < UNDONE; ++i) CHECK(library.redo(session) == Outcome::Done);
+    CHECK(matches(library, "volume") == BOOKS);
+    CHECK(matches(library, "2999") == 1);
+    CHECK(library.memoryStats().searchPostings == full.searchPostings);
+
+    // Undo again, then discard the redo history with new additions, freeing the undone books
+    for (int i = 0; i < 100; ++i) CHECK(library.undo(session) == Outcome::Done);
+    for (int i = 0; i < 10; ++i) library.addBook(session, "Atlas " + to_string(i), "Author", to_string(2000000 + i));
+    CHECK(matches(library, "volume") == BOOKS - 100);
+    CHECK(matches(library, "atlas") == 10);
+}
+
+int main() {
+    testUndoRedoCycles();
+    testCompaction();
+    if (failures) return 1;
+    puts("search_index_test: ok");
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Per-user undo and redo histories: the depth counts actions, so a batch larger than the
+// depth is still one undoable action; the ring wraps around and grows without losing
+// groups; and a group another reader has built on since conflicts instead of being undone.
+#include <cstdio>
+
+#include "library.h"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++failures;                                                        \
+        }                                                                      \
+    } while (0)
+
+// Copies of the book on the shelf, or -1 if it is not in the catalog
+long onShelf(Library& library, const string& isbn) {
+    BookInfo info;
+    return library.findByIsbn(isbn, info) ? long(info.available) : -1;
+}
+
+vector<string> isbns(int first, int count) {
+    vector<string> list;
+    for (int i = first; i < first + count; ++i) list.push_back(to_string(1000000 + i));
+    return list;
+}
+
+void login(Library& library, Session& session, const string& username) {
+    CHECK(library.signUp(username, "secret") == Outcome::Done);
+    CHECK(library.login(session, username, "secret") == Outcome::Done);
+}
+
+bool allDone(const vector<Outcome>& results) {
+    for (Outcome outcome : results)
+        if (outcome != Outcome::Done) return false;
+    return true;
+}
+
+// A batch of 150 issues with the default depth of 100 is undone and redone as one action,
+// and only the oldest whole actions make room for it
+void testBatchLargerThanDepth() {
+    Library library;
+    library.setPasswordCost(10);
+    Session alice;
+    login(library, alice, "alice");
+    vector<string> books = isbns(0, 150);
+    for (const string& isbn : books) CHECK(library.addBook(alice, "Title " + isbn, "Author", isbn) == Outcome::Done);
+    CHECK(allDone(library.issueBooks(alice, books)));
+    uint32_t action = 0;
+    CHECK(library.undo(alice, &action) == Outcome::Done);
+    CHECK(action == UNDO_BATCH);
+    for (const string& isbn : books) CHECK(onShelf(library, isbn) == 1);
+    for (int i = 0; i < 99; ++i) CHECK(library.undo(alice) == Outcome::Done);  // The 99 newest additions
+    CHECK(library.undo(alice) == Outcome::NothingToUndo);
+    CHECK(library.bookCount() == 51);
+    for (int i = 0; i < 100; ++i) CHECK(library.redo(alice) == Outcome::Done);
+    CHECK(library.redo(alice) == Outcome::NothingToRedo);
+    CHECK(library.bookCount() == 150);
+    for (const string& isbn : books) CHECK(onShelf(library, isbn) == 0);
+
+    // Depth 1: a new batch drops the previous one whole
+    library.setUndoDepth(1);
+    CHECK(allDone(library.returnBooks(alice, books)));
+    CHECK(library.undo(alice) == Outcome::Done);
+    CHECK(library.undo(alice) == Outcome::NothingToUndo);
+}
+
+// Many more actions than the depth, with batches of different sizes, so the ring wraps
+// around and grows while it holds a wrapped history
+void testWraparound() {
+    const int DEPTH = 4;
+    Library library;
+    library.setPasswordCost(10);
+    library.setUndoDepth(DEPTH);
+    Session alice;
+    login(library, alice, "alice");
+    vector<string> books = isbns(0, 40);
+    for (const string& isbn : books) CHECK(library.addBook(alice, "Title " + isbn, "Author", isbn) == Outcome::Done);
+    for (int round = 0; round < 30; ++round) {
+        vector<string> batch = isbns((round * 7) % 30, 1 + round % 9);
+        CHECK(allDone(library.issueBooks(alice, batch)));
+        CHECK(allDone(library.returnBooks(alice, batch)));
+        if (round % 3 == 0) CHECK(library.issueBook(alice, batch[0]) == Outcome::Done &&
+                                  library.returnBook(alice, batch[0]) == Outcome::Done);
+    }
+    // The newest action is the return of the last batch, then its issue
+    vector<string> last = isbns(3, 8);
+    CHECK(allDone(library.issueBooks(alice, last)));
+    CHECK(allDone(library.returnBooks(alice, last)));
+    CHECK(library.undo(alice) == Outcome::Done);
+    for (const string& isbn : last) CHECK(onShelf(library, isbn) == 0);
+    CHECK(library.undo(alice) == Outcome::Done);
+    for (const string& isbn : last) CHECK(onShelf(library, isbn) == 1);
+    for (int i = 2; i < DEPTH; ++i) CHECK(library.undo(alice) == Outcome::Done);
+    CHECK(library.undo(alice) == Outcome::NothingToUndo);
+    for (int i = 0; i < DEPTH; ++i) CHECK(library.redo(alice) == Outcome::Done);
+    CHECK(library.redo(alice) == Outcome::NothingToRedo);
+    for (const string& isbn : books) CHECK(onShelf(library, isbn) == 1);
+}
+
+// A batch another reader changed one book of since conflicts and is dropped as a whole,
+// on undo and on redo
+void testConflict() {
+    Library library;
+    library.setPasswordCost(10);
+    library.setUndoDepth(3);
+    Session alice, bob;
+    login(library, alice, "alice");
+    login(library, bob, "bob");
+    vector<string> books = isbns(0, 10);
+    for (const string& isbn : books) CHECK(library.addBook(alice, "Title " + isbn, "Author", isbn, 2) == Outcome::Done);
+    CHECK(allDone(library.issueBooks(alice, books)));
+    CHECK(library.issueBook(bob, books[5]) == Outcome::Done);
+    CHECK(library.undo(alice) == Outcome::Conflict);
+    for (const string& isbn : books) CHECK(onShelf(library, isbn) == (isbn == books[5] ? 0 : 1));  // Nothing was undone
+    CHECK(library.redo(alice) == Outcome::NothingToRedo);  // The batch is gone, not redoable
+
+    CHECK(allDone(library.returnBooks(alice, books)));
+    CHECK(library.undo(alice) == Outcome::Done);
+    CHECK(library.returnBook(bob, books[5]) == Outcome::Done);
+    CHECK(library.redo(alice) == Outcome::Conflict);
+    CHECK(library.redo(alice) == Outcome::NothingToRedo);
+    CHECK(onShelf(library, books[0]) == 1);
+    CHECK(onShelf(library, books[5]) == 1);
+}
+
+int main() {
+    testBatchLargerThanDepth();
+    testWraparound();
+    testConflict();
+    if (failures) return 1;
+    puts("undo_history_test: ok");
+    return 0;
+}
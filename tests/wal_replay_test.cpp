@@ -0,0 +1,128 @@
+// Round trip through the write-ahead log: a library that was changed after opening its
+// storage is started again from the log alone, and again from a checkpoint plus the log,
+// and must come back exactly as it was left.
+#include <cstdio>
+
+#include "library.h"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++failures;                                                        \
+        }                                                                      \
+    } while (0)
+
+const char* SNAPSHOT_FILE = "wal_replay_test.snapshot";
+const char* LOG_FILE = "wal_replay_test.wal";
+const int64_t LOAN_PERIOD = 7 * 86400;
+
+void configure(Library& library) {
+    library.setPasswordCost(10);
+    library.setLoanPeriod(LOAN_PERIOD);
+}
+
+// Everything replay has to restore, as text: every book with its shelf count and holds, then
+// every reader's loans with their due dates
+string state(Library& library, const vector<string>& readers) {
+    string text;
+    library.listBooks(100, ListFilter(), [&](const vector<BookInfo>& chunk) {
+        for (const BookInfo& book : chunk)
+            text += book.title + "|" + book.isbn + "|" + to_string(book.copies) + "|" + to_string(book.available) + "|" +
+                    to_string(book.holds) + "\n";
+    });
+    for (const string& reader : readers) {
+        vector<LoanInfo> loans;
+        CHECK(library.loansOf(reader, loans) == Outcome::Done);
+        for (const LoanInfo& loan : loans) text += reader + ":" + loan.isbn + "@" + to_string(loan.due) + "\n";
+    }
+    return text;
+}
+
+// Each kind of logged change: registrations, additions, single and batch issues and returns,
+// holds with a hand-off, a cancelled hold, undo and redo
+void changeLibrary(Library& library, Session& alice, Session& bob) {
+    CHECK(library.signUp("alice", "secret") == Outcome::Done);
+    CHECK(library.signUp("bob", "hunter2") == Outcome::Done);
+    CHECK(library.login(alice, "alice", "secret") == Outcome::Done);
+    CHECK(library.login(bob, "bob", "hunter2") == Outcome::Done);
+    CHECK(library.addBook(alice, "Dune", "Frank Herbert", "111") == Outcome::Done);
+    CHECK(library.addBook(alice, "Emma", "Jane Austen", "222", 2) == Outcome::Done);
+    CHECK(library.addBook(bob, "Ulysses", "James Joyce", "333") == Outcome::Done);
+    CHECK(library.addBook(bob, "Walden", "Henry Thoreau", "444") == Outcome::Done);
+    CHECK(library.issueBook(alice, "111") == Outcome::Done);
+    vector<Outcome> issued = library.issueBooks(alice, {"222", "333", "444"});
+    CHECK(issued.size() == 3 && issued[0] == Outcome::Done && issued[1] == Outcome::Done && issued[2] == Outcome::Done);
+    CHECK(library.issueBook(bob, "333") == Outcome::Held);
+    CHECK(library.issueBook(bob, "444") == Outcome::Held);
+    CHECK(library.cancelHold(bob, "444") == Outcome::Done);
+    string handedTo;
+    CHECK(library.returnBook(alice, "333", &handedTo) == Outcome::Done);
+    CHECK(handedTo == "bob");
+    vector<Outcome> returned = library.returnBooks(alice, {"111", "444"});
+    CHECK(returned.size() == 2 && returned[0] == Outcome::Done && returned[1] == Outcome::Done);
+    CHECK(library.undo(alice) == Outcome::Done);  // The batch return
+    CHECK(library.undo(alice) == Outcome::Done);  // The hand-off to bob
+    CHECK(library.redo(alice) == Outcome::Done);
+    CHECK(library.issueBook(bob, "222") == Outcome::Done);
+}
+
+void testRoundTrip() {
+    vector<string> readers = {"alice", "bob"};
+    string expected;
+    {
+        Library library;
+        configure(library);
+        CHECK(library.openStorage(SNAPSHOT_FILE, LOG_FILE).outcome == Outcome::Done);
+        Session alice, bob;
+        changeLibrary(library, alice, bob);
+        expected = state(library, readers);
+    }
+
+    // Started from the log alone
+    {
+        Library library;
+        configure(library);
+        StorageSummary summary = library.openStorage(SNAPSHOT_FILE, LOG_FILE);
+        CHECK(summary.outcome == Outcome::Done);
+        CHECK(summary.replayed > 0);
+        CHECK(state(library, readers) == expected);
+
+        // The undo histories came back too: alice can still undo her redone hand-off
+        Session alice;
+        CHECK(library.login(alice, "alice", "secret") == Outcome::Done);
+        CHECK(library.undo(alice) == Outcome::Done);
+        CHECK(library.redo(alice) == Outcome::Done);
+        CHECK(library.checkpoint());
+        Session bob;
+        CHECK(library.login(bob, "bob", "hunter2") == Outcome::Done);
+        CHECK(library.returnBook(bob, "333") == Outcome::Done);  // Logged after the checkpoint
+        expected = state(library, readers);
+    }
+
+    // Started from the checkpoint plus the records logged after it
+    {
+        Library library;
+        configure(library);
+        StorageSummary summary = library.openStorage(SNAPSHOT_FILE, LOG_FILE);
+        CHECK(summary.outcome == Outcome::Done);
+        CHECK(summary.books == 4);
+        CHECK(summary.replayed == 1);
+        CHECK(state(library, readers) == expected);
+    }
+}
+
+int main() {
+    remove(SNAPSHOT_FILE);
+    remove(LOG_FILE);
+    testRoundTrip();
+    remove(SNAPSHOT_FILE);
+    remove(LOG_FILE);
+    if (failures) return 1;
+    puts("wal_replay_test: ok");
+    return 0;
+}